@@ -0,0 +1,211 @@
+/*
+ * autotune.c
+ *
+ * This module picks the branching factor and leaf size of the bounding box
+ * hierarchy for a scene. A few candidate shapes are built in turn, and a
+ * sample of primary and shadow rays is traced through each. The shape with
+ * the lowest estimated time for the whole picture, build included, is kept.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "rt.h"
+#include "externs.h"
+
+#define TUNE_GRID	64	/* sample rays across and down	 */
+
+/*
+ * The candidate shapes, as branching factor and leaf size.
+ */
+
+static int      candidates[][2] = {
+    {2, 2}, {2, 4}, {4, 4}, {4, 8}, {8, 4}, {8, 8}, {16, 16}
+};
+
+#define NUM_CANDIDATES	(sizeof(candidates) / sizeof(candidates[0]))
+
+/*
+ * Sample_rays()
+ *
+ * Trace a grid of primary rays over the picture, and a shadow ray to every
+ * light which can reach each hit, and return the processor time it took.
+ * The view is set up the same way Raytrace() does it, without changing it.
+ */
+
+static double Sample_rays()
+{
+    VECTOR          dir, hor, ver, ip, l_dir;
+    RAY             ray, sray;
+    INTERSECT       inter;
+    LIGHT_WALK      lw;
+    double          angle, xr, yr;
+    clock_t         start;
+    int             x, y, l;
+
+    VecSub(view.look_at, view.from, dir);
+    VecNormalize(&dir);
+    VecCopy(view.up, ver);
+    VecNormalize(&ver);
+    VecCross(ver, dir, hor);
+    VecNormalize(&hor);
+    VecCross(dir, hor, ver);
+    VecNormalize(&ver);
+
+    angle = tan(view.angle * M_PI / 180) / sqrt(2.0);
+
+    start = clock();
+
+    for (y = 0; y < TUNE_GRID; y++)
+    {
+	yr = 1 - 2.0 * (y + 0.5) / TUNE_GRID;
+
+	for (x = 0; x < TUNE_GRID; x++)
+	{
+	    xr = 1 - 2.0 * (x + 0.5) / TUNE_GRID;
+
+	    VecCopy(view.from, ray.pos);
+	    VecComb(xr * angle, hor, yr * angle, ver, ray.dir);
+	    VecAdd(ray.dir, dir, ray.dir);
+	    VecNormalize(&ray.dir);
+
+	    if (!Intersect(&ray, &inter) || !shadow)
+		continue;
+
+	    VecAddS(inter.t, ray.dir, ray.pos, ip);
+
+	    Start_lights(&lw, &ip);
+	    while ((l = Next_light(&lw)) >= 0)
+	    {
+		VecSub(lights[l]->pos, ip, l_dir);
+		VecNormalize(&l_dir);
+
+		sray.pos = ip;
+		sray.dir = l_dir;
+		Intersect(&sray, &inter);
+	    }
+	}
+    }
+
+    return ((double) (clock() - start) / CLOCKS_PER_SEC);
+}
+
+/*
+ * Free_tree()
+ *
+ * Throw away the composites built over the first 'nprims' objects, and put
+ * the objects back in the given order.
+ */
+
+static void Free_tree(OBJECT **order, int nprims)
+{
+    int             i;
+
+    for (i = nprims; i < nobjects; i++)
+    {
+	free(objects[i]->obj);
+	free(objects[i]);
+    }
+
+    nobjects = nprims;
+    memcpy(objects, order, sizeof(OBJECT *) * nprims);
+}
+
+/*
+ * Autotune()
+ *
+ * Set branch_factor and leaf_size to the best of the candidates for the
+ * objects just read in. The objects are left as they were, with no
+ * hierarchy, ready for the real build.
+ */
+
+void Autotune()
+{
+    OBJECT        **order;
+    char           *save_cache;
+    double          build, trace, est, best_est = 0.0;
+    double          rays;
+    clock_t         start;
+    int             nprims, best = 0, i;
+
+    nprims = nobjects;
+
+    if ((order = (OBJECT **) malloc(sizeof(OBJECT *) * nprims)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+    memcpy(order, objects, sizeof(OBJECT *) * nprims);
+
+    /*
+     * The candidates are always built, never loaded from or saved to the
+     * cache file.
+     */
+
+    save_cache = bvh_cache;
+    bvh_cache = NULL;
+
+    rays = (double) view.x_res * view.y_res *
+	(sample_cnt == 1 ? 1 : sample_cnt - 1);
+
+    for (i = 0; i < NUM_CANDIDATES; i++)
+    {
+	branch_factor = candidates[i][0];
+	leaf_size = candidates[i][1];
+
+	start = clock();
+	Build_hierarchy();
+	Pack_sphere_leaves();
+	if (use_qbvh)
+	    Build_qbvh();
+	if (use_stackless)
+	    Build_skip_tree();
+	build = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+	/* the faster of two runs, to get past a cold cache */
+	trace = Sample_rays();
+	trace = MIN(trace, Sample_rays());
+
+	est = build + trace * rays / (TUNE_GRID * TUNE_GRID);
+
+	if (verbose)
+	{
+	    fprintf(stderr, "%s: autotune: branching %d, leaves of %d: "
+		    "build %.3fs, sample %.3fs, estimate %.1fs\n",
+		    my_name, branch_factor, leaf_size, build, trace, est);
+	}
+
+	if (i == 0 || est < best_est)
+	{
+	    best = i;
+	    best_est = est;
+	}
+
+	Free_tree(order, nprims);
+    }
+
+    branch_factor = candidates[best][0];
+    leaf_size = candidates[best][1];
+    bvh_cache = save_cache;
+    free(order);
+
+    if (verbose)
+    {
+	fprintf(stderr, "%s: autotune: using branching %d, leaves of %d\n",
+		my_name, branch_factor, leaf_size);
+    }
+}
@@ -0,0 +1,267 @@
+/*
+ * batch.c
+ *
+ * This module traces the rays of a tile of the picture in batches, instead of
+ * following each reflection and refraction down as soon as it is made. The
+ * primary rays of the tile are traced first, in scan order. The reflected and
+ * refracted rays they make are put in a queue, and when they are all in, the
+ * queue is sorted by the octant of the rays' directions and then by where
+ * they start, and traced in that order. Those make the next queue, and so on
+ * down to MAX_LEVEL. Rays which start near each other and go the same way
+ * mostly visit the same parts of the hierarchy, so one after another they
+ * find them in the cache.
+ *
+ * A ray carries the share of its pixel's color which it gives, which is the
+ * product of the reflection or refraction colors along its way. What it
+ * finds is added to the pixel times that share.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rt.h"
+#include "externs.h"
+
+#define HASH_BITS	10	/* bits of each coordinate of the origin */
+
+COLOR           Background_color();
+
+/*
+ * A ray waiting to be traced.
+ */
+
+typedef struct deferred
+{
+	RAY             ray;
+	COLOR           weight;	/* share of the pixel's color	 */
+	unsigned long   key;	/* octant, then origin hash	 */
+	int             pixel;	/* pixel of the tile		 */
+	int             level;	/* level of recursion		 */
+}               DEFERRED;
+
+static DEFERRED *queue[2] = {NULL, NULL};
+static int      nqueue[2], max_queue[2];
+static int      fill;		/* queue rays are added to	 */
+
+/*
+ * Spread_bits()
+ *
+ * Spread the low HASH_BITS bits of a number out to every third bit.
+ */
+
+static unsigned long Spread_bits(unsigned long v)
+{
+    unsigned long   r;
+    int             i;
+
+    r = 0;
+    for (i = 0; i < HASH_BITS; i++)
+	r |= ((v >> i) & 1) << (3 * i);
+
+    return (r);
+}
+
+/*
+ * Cell()
+ *
+ * Return which of the 2^HASH_BITS cells across the scene's box the given
+ * coordinate falls in.
+ */
+
+static unsigned long Cell(double v, double lo, double hi)
+{
+    double          f;
+
+    if (hi <= lo)
+	return (0);
+
+    f = (v - lo) / (hi - lo) * (1 << HASH_BITS);
+    if (f < 0)
+	return (0);
+    if (f >= (1 << HASH_BITS))
+	return ((1 << HASH_BITS) - 1);
+
+    return ((unsigned long) f);
+}
+
+/*
+ * Sort_key()
+ *
+ * Make the key to sort a ray by: the octant of its direction, then the
+ * Morton order of the cell of the scene its origin is in.
+ */
+
+static unsigned long Sort_key(RAY *ray)
+{
+    unsigned long   octant, hash;
+
+    octant = (ray->dir.x < 0) | (ray->dir.y < 0) << 1 | (ray->dir.z < 0) << 2;
+
+    hash = Spread_bits(Cell(ray->pos.x, root->b_min.x, root->b_max.x)) |
+	Spread_bits(Cell(ray->pos.y, root->b_min.y, root->b_max.y)) << 1 |
+	Spread_bits(Cell(ray->pos.z, root->b_min.z, root->b_max.z)) << 2;
+
+    return (octant << (3 * HASH_BITS) | hash);
+}
+
+/*
+ * Compare_key()
+ *
+ * Compare two waiting rays by their keys for qsort().
+ */
+
+static int Compare_key(const void *p1, const void *p2)
+{
+    unsigned long   k1, k2;
+
+    k1 = ((DEFERRED *) p1)->key;
+    k2 = ((DEFERRED *) p2)->key;
+
+    if (k1 < k2)
+	return (-1);
+    else if (k1 > k2)
+	return (1);
+    else
+	return (0);
+}
+
+/*
+ * Add_ray()
+ *
+ * Put a ray in the given queue, growing it as needed.
+ */
+
+static void Add_ray(int q, RAY *ray, COLOR *weight, int pixel, int level)
+{
+    DEFERRED       *d;
+
+    if (nqueue[q] == max_queue[q])
+    {
+	max_queue[q] = max_queue[q] ? max_queue[q] * 2 : 1024;
+	queue[q] = (DEFERRED *) realloc(queue[q],
+					sizeof(DEFERRED) * max_queue[q]);
+	if (queue[q] == NULL)
+	{
+	    fprintf(stderr, "%s: malloc failed\n", my_name);
+	    exit(1);
+	}
+    }
+
+    d = &queue[q][nqueue[q]++];
+    d->ray = *ray;
+    d->weight = *weight;
+    d->pixel = pixel;
+    d->level = level;
+}
+
+/*
+ * Defer_ray()
+ *
+ * Put a primary ray for the given pixel of the tile in the queue. It is
+ * traced by the next Trace_deferred().
+ */
+
+void Defer_ray(RAY *ray, int pixel)
+{
+    COLOR           one;
+
+    one.r = one.g = one.b = 1.0;
+    Add_ray(fill, ray, &one, pixel, 0);
+}
+
+/*
+ * Trace_one()
+ *
+ * Trace a ray from the queue, add what it sees to its pixel and put the rays
+ * it sends out in the given queue. This does what Trace_a_ray() and
+ * Illuminate() do, without following the new rays down.
+ */
+
+static void Trace_one(DEFERRED *d, COLOR *sum, int q)
+{
+    INTERSECT       inter;
+    SURFACE        *surf;
+    VECTOR          ip, normal;
+    COLOR           col, tint[2], w;
+    RAY             ray2[2];
+    double          share[2];
+    int             i, k;
+
+    ++n_rays;
+
+    if (!Intersect(&d->ray, &inter))
+    {
+	col = Background_color(&d->ray);
+    }
+    else
+    {
+	++n_intersects;
+
+	/* past the last level, a hit adds nothing */
+	if (d->level >= MAX_LEVEL)
+	    return;
+
+	VecAddS(inter.t, d->ray.dir, d->ray.pos, ip);
+
+	surf = Surface_at(&inter, &d->ray, &ip, &normal);
+	col = Direct_light(&inter, &d->ray, &ip, &normal, surf, d->level);
+
+	k = Secondary_rays(&inter, &d->ray, &ip, &normal, surf, ray2,
+			   share, tint);
+
+	for (i = 0; i < k; i++)
+	{
+	    w.r = d->weight.r * share[i] * tint[i].r;
+	    w.g = d->weight.g * share[i] * tint[i].g;
+	    w.b = d->weight.b * share[i] * tint[i].b;
+	    Add_ray(q, &ray2[i], &w, d->pixel, d->level + 1);
+	}
+    }
+
+    sum[d->pixel].r += col.r * d->weight.r;
+    sum[d->pixel].g += col.g * d->weight.g;
+    sum[d->pixel].b += col.b * d->weight.b;
+}
+
+/*
+ * Trace_deferred()
+ *
+ * Trace the rays put in the queue with Defer_ray(), and all of the rays they
+ * send out, a level at a time. The colors are added to 'sum', by pixel.
+ */
+
+void Trace_deferred(COLOR *sum)
+{
+    int             q, i, level;
+
+    for (level = 0; nqueue[fill] > 0; level++)
+    {
+	q = fill;
+	fill = 1 - fill;
+
+	/* primary rays are traced in scan order, which is coherent */
+	if (level > 0)
+	{
+	    for (i = 0; i < nqueue[q]; i++)
+		queue[q][i].key = Sort_key(&queue[q][i].ray);
+
+	    qsort(queue[q], nqueue[q], sizeof(DEFERRED), Compare_key);
+	}
+
+	for (i = 0; i < nqueue[q]; i++)
+	    Trace_one(&queue[q][i], sum, fill);
+
+	nqueue[q] = 0;
+    }
+}
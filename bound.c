@@ -18,12 +18,15 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "rt.h"
 #include "externs.h"
 
 static int      axis;
+static int      next_id = 0;	/* id of the next object made */
 
 /*
  * Find the most dominant axis for this group of objects.
@@ -127,100 +130,182 @@ static int Compslabs(const void *p1, const void *p2)
 }
 
 
-int Sort_split(int first, int last)
+/*
+ * Make_composite()
+ * 
+ * Build a composite object which contains the given children, size its box
+ * to hold all of them, and add it to the object list.
+ */
+
+OBJECT *Make_composite(OBJECT **child, int num)
 {
     OBJECT         *cp;
     COMPOSITE      *cd;
-    int             size, i, j;
-    double          dmin, dmax;
-    int             m;
+    int             i;
 
-    axis = Find_axis(first, last);
+    if (nobjects == MAX_PRIMS)
+    {
+	fprintf(stderr, "%s: too many primitives, max is %d\n",
+		my_name, MAX_PRIMS);
+	exit(0);
+    }
 
-    size = last - first;
+    if ((cp = (OBJECT *) malloc(sizeof(OBJECT))) == NULL ||
+	(cd = (COMPOSITE *) malloc(sizeof(COMPOSITE) +
+				   sizeof(OBJECT *) * (num - 1))) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
 
-    qsort((char *) (objects + first), 
-	  size, 
-	  sizeof(OBJECT *), 
-	  Compslabs);
+    cp->type = T_COMPOSITE;
+    cd->num = num;
+    cd->leaf = NULL;
 
-    if (size <= GROUP_SIZE)
+    cp->b_min.x = cp->b_min.y = cp->b_min.z = HUGE;
+    cp->b_max.x = cp->b_max.y = cp->b_max.z = -HUGE;
+
+    for (i = 0; i < num; i++)
     {
-	/* build a box to contain them */
+	cd->child[i] = child[i];
 
-	cp = (OBJECT *) malloc(sizeof(OBJECT));
-	cp->type = T_COMPOSITE;
-	cd = (COMPOSITE *) malloc(sizeof(COMPOSITE));
-	cd->num = size;
+	cp->b_min.x = MIN(child[i]->b_min.x, cp->b_min.x);
+	cp->b_min.y = MIN(child[i]->b_min.y, cp->b_min.y);
+	cp->b_min.z = MIN(child[i]->b_min.z, cp->b_min.z);
 
-	for (i = 0; i < size; i++)
-	{
-	    cd->child[i] = objects[first + i];
-	}
+	cp->b_max.x = MAX(child[i]->b_max.x, cp->b_max.x);
+	cp->b_max.y = MAX(child[i]->b_max.y, cp->b_max.y);
+	cp->b_max.z = MAX(child[i]->b_max.z, cp->b_max.z);
+    }
 
-	dmin = HUGE;
-	dmax = -HUGE;
+    cp->obj = (void *) cd;
+    objects[nobjects++] = cp;
 
-	for (j = 0; j < size; j++)
-	{
-	    if (cd->child[j]->b_min.x < dmin)
-		dmin = cd->child[j]->b_min.x;
-	    if (cd->child[j]->b_max.x > dmax)
-		dmax = cd->child[j]->b_max.x;
-	}
+    return (cp);
+}
 
-	cp->b_min.x = dmin;
-	cp->b_max.x = dmax;
+/*
+ * New_object()
+ *
+ * Make an object of the given type and add it to the object list. The
+ * given data of the primitive, 'size' bytes of it, is copied into the
+ * object's block, right after the object, where obj points. Each object
+ * gets the next id, which decides between hits at the same distance.
+ */
 
-	dmin = HUGE;
-	dmax = -HUGE;
+OBJECT *New_object(int type, void *data, int size)
+{
+    OBJECT         *o;
 
-	for (j = 0; j < size; j++)
-	{
-	    if (cd->child[j]->b_min.y < dmin)
-		dmin = cd->child[j]->b_min.y;
-	    if (cd->child[j]->b_max.y > dmax)
-		dmax = cd->child[j]->b_max.y;
-	}
+    if (nobjects == MAX_PRIMS)
+    {
+	fprintf(stderr, "%s: too many objects specified\n", my_name);
+	exit(1);
+    }
 
-	cp->b_min.y = dmin;
-	cp->b_max.y = dmax;
+    if ((o = (OBJECT *) malloc(sizeof(OBJECT) + size)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
 
-	dmin = HUGE;
-	dmax = -HUGE;
+    if (size > 0)
+	memcpy(o + 1, data, size);
 
-	for (j = 0; j < size; j++)
-	{
-	    if (cd->child[j]->b_min.z < dmin)
-		dmin = cd->child[j]->b_min.z;
-	    if (cd->child[j]->b_max.z > dmax)
-		dmax = cd->child[j]->b_max.z;
-	}
+    o->type = type;
+    o->active = 0;
+    o->id = next_id++;
+    o->obj = (void *) (o + 1);
+    o->surf = cur_surface;
 
-	cp->b_min.z = dmin;
-	cp->b_max.z = dmax;
+    objects[nobjects++] = o;
+    return (o);
+}
 
+/*
+ * Data_size()
+ *
+ * Return the number of bytes of the data kept in the block of the given
+ * object. The triangles of a mesh keep theirs in the mesh.
+ */
 
-	cp->obj = (void *) cd;
-	root = cp;
+int Data_size(OBJECT *o)
+{
+    switch (o->type)
+    {
+    case T_POLYGON:
+	return (POLY_SIZE(((POLYGON *) o->obj)->npoints));
+    case T_SPHERE:
+	return (sizeof(SPHERE));
+    case T_HSPHERE:
+	return (sizeof(HSPHERE));
+    case T_CONE:
+	return (sizeof(CONE));
+    case T_RING:
+	return (sizeof(RING));
+    case T_QUADRIC:
+	return (sizeof(QUADRIC));
+    case T_INSTANCE:
+	return (sizeof(PLACEMENT));
+    default:
+	return (0);
+    }
+}
 
-	if (nobjects < MAX_PRIMS)
-	{
-	    objects[nobjects++] = cp;
-	    return (1);
-	}
-	else
-	{
-	    fprintf(stderr, "%s: too many primitives, max is %d\n",
-		    my_name, MAX_PRIMS);
-	    exit(0);
-	}
+/*
+ * Box_area()
+ * 
+ * Return the surface area of the given box. Empty boxes have no area.
+ */
+
+double Box_area(VECTOR *b_min, VECTOR *b_max)
+{
+    double          dx, dy, dz;
+
+    dx = b_max->x - b_min->x;
+    dy = b_max->y - b_min->y;
+    dz = b_max->z - b_min->z;
+
+    if (dx < 0 || dy < 0 || dz < 0)
+	return (0.0);
+
+    return (2.0 * (dx * dy + dy * dz + dz * dx));
+}
+
+/*
+ * Sort_split()
+ * 
+ * Cut the objects in the given range in half along their longest axis until
+ * the pieces have at most 'group' objects, and put each piece in a
+ * composite. Returns 1 if the whole range went into one composite.
+ */
+
+int Sort_split(int first, int last, int group)
+{
+    int             size;
+    int             m;
+
+    axis = Find_axis(first, last);
+
+    size = last - first;
+
+    qsort((char *) (objects + first), 
+	  size, 
+	  sizeof(OBJECT *), 
+	  Compslabs);
+
+    if (size <= group)
+    {
+	/* build a box to contain them */
+
+	root = Make_composite(objects + first, size);
+	return (1);
     }
     else
     {
 	m = (first + last) / 2;
-	Sort_split(first, m);
-	Sort_split(m, last);
+	Sort_split(first, m, group);
+	Sort_split(m, last, group);
 	return (0);
 	}
 }
@@ -234,14 +319,103 @@ int Sort_split(int first, int last)
 
 void Build_bounding_slabs()
 {
-    int             low = 0;
+    Build_group_slabs(0);
+}
+
+/*
+ * Build_group_slabs()
+ * 
+ * Build a median cut hierarchy over the objects from 'first' to the end of
+ * the object list, and return its root. The objects go into leaves of at
+ * most leaf_size, and each level above groups at most branch_factor
+ * composites.
+ */
+
+OBJECT *Build_group_slabs(int first)
+{
+    int             low = first;
     int             high;
 
     high = nobjects;
-    while (Sort_split(low, high) == 0)
+    if (Sort_split(low, high, leaf_size))
+	return (root);
+
+    low = high;
+    high = nobjects;
+    while (Sort_split(low, high, branch_factor) == 0)
     {
 	low = high;
 	high = nobjects;
     }
+
+    return (root);
 }
 
+
+/*
+ * Build_hierarchy()
+ * 
+ * Build the bounding box hierarchy over all of the objects with whichever
+ * builder was asked for, unless the bvh cache file already has it.
+ */
+
+void Build_hierarchy()
+{
+    if (bvh_cache != NULL && Load_bvh_cache())
+	return;
+
+    if (use_sbvh)
+	Build_sbvh();
+    else
+	Build_bounding_slabs();
+
+    if (treelet_passes > 0)
+	Optimize_treelets(treelet_passes);
+
+    if (bvh_cache != NULL)
+	Save_bvh_cache();
+}
+
+/*
+ * Node_cost()
+ * 
+ * Return the cost of the subtree under the given object, scaled by the area
+ * of the box of the subtree's parent.
+ */
+
+double Node_cost(OBJECT *obj)
+{
+    COMPOSITE      *cd;
+    double          cost;
+    int             i;
+
+    if (obj->type != T_COMPOSITE)
+	return (Box_area(&obj->b_min, &obj->b_max) * SAH_PRIM);
+
+    cd = (COMPOSITE *) obj->obj;
+    cost = Box_area(&obj->b_min, &obj->b_max) * cd->num;
+
+    for (i = 0; i < cd->num; i++)
+	cost += Node_cost(cd->child[i]);
+
+    return (cost);
+}
+
+/*
+ * Sah_cost()
+ * 
+ * Return the surface area heuristic cost of the hierarchy under the given
+ * node. This is the expected number of box tests, plus SAH_PRIM for every
+ * primitive test, for a ray which hits the node's box.
+ */
+
+double Sah_cost(OBJECT *node)
+{
+    double          area;
+
+    area = Box_area(&node->b_min, &node->b_max);
+    if (area <= 0.0)
+	return (0.0);
+
+    return (Node_cost(node) / area);
+}
@@ -0,0 +1,468 @@
+/*
+ * cache.c
+ *
+ * This module keeps built bounding box hierarchies in a cache file, so that
+ * the rt processes started by prt for a static scene don't all have to build
+ * the same tree again. The file is keyed by a hash over everything the
+ * builders look at. A run whose scene hashes differently builds a new tree
+ * and replaces the file.
+ *
+ * Cache file layout (native byte order):
+ *
+ *	header		BVH_HEADER
+ *	order		int[nprims], the input file index of the primitive at
+ *			each place of the object list after the build
+ *	nodes		BVH_NODE[nnodes], the composites in object list order
+ *	children	int[nchildren], the object list indices of the children
+ *			of every node, one node after the other
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "rt.h"
+#include "externs.h"
+
+#define CACHE_MAGIC	0x48564252	/* "RBVH"			 */
+#define CACHE_VERSION	2
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+typedef struct bvh_header
+{
+    int             magic;	/* CACHE_MAGIC			 */
+    int             version;	/* CACHE_VERSION		 */
+    int             branch_factor;	/* tree shape it was built with	 */
+    int             leaf_size;
+    int             nprims;	/* number of primitives		 */
+    int             nnodes;	/* number of composites		 */
+    int             nchildren;	/* total children of all nodes	 */
+    int             pad;
+    unsigned long long hash;	/* scene hash			 */
+}               BVH_HEADER;
+
+typedef struct bvh_node
+{
+    VECTOR          b_min;	/* bounding box			 */
+    VECTOR          b_max;
+    int             num;	/* number of children		 */
+    int             first;	/* first of them in children	 */
+}               BVH_NODE;
+
+typedef struct prim_index
+{
+    OBJECT         *obj;
+    int             index;
+}               PRIM_INDEX;
+
+static unsigned long long scene_hash;	/* hash of the current scene	 */
+static OBJECT **file_order = NULL;	/* primitives in input file order */
+static int      file_nprims;
+
+/*
+ * Hash_bytes()
+ *
+ * Add the given bytes to a FNV-1a hash.
+ */
+
+static unsigned long long Hash_bytes(unsigned long long h, void *p, int n)
+{
+    unsigned char  *c = (unsigned char *) p;
+
+    while (n-- > 0)
+    {
+	h ^= *c++;
+	h *= FNV_PRIME;
+    }
+
+    return (h);
+}
+
+/*
+ * Hash_scene()
+ *
+ * Hash the objects, in input file order, and the builder settings. The
+ * builders only look at the bounding boxes and, for spatial splits, at the
+ * polygon and triangle vertices.
+ */
+
+static unsigned long long Hash_scene()
+{
+    unsigned long long h;
+    POLYGON        *p;
+    TRIANGLE       *tri;
+    int             i, j;
+
+    h = FNV_OFFSET;
+    h = Hash_bytes(h, &use_sbvh, sizeof(use_sbvh));
+    h = Hash_bytes(h, &branch_factor, sizeof(branch_factor));
+    h = Hash_bytes(h, &leaf_size, sizeof(leaf_size));
+    h = Hash_bytes(h, &treelet_passes, sizeof(treelet_passes));
+    if (use_sbvh)
+	h = Hash_bytes(h, &sbvh_budget, sizeof(sbvh_budget));
+
+    for (i = 0; i < nobjects; i++)
+    {
+	h = Hash_bytes(h, &objects[i]->type, sizeof(int));
+	h = Hash_bytes(h, &objects[i]->b_min, sizeof(VECTOR));
+	h = Hash_bytes(h, &objects[i]->b_max, sizeof(VECTOR));
+
+	if (objects[i]->type == T_POLYGON)
+	{
+	    p = (POLYGON *) objects[i]->obj;
+	    h = Hash_bytes(h, p->points, sizeof(VECTOR) * p->npoints);
+	}
+	else if (objects[i]->type == T_TRIANGLE)
+	{
+	    tri = (TRIANGLE *) objects[i]->obj;
+	    for (j = 0; j < 3; j++)
+		h = Hash_bytes(h, &tri->mesh->verts[tri->v[j]],
+			       sizeof(VECTOR));
+	}
+    }
+
+    return (h);
+}
+
+/*
+ * Compindex()
+ *
+ * Compare two primitive index entries by object address.
+ */
+
+static int Compindex(const void *p1, const void *p2)
+{
+    PRIM_INDEX     *a = (PRIM_INDEX *) p1;
+    PRIM_INDEX     *b = (PRIM_INDEX *) p2;
+
+    if (a->obj < b->obj)
+	return (-1);
+    else if (a->obj == b->obj)
+	return (0);
+    else
+	return (1);
+}
+
+/*
+ * Load_bvh_cache()
+ *
+ * Map the cache file and, if it was written for this scene, rebuild the
+ * hierarchy from it. The objects must be in input file order. Returns 1 if
+ * the hierarchy came from the cache. Otherwise the scene is remembered for
+ * Save_bvh_cache().
+ */
+
+int Load_bvh_cache()
+{
+    BVH_HEADER     *hdr;
+    BVH_NODE       *nodes;
+    OBJECT        **list, *cp;
+    COMPOSITE      *cd;
+    struct stat     st;
+    size_t          size;
+    void           *map;
+    int            *order, *children;
+    int             fd, nprims, i, j, k;
+
+    scene_hash = Hash_scene();
+
+    file_nprims = nobjects;
+    file_order = (OBJECT **) realloc(file_order,
+				     sizeof(OBJECT *) * file_nprims);
+    if (file_order == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+    memcpy(file_order, objects, sizeof(OBJECT *) * file_nprims);
+
+    if ((fd = open(bvh_cache, O_RDONLY)) < 0)
+	return (0);
+
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(BVH_HEADER))
+    {
+	close(fd);
+	return (0);
+    }
+
+    size = st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+	return (0);
+
+    hdr = (BVH_HEADER *) map;
+    nprims = nobjects;
+
+    if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION ||
+	hdr->branch_factor != branch_factor ||
+	hdr->leaf_size != leaf_size || hdr->hash != scene_hash ||
+	hdr->nprims != nprims || hdr->nnodes < 1 ||
+	nprims + hdr->nnodes > MAX_PRIMS || hdr->nchildren < 0 ||
+	size != sizeof(BVH_HEADER) + sizeof(int) * nprims +
+	sizeof(BVH_NODE) * hdr->nnodes + sizeof(int) * hdr->nchildren)
+    {
+	munmap(map, size);
+	return (0);
+    }
+
+    order = (int *) (hdr + 1);
+    nodes = (BVH_NODE *) (order + nprims);
+    children = (int *) (nodes + hdr->nnodes);
+
+    /*
+     * Check the indices before touching anything. A node's children
+     * always come before it in the object list.
+     */
+
+    for (i = 0; i < nprims; i++)
+	if (order[i] < 0 || order[i] >= nprims)
+	    break;
+
+    for (j = 0; i == nprims && j < hdr->nnodes; j++)
+    {
+	if (nodes[j].num < 1 || nodes[j].num > MAX_GROUP ||
+	    nodes[j].first < 0 ||
+	    nodes[j].first > hdr->nchildren - nodes[j].num)
+	    break;
+	for (k = 0; k < nodes[j].num; k++)
+	    if (children[nodes[j].first + k] < 0 ||
+		children[nodes[j].first + k] >= nprims + j)
+		break;
+	if (k < nodes[j].num)
+	    break;
+    }
+
+    if (i < nprims || j < hdr->nnodes)
+    {
+	munmap(map, size);
+	return (0);
+    }
+
+    /*
+     * Put the primitives back in the order the tree was built with,
+     * then add the composites.
+     */
+
+    if ((list = (OBJECT **) malloc(sizeof(OBJECT *) * nprims)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+    memcpy(list, objects, sizeof(OBJECT *) * nprims);
+
+    for (i = 0; i < nprims; i++)
+	objects[i] = list[order[i]];
+    free(list);
+
+    for (i = 0; i < hdr->nnodes; i++)
+    {
+	if ((cp = (OBJECT *) malloc(sizeof(OBJECT))) == NULL ||
+	    (cd = (COMPOSITE *) malloc(sizeof(COMPOSITE) + sizeof(OBJECT *) *
+				       (nodes[i].num - 1))) == NULL)
+	{
+	    fprintf(stderr, "%s: malloc failed\n", my_name);
+	    exit(1);
+	}
+
+	cp->type = T_COMPOSITE;
+	cp->obj = (void *) cd;
+	cp->b_min = nodes[i].b_min;
+	cp->b_max = nodes[i].b_max;
+
+	cd->num = nodes[i].num;
+	cd->leaf = NULL;
+	for (j = 0; j < cd->num; j++)
+	    cd->child[j] = objects[children[nodes[i].first + j]];
+
+	objects[nobjects++] = cp;
+    }
+
+    root = objects[nobjects - 1];
+
+    /* duplicate references from spatial splits need the mailbox */
+    mailbox = 0;
+    if (hdr->nchildren != nprims + hdr->nnodes - 1)
+    {
+	mailbox = 1;
+	for (i = 0; i < nprims; i++)
+	    objects[i]->active = 0;
+    }
+
+    munmap(map, size);
+
+    if (verbose)
+	fprintf(stderr, "%s: hierarchy loaded from bvh cache '%s'\n",
+		my_name, bvh_cache);
+
+    return (1);
+}
+
+/*
+ * Make_index()
+ *
+ * Return a table of the given objects and their places in the list, sorted
+ * so that an object's place can be looked up with Find_index().
+ */
+
+static PRIM_INDEX *Make_index(OBJECT **list, int n)
+{
+    PRIM_INDEX     *index;
+    int             i;
+
+    if ((index = (PRIM_INDEX *) malloc(sizeof(PRIM_INDEX) * n)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+	index[i].obj = list[i];
+	index[i].index = i;
+    }
+    qsort((char *) index, n, sizeof(PRIM_INDEX), Compindex);
+
+    return (index);
+}
+
+/*
+ * Find_index()
+ *
+ * Look up the place of an object in a table from Make_index().
+ */
+
+static int Find_index(PRIM_INDEX *index, int n, OBJECT *obj)
+{
+    PRIM_INDEX      key, *found;
+
+    key.obj = obj;
+    found = (PRIM_INDEX *) bsearch(&key, index, n, sizeof(PRIM_INDEX),
+				   Compindex);
+
+    return (found ? found->index : -1);
+}
+
+/*
+ * Save_bvh_cache()
+ *
+ * Write the hierarchy just built for the scene seen by Load_bvh_cache() to
+ * the cache file. The file is written under a temporary name and then
+ * renamed, so that other rt processes never see half of it.
+ */
+
+void Save_bvh_cache()
+{
+    BVH_HEADER      hdr;
+    BVH_NODE        node;
+    PRIM_INDEX     *in_file, *in_list;
+    COMPOSITE      *cd;
+    FILE           *fp;
+    char           *tmp_name;
+    int             nprims, nchildren, i, j, k, ok;
+
+    nprims = file_nprims;
+
+    if (root != objects[nobjects - 1])
+	return;
+
+    if ((tmp_name = malloc(strlen(bvh_cache) + 32)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    sprintf(tmp_name, "%s.%d", bvh_cache, (int) getpid());
+    if ((fp = fopen(tmp_name, "w")) == NULL)
+    {
+	fprintf(stderr, "%s: can't create bvh cache file '%s'\n",
+		my_name, tmp_name);
+	free(tmp_name);
+	return;
+    }
+
+    in_file = Make_index(file_order, nprims);
+    in_list = Make_index(objects, nobjects);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CACHE_MAGIC;
+    hdr.version = CACHE_VERSION;
+    hdr.branch_factor = branch_factor;
+    hdr.leaf_size = leaf_size;
+    hdr.nprims = nprims;
+    hdr.nnodes = nobjects - nprims;
+
+    nchildren = 0;
+    for (i = nprims; i < nobjects; i++)
+	nchildren += ((COMPOSITE *) objects[i]->obj)->num;
+    hdr.nchildren = nchildren;
+    hdr.hash = scene_hash;
+
+    ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+
+    for (i = 0; i < nprims && ok; i++)
+    {
+	k = Find_index(in_file, nprims, objects[i]);
+	ok = (fwrite(&k, sizeof(int), 1, fp) == 1);
+    }
+
+    for (i = nprims, nchildren = 0; i < nobjects && ok; i++)
+    {
+	memset(&node, 0, sizeof(node));
+	node.b_min = objects[i]->b_min;
+	node.b_max = objects[i]->b_max;
+
+	cd = (COMPOSITE *) objects[i]->obj;
+	node.num = cd->num;
+	node.first = nchildren;
+	nchildren += cd->num;
+
+	ok = (fwrite(&node, sizeof(node), 1, fp) == 1);
+    }
+
+    for (i = nprims; i < nobjects && ok; i++)
+    {
+	cd = (COMPOSITE *) objects[i]->obj;
+	for (j = 0; j < cd->num && ok; j++)
+	{
+	    k = Find_index(in_list, nobjects, cd->child[j]);
+	    ok = (fwrite(&k, sizeof(int), 1, fp) == 1);
+	}
+    }
+
+    free(in_file);
+    free(in_list);
+
+    if (fclose(fp) != 0 || !ok || rename(tmp_name, bvh_cache) < 0)
+    {
+	fprintf(stderr, "%s: can't write bvh cache file '%s'\n",
+		my_name, bvh_cache);
+	unlink(tmp_name);
+    }
+    else if (verbose)
+    {
+	fprintf(stderr, "%s: hierarchy saved to bvh cache '%s'\n",
+		my_name, bvh_cache);
+    }
+
+    free(tmp_name);
+}
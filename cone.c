@@ -25,33 +25,24 @@
 #include "externs.h"
 
 
-int             Cone_intersect();
+int             Cone_intersect(), Cylinder_intersect();
 void		Cone_normal();
 
 void Build_cone(CONE *cd)
 {
     OBJECT         *obj;
-    double          dmin, dmax, d, ftmp;
-    VECTOR          tmp;
+    double          ftmp;
+    VECTOR          tmp, ext;
 
-    if (nobjects == MAX_PRIMS)
-    {
-	fprintf(stderr, "%s: too many objects specified\n", my_name);
-	exit(1);
-    }
-
-    if ((obj = (OBJECT *) malloc(sizeof(OBJECT))) == NULL)
-    {
-	fprintf(stderr, "%s: malloc failed\n", my_name);
-	exit(1);
-    }
+    obj = New_object(T_CONE, cd, sizeof(CONE));
+    obj->normal = Cone_normal;
 
-    objects[nobjects++] = obj;
+    cd = (CONE *) obj->obj;
 
-    obj->type = T_CONE;
-    obj->inter = Cone_intersect;
-    obj->normal = Cone_normal;
-    obj->surf = cur_surface;
+    if (cd->base_radius == cd->apex_radius)
+	obj->inter = Cylinder_intersect;
+    else
+	obj->inter = Cone_intersect;
 
     VecSub(cd->apex, cd->base, cd->w);
     cd->height = VecNormalize(&cd->w);
@@ -88,150 +79,49 @@ void Build_cone(CONE *cd)
 	cd->min_d = ftmp;
     }
 
-    obj->obj = cd;
-
     /*
-     * Create the bounding box for this puppy.
+     * Create the bounding box for this puppy. The ends are circles, and
+     * along each axis a circle reaches out its radius times the sine of
+     * the angle between the axis and the cone's.
      */
 
-    dmin = HUGE;
-    dmax = -HUGE;
-
-    /* first the X plane */
-    d = cd->base.x - cd->base_radius;
-
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    d = cd->base.x + cd->base_radius;
-
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    d = cd->apex.x - cd->apex_radius;
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    d = cd->apex.x + cd->apex_radius;
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    obj->b_min.x = dmin;
-    obj->b_max.x = dmax;
-
-    /* now the Y plane */
-    dmin = HUGE;
-    dmax = -HUGE;
-
-    d = cd->base.y - cd->base_radius;
-
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    d = cd->base.y + cd->base_radius;
-
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    d = cd->apex.y - cd->apex_radius;
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    d = cd->apex.y + cd->apex_radius;
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    obj->b_min.y = dmin;
-    obj->b_max.y = dmax;
-
-    /* and finally the Z plane */
-    dmin = HUGE;
-    dmax = -HUGE;
-
-    d = cd->base.z - cd->base_radius;
-
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    d = cd->base.z + cd->base_radius;
-
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    d = cd->apex.z - cd->apex_radius;
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    d = cd->apex.z + cd->apex_radius;
-    if (d < dmin)
-	dmin = d;
-    if (d > dmax)
-	dmax = d;
-
-    obj->b_min.z = dmin;
-    obj->b_max.z = dmax;
+    ext.x = sqrt(MAX(0.0, 1.0 - cd->w.x * cd->w.x));
+    ext.y = sqrt(MAX(0.0, 1.0 - cd->w.y * cd->w.y));
+    ext.z = sqrt(MAX(0.0, 1.0 - cd->w.z * cd->w.z));
+
+    obj->b_min.x = MIN(cd->base.x - cd->base_radius * ext.x,
+		       cd->apex.x - cd->apex_radius * ext.x);
+    obj->b_min.y = MIN(cd->base.y - cd->base_radius * ext.y,
+		       cd->apex.y - cd->apex_radius * ext.y);
+    obj->b_min.z = MIN(cd->base.z - cd->base_radius * ext.z,
+		       cd->apex.z - cd->apex_radius * ext.z);
+
+    obj->b_max.x = MAX(cd->base.x + cd->base_radius * ext.x,
+		       cd->apex.x + cd->apex_radius * ext.x);
+    obj->b_max.y = MAX(cd->base.y + cd->base_radius * ext.y,
+		       cd->apex.y + cd->apex_radius * ext.y);
+    obj->b_max.z = MAX(cd->base.z + cd->base_radius * ext.z,
+		       cd->apex.z + cd->apex_radius * ext.z);
 }
 
+/*
+ * Cone_roots()
+ *
+ * Given the quadratic of a cone or cylinder along the ray, find the closest
+ * of its roots which is between the end planes, if there is one.
+ */
 
-int Cone_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
+static int Cone_roots(OBJECT *obj, RAY *ray, double a, double b, double c,
+		      INTERSECT *inter)
 {
-    RAY             tray;
     CONE           *cd;
-    VECTOR          v, p;
-    double          a, b, c, d, disc;
+    VECTOR          p;
+    double          d, disc;
     double          t1, t2;
     int             nroots;
 
     cd = (CONE *) (obj->obj);
 
-    /*
-     * First, we get the coordinates of the ray origin in the objects
-     * space....
-     */
-
-    VecSub(ray->pos, cd->base, v);
-
-    tray.pos.x = VecDot(v, cd->u);
-    tray.pos.y = VecDot(v, cd->v);
-    tray.pos.z = VecDot(v, cd->w);
-
-    tray.dir.x = VecDot(ray->dir, cd->u);
-    tray.dir.y = VecDot(ray->dir, cd->v);
-    tray.dir.z = VecDot(ray->dir, cd->w);
-
-    a = tray.dir.x * tray.dir.x
-	+ tray.dir.y * tray.dir.y
-	- cd->slope * cd->slope * tray.dir.z * tray.dir.z;
-
-    b = 2.0 * (tray.pos.x * tray.dir.x + tray.pos.y * tray.dir.y -
-	       cd->slope * cd->slope * tray.pos.z * tray.dir.z
-	       - cd->base_radius * cd->slope * tray.dir.z);
-
-    c = cd->slope * tray.pos.z + cd->base_radius;
-    c = tray.pos.x * tray.pos.x + tray.pos.y * tray.pos.y - (c * c);
-
     disc = b * b - 4.0 * a * c;
 
     if (disc < 0.0)
@@ -305,6 +195,95 @@ int Cone_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
     return (0);
 }
 
+/*
+ * Cone_intersect()
+ *
+ * Check given cone for intersection with given ray. Return TRUE if an
+ * intersection takes place. The ray is first checked against the planes
+ * of the ends, along the cone's axis, which takes two dot products. A ray
+ * which is past one of them and going away from the other can't hit it.
+ */
+
+int Cone_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
+{
+    RAY             tray;
+    CONE           *cd;
+    VECTOR          v;
+    double          a, b, c;
+
+    cd = (CONE *) (obj->obj);
+
+    /*
+     * First, we get the coordinates of the ray origin in the objects
+     * space....
+     */
+
+    VecSub(ray->pos, cd->base, v);
+
+    tray.pos.z = VecDot(v, cd->w);
+    tray.dir.z = VecDot(ray->dir, cd->w);
+
+    if ((tray.pos.z < 0.0 && tray.dir.z <= 0.0) ||
+	(tray.pos.z > cd->height && tray.dir.z >= 0.0))
+	return (0);
+
+    tray.pos.x = VecDot(v, cd->u);
+    tray.pos.y = VecDot(v, cd->v);
+
+    tray.dir.x = VecDot(ray->dir, cd->u);
+    tray.dir.y = VecDot(ray->dir, cd->v);
+
+    a = tray.dir.x * tray.dir.x
+	+ tray.dir.y * tray.dir.y
+	- cd->slope * cd->slope * tray.dir.z * tray.dir.z;
+
+    b = 2.0 * (tray.pos.x * tray.dir.x + tray.pos.y * tray.dir.y -
+	       cd->slope * cd->slope * tray.pos.z * tray.dir.z
+	       - cd->base_radius * cd->slope * tray.dir.z);
+
+    c = cd->slope * tray.pos.z + cd->base_radius;
+    c = tray.pos.x * tray.pos.x + tray.pos.y * tray.pos.y - (c * c);
+
+    return (Cone_roots(obj, ray, a, b, c, inter));
+}
+
+/*
+ * Cylinder_intersect()
+ *
+ * Check a cone whose ends have the same radius, a cylinder, for
+ * intersection with the given ray. With no slope, the quadratic only needs
+ * the ray across the axis, and the terms along it drop out.
+ */
+
+int Cylinder_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
+{
+    CONE           *cd;
+    VECTOR          v;
+    double          pz, dz, px, py, dx, dy;
+    double          a, b, c;
+
+    cd = (CONE *) (obj->obj);
+
+    VecSub(ray->pos, cd->base, v);
+
+    pz = VecDot(v, cd->w);
+    dz = VecDot(ray->dir, cd->w);
+
+    if ((pz < 0.0 && dz <= 0.0) || (pz > cd->height && dz >= 0.0))
+	return (0);
+
+    px = VecDot(v, cd->u);
+    py = VecDot(v, cd->v);
+
+    dx = VecDot(ray->dir, cd->u);
+    dy = VecDot(ray->dir, cd->v);
+
+    a = dx * dx + dy * dy;
+    b = 2.0 * (px * dx + py * dy);
+    c = px * px + py * py - cd->base_radius * cd->base_radius;
+
+    return (Cone_roots(obj, ray, a, b, c, inter));
+}
 
 void Cone_normal(CONE *cone, RAY *ray, VECTOR *ip, VECTOR *normal)
 {
@@ -17,8 +17,8 @@
 
 int             verbose = 0;
 char           *my_name;
-char            input_file[64] = "";
-char            output_file[64] = "";
+char            input_file[MAX_NAME] = "";
+char            output_file[MAX_NAME] = "";
 int             nlights = 0;
 int             nobjects = 0;
 int             shadow = 1;
@@ -28,11 +28,28 @@ int		y_start = 0;
 int		y_inc = 1;
 int		do_image_size = 1;
 int		use_stdio = 0;
+int		use_sbvh = 0;
+double		sbvh_budget = 0.3;
+int		mailbox = 0;
+double		refit_threshold = 1.5;
+char		*bvh_cache = NULL;
+int		use_qbvh = 0;
+int		bvh_stats = 0;
+int		branch_factor = GROUP_SIZE;
+int		leaf_size = GROUP_SIZE;
+int		autotune = 0;
+int		treelet_passes = 0;
+int		use_stackless = 0;
+int		bvh_layout = LAYOUT_DFS;
+double		split_factor = 0.0;
+int		sort_rays = 0;
+int		packet_size = 0;
+double		light_cutoff = LIGHT_CUTOFF;
 
 VIEW_INFO       view;
 SURFACE        *cur_surface;
 BACKGROUND      bkgnd;
-LIGHT          *lights[MAX_LIGHTS];
+LIGHT         **lights = NULL;
 OBJECT         *objects[MAX_PRIMS];
 OBJECT         *object_stack[STACK_SIZE];
 OBJECT         *root;
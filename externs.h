@@ -27,11 +27,28 @@ extern int		y_start;
 extern int		y_inc;
 extern int 	do_image_size;
 extern int		use_stdio;
+extern int		use_sbvh;
+extern double		sbvh_budget;
+extern int		mailbox;
+extern double		refit_threshold;
+extern char		*bvh_cache;
+extern int		use_qbvh;
+extern int		bvh_stats;
+extern int		branch_factor;
+extern int		leaf_size;
+extern int		autotune;
+extern int		treelet_passes;
+extern int		use_stackless;
+extern int		bvh_layout;
+extern double		split_factor;
+extern int		sort_rays;
+extern int		packet_size;
+extern double		light_cutoff;
 
 extern VIEW_INFO view;
 extern SURFACE *cur_surface;
 extern BACKGROUND bkgnd;
-extern LIGHT   *lights[];
+extern LIGHT  **lights;
 extern OBJECT  *objects[];
 extern OBJECT  *object_stack[];
 extern OBJECT  *root;
@@ -50,24 +67,73 @@ extern int      n_refract;
 
 /* Global functions */
 void Read_input_file(char *filename);
+void Reset_scene(void);
 void Init_output_file(char *filename);
 void Close_output_file(char *output_file);
 
 void Build_bounding_slabs(void);
+OBJECT *Build_group_slabs(int first);
+void Build_sbvh(void);
+void Build_hierarchy(void);
+void Split_polygons(void);
+void Build_frame_hierarchy(int first);
+double Sah_cost(OBJECT *node);
+double Node_cost(OBJECT *obj);
+void Optimize_treelets(int passes);
+int Load_bvh_cache(void);
+void Save_bvh_cache(void);
+void Build_qbvh(void);
+int Intersect_qbvh(RAY *ray, INTERSECT *inter, int stamp);
+long Qbvh_memory(void);
+void Pack_sphere_leaves(void);
+void Build_skip_tree(void);
+int Intersect_skip(int first, RAY *ray, INTERSECT *inter, int stamp);
+long Skip_memory(void);
+int Veb_order(int root, int (*kids) (int node, int *child), int *list);
+void Print_bvh_stats(int dump_areas);
+void Autotune(void);
+void Build_light_tree(void);
+void Start_lights(LIGHT_WALK *w, VECTOR *pos);
+int Next_light(LIGHT_WALK *w);
+OBJECT *Make_composite(OBJECT **child, int num);
+OBJECT *New_object(int type, void *data, int size);
+int Data_size(OBJECT *o);
+double Box_area(VECTOR *b_min, VECTOR *b_max);
 void Raytrace(void);
+void Defer_ray(RAY *ray, int pixel);
+void Trace_deferred(COLOR *sum);
+SURFACE *Surface_at(INTERSECT *inter, RAY *ray, VECTOR *ip, VECTOR *normal);
+COLOR Direct_light(INTERSECT *inter, RAY *ray, VECTOR *ip, VECTOR *normal,
+		   SURFACE *surf, int n);
+int Secondary_rays(INTERSECT *inter, RAY *ray, VECTOR *ip, VECTOR *normal,
+		   SURFACE *surf, RAY *out, double *share, COLOR *tint);
 
 void Build_cone(CONE *cd);
 
 void Build_sphere(SPHERE *sd);
+int Sphere_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter);
 void Build_hsphere(HSPHERE *sd);
 void Build_poly(POLYGON *pd);
+void Poly_edges(OBJECT *o);
+int Convex_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter);
+int Poly_crossing(POLYGON *p, double u, double v);
 void Build_ring(RING *r);
 void Build_quadric(QUADRIC *q);
+void Build_mesh(MESH *m);
+int Tri_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter);
+void Build_instance(OBJECT *tree, VECTOR *offset, double m[3][3]);
+void Placement_normal(PLACEMENT *pl, OBJECT *obj, RAY *ray, VECTOR *ip,
+		      VECTOR *normal);
+OBJECT *Instance_tree(INSTANCE *head);
+void Free_instance_tree(INSTANCE *head);
 
 void Write_pixel(COLOR *c);
 void Flush_output_file(void);
 
 int Intersect(RAY *ray, INTERSECT *inter);
+int Intersect_tree(OBJECT *node, RAY *ray, INTERSECT *inter, int stamp);
+int Hit_bbox(OBJECT *obj, RAY *ray);
+int Intersect_packet(RAY *ray, int num, FRUSTUM *fr, INTERSECT *inter);
 
 void Push_object(OBJECT *obj);
 OBJECT *Pop_object(void);
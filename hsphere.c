@@ -30,34 +30,20 @@ void Hsphere_normal();
  * Build_hsphere()
  *
  * Given some info on a sphere object, build a complete object stucture.
+ * The sphere is copied into the object.
  */
 
 void Build_hsphere( HSPHERE *s)
 {
     OBJECT *o;
 
-    if(nobjects == MAX_PRIMS)
-    {
-	fprintf(stderr, "%s: too many objects specified\n", my_name);
-	exit(1);
-    }
-
-    if((o = (OBJECT *) malloc(sizeof(OBJECT))) == NULL)
-    {
-	fprintf(stderr, "%s: malloc failed\n", my_name);
-	exit(1);
-    }
-
-    s->radius2 = s->radius * s->radius;
-    s->i_radius2 = s->i_radius * s->i_radius;
-    
-    o->type = T_HSPHERE;
-    o->obj  = s;
-    o->surf = cur_surface;
+    o = New_object(T_HSPHERE, s, sizeof(HSPHERE));
     o->inter = Hsphere_intersect;
     o->normal = Hsphere_normal;
 
-    objects[nobjects++] = o;
+    s = (HSPHERE *) o->obj;
+    s->radius2 = s->radius * s->radius;
+    s->i_radius2 = s->i_radius * s->i_radius;
 
     /*
      * Setup of bounding box for this puppy.
@@ -30,7 +30,7 @@ int             Parse_from(), Parse_at(), Parse_up(), Parse_angle(), Parse_res()
 int             Parse_light(), Parse_bkgnd(), Parse_surface(), Parse_cone();
 int             Parse_sphere(), Parse_hallow_sphere(), Parse_poly(), Parse_ring();
 int             Parse_quadric(), Parse_instance(), Parse_end_instance();
-int             Parse_instanceof();
+int             Parse_instanceof(), Parse_mesh();
 
 char           *Get_token();
 int             iflag = 0;
@@ -46,6 +46,8 @@ struct parse_procs
 FILE           *in_fp;
 int             line;
 char            line_buf[255], token[32], *info_ptr;
+#define V_FMT		R_FMT " " R_FMT " " R_FMT	/* a VECTOR */
+
 char           *sp = "%lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg";
 
 struct parse_procs tokens[MAX_TOKENS] =
@@ -66,7 +68,8 @@ struct parse_procs tokens[MAX_TOKENS] =
     {Parse_quadric, "quadric"},
     {Parse_instance, "instance"},
     {Parse_end_instance, "end_instance"},
-    {Parse_instanceof, "instance_of"}
+    {Parse_instanceof, "instance_of"},
+    {Parse_mesh, "mesh"}
 };
 
 /*
@@ -154,6 +157,45 @@ void Read_input_file(char *filename)
 
 }
 
+/*
+ * Reset_scene()
+ * 
+ * Throw away the lights and instances of the last input file, so that the
+ * next frame of an animation can be read in. The objects themselves belong
+ * to the hierarchy that was built over them.
+ */
+
+void Reset_scene()
+{
+    INSTANCE       *i1, *i2;
+    int             i;
+
+    for (i = 0; i < nlights; i++)
+	free(lights[i]);
+
+    for (i = 0; i < num_instance; i++)
+    {
+	for (i1 = instances[i]; i1; i1 = i2)
+	{
+	    i2 = i1->next;
+	    if (i1 == instances[i])
+	    {
+		Free_instance_tree(i1);
+		free(i1->name);
+	    }
+	    else if (i1->type == I_OBJECT)
+		free(i1->data);
+	    free(i1);
+	}
+    }
+
+    nlights = 0;
+    nobjects = 0;
+    num_instance = 0;
+    iflag = 0;
+    cur_surface = NULL;
+}
+
 /*
  * Get_token()
  * 
@@ -227,7 +269,7 @@ void Bad_malloc()
 int Parse_from()
 {
 
-    if (sscanf(info_ptr, "%lg %lg %lg", &view.from.x, &view.from.y,
+    if (sscanf(info_ptr, V_FMT, &view.from.x, &view.from.y,
 	       &view.from.z) != 3)
 	return (1);
     else
@@ -246,7 +288,7 @@ int Parse_from()
 int Parse_at()
 {
 
-    if (sscanf(info_ptr, "%lg %lg %lg", &view.look_at.x, &view.look_at.y,
+    if (sscanf(info_ptr, V_FMT, &view.look_at.x, &view.look_at.y,
 	       &view.look_at.z) != 3)
 	return (1);
     else
@@ -265,7 +307,7 @@ int Parse_at()
 int Parse_up()
 {
 
-    if (sscanf(info_ptr, "%lg %lg %lg", &view.up.x, &view.up.y,
+    if (sscanf(info_ptr, V_FMT, &view.up.x, &view.up.y,
 	       &view.up.z) != 3)
 	return (1);
     else
@@ -313,25 +355,43 @@ int Parse_res()
  * 
  * Parse the positional light token. The format is:
  * 
- * l x y z
+ * l x y z [intensity]
  * 
+ * A light given an intensity falls off with the square of the distance.
+ * The list of lights grows as they are added.
  */
 
 int Parse_light()
 {
+    static int      max_lights = 0;
     LIGHT          *l;
+    double          intensity;
+    int             n;
 
-    if (nlights == MAX_LIGHTS)
+    if (nlights == max_lights)
     {
-	fprintf(stderr, "%s: too many light sources defined\n", my_name);
-	return (1);
+	max_lights = max_lights ? 2 * max_lights : 8;
+	lights = (LIGHT **) realloc(lights, sizeof(LIGHT *) * max_lights);
+	if (lights == NULL)
+	    Bad_malloc();
     }
 
     if ((l = (LIGHT *) calloc(1, sizeof(LIGHT))) == NULL)
 	Bad_malloc();
 
-    if (sscanf(info_ptr, "%lg %lg %lg", &l->pos.x, &l->pos.y, &l->pos.z) != 3)
+    n = sscanf(info_ptr, V_FMT " %lg", &l->pos.x, &l->pos.y, &l->pos.z,
+	       &intensity);
+    if (n < 3 || (n == 4 && intensity <= 0.0))
+    {
+	free(l);
 	return (1);
+    }
+
+    if (n == 4)
+    {
+	l->intensity = intensity;
+	l->falloff = 1;
+    }
 
     lights[nlights++] = l;
     return (0);
@@ -414,20 +474,23 @@ int Parse_cone()
 
     /* get the cone base info */
     Next_line();
-    if (sscanf(line_buf, "%lg %lg %lg %lg", &cd->base.x, &cd->base.y,
+    if (sscanf(line_buf, V_FMT " " R_FMT, &cd->base.x, &cd->base.y,
 	       &cd->base.z, &cd->base_radius) != 4)
 	return (1);
 
     /* and the apex stuff */
     Next_line();
-    if (sscanf(line_buf, "%lg %lg %lg %lg", &cd->apex.x, &cd->apex.y,
+    if (sscanf(line_buf, V_FMT " " R_FMT, &cd->apex.x, &cd->apex.y,
 	       &cd->apex.z, &cd->apex_radius) != 4)
 	return (1);
 
     if (iflag)
 	Add_to_ilist(cd, I_OBJECT, T_CONE);
     else
+    {
 	Build_cone(cd);
+	free(cd);
+    }
     return (0);
 
 }
@@ -445,7 +508,7 @@ int Parse_sphere()
     if ((s = (SPHERE *) malloc(sizeof(SPHERE))) == NULL)
 	Bad_malloc();
 
-    if (sscanf(info_ptr, "%lg %lg %lg %lg", &s->center.x, &s->center.y,
+    if (sscanf(info_ptr, V_FMT " " R_FMT, &s->center.x, &s->center.y,
 	       &s->center.z, &s->radius) != 4)
 	return (1);
 
@@ -453,7 +516,10 @@ int Parse_sphere()
     if (iflag)
 	Add_to_ilist(s, I_OBJECT, T_SPHERE);
     else
+    {
 	Build_sphere(s);
+	free(s);
+    }
     return (0);
 }
 
@@ -473,7 +539,7 @@ int Parse_hallow_sphere()
     if ((s = (HSPHERE *) malloc(sizeof(HSPHERE))) == NULL)
 	Bad_malloc();
 
-    if (sscanf(info_ptr, "%lg %lg %lg %lg %lg", &s->center.x, &s->center.y,
+    if (sscanf(info_ptr, V_FMT " " R_FMT " %lg", &s->center.x, &s->center.y,
 	       &s->center.z, &s->radius, &thickness) != 5)
 	return (1);
 
@@ -482,7 +548,10 @@ int Parse_hallow_sphere()
     if (iflag)
 	Add_to_ilist(s, I_OBJECT, T_HSPHERE);
     else
+    {
 	Build_hsphere(s);
+	free(s);
+    }
     return (0);
 }
 
@@ -501,17 +570,16 @@ int Parse_poly()
     if (sscanf(info_ptr, "%d", &np) != 1)
 	return (1);
 
-    if ((p = (POLYGON *) malloc(sizeof(POLYGON) + (sizeof(VECTOR) * (np - 1))))
-	== NULL)
-	Bad_malloc();
-
     if (np < 3)
 	return (1);
 
+    if ((p = (POLYGON *) malloc(POLY_SIZE(np))) == NULL)
+	Bad_malloc();
+
     for (i = 0; i < np; i++)
     {
 	Next_line();
-	if (sscanf(line_buf, "%lg %lg %lg", &p->points[i].x, &p->points[i].y,
+	if (sscanf(line_buf, V_FMT, &p->points[i].x, &p->points[i].y,
 		   &p->points[i].z) != 3)
 	    return (1);
     }
@@ -521,7 +589,73 @@ int Parse_poly()
     if (iflag)
 	Add_to_ilist(p, I_OBJECT, T_POLYGON);
     else
+    {
 	Build_poly(p);
+	free(p);
+    }
+    return (0);
+}
+
+/*
+ * Parse_mesh()
+ * 
+ * Parse a triangle mesh. The format is:
+ * 
+ * mesh total_vertices total_triangles
+ * 
+ * followed by a line of x y z for each vertex, then a line of three vertex
+ * numbers, counted from 0, for each triangle.
+ */
+
+int Parse_mesh()
+{
+    MESH           *m;
+    TRIANGLE       *tri;
+    int             nv, nt, i, j;
+
+    if (sscanf(info_ptr, "%d %d", &nv, &nt) != 2)
+	return (1);
+
+    if (nv < 3 || nt < 1)
+	return (1);
+
+    /* the vertices and triangles come right after the mesh */
+    if ((m = (MESH *) malloc(sizeof(MESH) + sizeof(VECTOR) * nv +
+			     sizeof(TRIANGLE) * nt)) == NULL)
+	Bad_malloc();
+
+    m->nverts = nv;
+    m->ntris = nt;
+    m->verts = (VECTOR *) (m + 1);
+    m->tris = (TRIANGLE *) (m->verts + nv);
+
+    for (i = 0; i < nv; i++)
+    {
+	Next_line();
+	if (sscanf(line_buf, V_FMT, &m->verts[i].x, &m->verts[i].y,
+		   &m->verts[i].z) != 3)
+	    return (1);
+    }
+
+    for (i = 0; i < nt; i++)
+    {
+	tri = &m->tris[i];
+	tri->mesh = m;
+
+	Next_line();
+	if (sscanf(line_buf, "%d %d %d", &tri->v[0], &tri->v[1],
+		   &tri->v[2]) != 3)
+	    return (1);
+
+	for (j = 0; j < 3; j++)
+	    if (tri->v[j] < 0 || tri->v[j] >= nv)
+		return (1);
+    }
+
+    if (iflag)
+	Add_to_ilist(m, I_OBJECT, T_TRIANGLE);
+    else
+	Build_mesh(m);
     return (0);
 }
 
@@ -540,7 +674,7 @@ int Parse_ring()
     if ((r = (RING *) malloc(sizeof(RING))) == NULL)
 	Bad_malloc();
 
-    if (sscanf(info_ptr, "%lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg",
+    if (sscanf(info_ptr, V_FMT " " V_FMT " " V_FMT " " R_FMT " " R_FMT,
 	       &r->center.x, &r->center.y, &r->center.z,
 	       &r->point1.x, &r->point1.y, &r->point1.z,
 	       &r->point2.x, &r->point2.y, &r->point2.z,
@@ -550,7 +684,10 @@ int Parse_ring()
     if (iflag)
 	Add_to_ilist(r, I_OBJECT, T_RING);
     else
+    {
 	Build_ring(r);
+	free(r);
+    }
     return (0);
 }
 
@@ -577,7 +714,7 @@ int Parse_quadric()
      * Get the center of the quadratic.
      */
 
-    if (sscanf(info_ptr, "%lg %lg %lg", &q->loc.x, &q->loc.y, &q->loc.z) != 3)
+    if (sscanf(info_ptr, V_FMT, &q->loc.x, &q->loc.y, &q->loc.z) != 3)
 	return (1);
 
     /*
@@ -585,7 +722,7 @@ int Parse_quadric()
      */
 
     Next_line();
-    if (sscanf(line_buf, "%lg %lg %lg %lg %lg %lg",
+    if (sscanf(line_buf, V_FMT " " V_FMT,
 	       &q->min.x, &q->min.y, &q->min.z,
 	       &q->max.x, &q->max.y, &q->max.z) != 6)
 	return (1);
@@ -611,7 +748,10 @@ int Parse_quadric()
     if (iflag)
 	Add_to_ilist(q, I_OBJECT, T_QUADRIC);
     else
+    {
 	Build_quadric(q);
+	free(q);
+    }
     return (0);
 }
 
@@ -660,7 +800,7 @@ int Parse_instance()
     if ((i = (INSTANCE *) malloc(sizeof(INSTANCE))) == NULL)
 	Bad_malloc();
 
-    if ((i->name = malloc(strlen(name))) == NULL)
+    if ((i->name = malloc(strlen(name) + 1)) == NULL)
 	Bad_malloc();
 
     strcpy(i->name, name);
@@ -699,23 +839,27 @@ int Parse_end_instance()
 /*
  * Parse_instanceof()
  * 
- * Build the instance requested using the given offset. Format is
+ * Place the instance requested at the given offset. Format is
  * 
  * instance_of fubar loc.x loc.y loc.z
+ * 
+ * or, to turn and scale it as well, the rows of a 3x4 matrix whose last
+ * column is the offset
+ * 
+ * instance_of fubar m00 m01 m02 loc.x m10 m11 m12 loc.y m20 m21 m22 loc.z
+ * 
+ * The objects of the instance are not copied. All of the placements share
+ * one hierarchy built over the objects as they were defined.
  */
 
 int Parse_instanceof()
 {
     INSTANCE       *inst;
-    SPHERE         *s;
-    HSPHERE        *hs;
-    POLYGON        *p, *p1;
-    CONE           *c;
-    RING           *r;
-    QUADRIC        *q;
+    OBJECT         *tree;
     VECTOR          off;
+    double          v[12], m[3][3];
     char            name[32];
-    int             i, size;
+    int             i, n;
 
     if (iflag)
     {
@@ -740,107 +884,48 @@ int Parse_instanceof()
 
     inst = instances[i];
 
-    /* get the offset for this instance */
-    if (sscanf(info_ptr, "%lg %lg %lg", &off.x, &off.y, &off.z) != 3)
+    /* get the offset for this instance, or its matrix */
+    n = sscanf(info_ptr, "%lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg %lg",
+	       &v[0], &v[1], &v[2], &v[3], &v[4], &v[5],
+	       &v[6], &v[7], &v[8], &v[9], &v[10], &v[11]);
+
+    if (n == 3)
     {
-	fprintf(stderr, "%s: missing instance location.\n", my_name);
-	return (1);
+	off.x = v[0];
+	off.y = v[1];
+	off.z = v[2];
     }
-
-    /* skip the first one */
-    inst = inst->next;
-
-    while (inst)
+    else if (n == 12)
     {
-	switch (inst->type)
+	for (i = 0; i < 3; i++)
 	{
-	case I_SURFACE:
-	    cur_surface = (SURFACE *) inst->data;
-	    break;
-
-	case I_OBJECT:
-	    switch (inst->subtype)
-	    {
-	    case T_POLYGON:
-		p1 = (POLYGON *) inst->data;
-		size = sizeof(POLYGON) + (sizeof(VECTOR) * (p1->npoints - 1));
-		if ((p = (POLYGON *) malloc(size)) == NULL)
-		    Bad_malloc();
-		memcpy(p, p1, size);
-
-		for (i = 0; i < p->npoints; i++)
-		{
-		    VecAdd(off, p->points[i], p->points[i]);
-		}
-		Build_poly(p);
-		break;
-
-	    case T_SPHERE:
-		if ((s = (SPHERE *) malloc(sizeof(SPHERE))) == NULL)
-		    Bad_malloc();
-
-		memcpy(s, inst->data, sizeof(SPHERE));
-
-		VecAdd(off, s->center, s->center);
-		Build_sphere(s);
-		break;
-
-	    case T_HSPHERE:
-		if ((hs = (HSPHERE *) malloc(sizeof(HSPHERE))) == NULL)
-		    Bad_malloc();
-
-		memcpy(hs, inst->data, sizeof(HSPHERE));
-		VecAdd(off, hs->center, hs->center);
-		Build_hsphere(hs);
-		break;
-
-	    case T_CONE:
-		if ((c = (CONE *) malloc(sizeof(CONE))) == NULL)
-		    Bad_malloc();
-		memcpy(c, inst->data, sizeof(CONE));
-
-		VecAdd(off, c->base, c->base);
-		VecAdd(off, c->apex, c->apex);
-		Build_cone(c);
-		break;
-
-	    case T_RING:
-		if ((r = (RING *) malloc(sizeof(RING))) == NULL)
-		    Bad_malloc();
-		memcpy(r, inst->data, sizeof(RING));
-
-		VecAdd(off, r->center, r->center);
-		VecAdd(off, r->point1, r->point1);
-		VecAdd(off, r->point2, r->point2);
-
-		Build_ring(r);
-		break;
-
-	    case T_QUADRIC:
-		if ((q = (QUADRIC *) malloc(sizeof(QUADRIC))) == NULL)
-		    Bad_malloc();
-		memcpy(q, inst->data, sizeof(QUADRIC));
-
-		VecAdd(off, q->loc, q->loc);
-		VecAdd(off, q->min, q->min);
-		VecAdd(off, q->max, q->max);
+	    m[i][0] = v[i * 4];
+	    m[i][1] = v[i * 4 + 1];
+	    m[i][2] = v[i * 4 + 2];
+	}
 
-		Build_quadric(q);
-		break;
+	off.x = v[3];
+	off.y = v[7];
+	off.z = v[11];
+    }
+    else
+    {
+	fprintf(stderr, "%s: bad instance location, give 3 numbers or 12.\n",
+		my_name);
+	return (1);
+    }
 
-	    default:
-		fprintf(stderr, "%s: internal error 01.\n", my_name);
-		return (1);
-	    }
-	    break;
+    if ((tree = Instance_tree(inst)) != NULL)
+	Build_instance(tree, &off, n == 12 ? m : NULL);
 
-	default:
-	    fprintf(stderr, "%s: internal error 02.\n", my_name);
-	    return (1);
-	}
+    /*
+     * The surfaces of the instance stay in effect after it, as if its
+     * objects had been given right here.
+     */
 
-	inst = inst->next;
-    }
+    for (inst = inst->next; inst; inst = inst->next)
+	if (inst->type == I_SURFACE)
+	    cur_surface = (SURFACE *) inst->data;
 
     return (0);
 }
@@ -0,0 +1,390 @@
+/*
+ * instance.c
+ *
+ * This module takes care of the placements made with instance_of. The
+ * objects of an instance definition are built only once, into a bounding box
+ * hierarchy of their own. Every placement is a single object in the scene
+ * which points at that hierarchy and says how far it is moved, and how it
+ * is turned or scaled if it is. Rays are taken back into the space of the
+ * definition before they are traced through the shared hierarchy, so a
+ * part which is repeated at many angles is still only built once.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rt.h"
+#include "externs.h"
+
+int             Instance_intersect();
+void		Instance_normal();
+
+/*
+ * The hierarchy of an instance definition. It hangs off the data pointer of
+ * the head of the definition's list.
+ */
+
+typedef struct inst_tree
+{
+	OBJECT         *root;	/* root of the hierarchy	 */
+	OBJECT        **list;	/* primitives and composites	 */
+	int             num;	/* number of entries in list	 */
+}               INST_TREE;
+
+/*
+ * Instance_tree()
+ *
+ * Return the root of the hierarchy of the given instance definition, or
+ * NULL if it has no objects. The hierarchy is built the first time the
+ * definition is placed. Objects which come before any surface in the
+ * definition are left without one; they take the surface of the placement.
+ */
+
+OBJECT *Instance_tree(INSTANCE *head)
+{
+    INST_TREE      *it;
+    INSTANCE       *inst;
+    SURFACE        *save_surface;
+    OBJECT         *save_root;
+    int             first;
+
+    if (head->data != NULL)
+	return (((INST_TREE *) head->data)->root);
+
+    if ((it = (INST_TREE *) malloc(sizeof(INST_TREE))) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    save_surface = cur_surface;
+    save_root = root;
+    cur_surface = NULL;
+
+    /*
+     * Build the objects at the end of the object list, put a hierarchy
+     * over them, then take all of it back off of the list.
+     */
+
+    first = nobjects;
+
+    for (inst = head->next; inst; inst = inst->next)
+    {
+	if (inst->type == I_SURFACE)
+	{
+	    cur_surface = (SURFACE *) inst->data;
+	    continue;
+	}
+
+	switch (inst->subtype)
+	{
+	case T_POLYGON:
+	    Build_poly((POLYGON *) inst->data);
+	    break;
+
+	case T_SPHERE:
+	    Build_sphere((SPHERE *) inst->data);
+	    break;
+
+	case T_HSPHERE:
+	    Build_hsphere((HSPHERE *) inst->data);
+	    break;
+
+	case T_CONE:
+	    Build_cone((CONE *) inst->data);
+	    break;
+
+	case T_RING:
+	    Build_ring((RING *) inst->data);
+	    break;
+
+	case T_QUADRIC:
+	    Build_quadric((QUADRIC *) inst->data);
+	    break;
+
+	case T_TRIANGLE:
+	    Build_mesh((MESH *) inst->data);
+	    break;
+
+	default:
+	    fprintf(stderr, "%s: internal error 01.\n", my_name);
+	    exit(1);
+	}
+    }
+
+    if (nobjects == first)
+    {
+	it->root = NULL;
+	it->list = NULL;
+	it->num = 0;
+    }
+    else
+    {
+	it->root = Build_group_slabs(first);
+	it->num = nobjects - first;
+
+	if ((it->list = (OBJECT **) malloc(sizeof(OBJECT *) * it->num)) == NULL)
+	{
+	    fprintf(stderr, "%s: malloc failed\n", my_name);
+	    exit(1);
+	}
+	memcpy(it->list, objects + first, sizeof(OBJECT *) * it->num);
+	nobjects = first;
+    }
+
+    cur_surface = save_surface;
+    root = save_root;
+
+    head->data = (void *) it;
+    return (it->root);
+}
+
+/*
+ * Free_instance_tree()
+ *
+ * Release the hierarchy of the given instance definition, if it was built.
+ * The object data itself belongs to the definition's list.
+ */
+
+void Free_instance_tree(INSTANCE *head)
+{
+    INST_TREE      *it;
+    int             i;
+
+    if ((it = (INST_TREE *) head->data) == NULL)
+	return;
+
+    for (i = 0; i < it->num; i++)
+    {
+	if (it->list[i]->type == T_COMPOSITE)
+	    free(it->list[i]->obj);
+	free(it->list[i]);
+    }
+
+    free(it->list);
+    free(it);
+    head->data = NULL;
+}
+
+/*
+ * Mat_apply()
+ *
+ * Multiply the vector by the matrix.
+ */
+
+static void Mat_apply(double m[3][3], VECTOR *v, VECTOR *out)
+{
+    double          x, y, z;
+
+    x = m[0][0] * v->x + m[0][1] * v->y + m[0][2] * v->z;
+    y = m[1][0] * v->x + m[1][1] * v->y + m[1][2] * v->z;
+    z = m[2][0] * v->x + m[2][1] * v->y + m[2][2] * v->z;
+
+    out->x = x;
+    out->y = y;
+    out->z = z;
+}
+
+/*
+ * Mat_invert()
+ *
+ * Find the inverse of the matrix. Returns 0 if it has none.
+ */
+
+static int Mat_invert(double m[3][3], double inv[3][3])
+{
+    double          det;
+    int             i, j;
+
+    inv[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    inv[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+    inv[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+    inv[1][0] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    inv[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+    inv[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+    inv[2][0] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    inv[2][1] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+    inv[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+
+    det = m[0][0] * inv[0][0] + m[0][1] * inv[1][0] + m[0][2] * inv[2][0];
+    if (fabs(det) < MIN_T)
+	return (0);
+
+    for (i = 0; i < 3; i++)
+	for (j = 0; j < 3; j++)
+	    inv[i][j] /= det;
+
+    return (1);
+}
+
+/*
+ * Build_instance()
+ *
+ * Place the given hierarchy in the scene, moved by the given offset. If 'm'
+ * is not NULL, the hierarchy is first turned and scaled by it.
+ */
+
+void Build_instance(OBJECT *tree, VECTOR *offset, double m[3][3])
+{
+    OBJECT         *o;
+    PLACEMENT       pl;
+    VECTOR          c;
+    int             i;
+
+    memset(&pl, 0, sizeof(PLACEMENT));
+    pl.tree = tree;
+    pl.offset = *offset;
+    pl.first = 0;
+
+    if (m != NULL)
+    {
+	if (!Mat_invert(m, pl.inv))
+	{
+	    fprintf(stderr, "%s: instance matrix can't be inverted.\n",
+		    my_name);
+	    exit(1);
+	}
+
+	memcpy(pl.m, m, sizeof(pl.m));
+	pl.turned = 1;
+    }
+
+    o = New_object(T_INSTANCE, &pl, sizeof(PLACEMENT));
+    o->inter = Instance_intersect;
+    o->normal = Instance_normal;
+
+    if (m == NULL)
+    {
+	VecAdd(tree->b_min, *offset, o->b_min);
+	VecAdd(tree->b_max, *offset, o->b_max);
+	return;
+    }
+
+    /* the box has to take in all eight corners of the turned one */
+    o->b_min.x = o->b_min.y = o->b_min.z = HUGE;
+    o->b_max.x = o->b_max.y = o->b_max.z = -HUGE;
+
+    for (i = 0; i < 8; i++)
+    {
+	c.x = (i & 1) ? tree->b_max.x : tree->b_min.x;
+	c.y = (i & 2) ? tree->b_max.y : tree->b_min.y;
+	c.z = (i & 4) ? tree->b_max.z : tree->b_min.z;
+
+	Mat_apply(m, &c, &c);
+	VecAdd(c, *offset, c);
+
+	o->b_min.x = MIN(c.x, o->b_min.x);
+	o->b_min.y = MIN(c.y, o->b_min.y);
+	o->b_min.z = MIN(c.z, o->b_min.z);
+
+	o->b_max.x = MAX(c.x, o->b_max.x);
+	o->b_max.y = MAX(c.y, o->b_max.y);
+	o->b_max.z = MAX(c.z, o->b_max.z);
+    }
+}
+
+/*
+ * Instance_intersect()
+ *
+ * Move the ray into the space of the instance definition and trace it
+ * through the shared hierarchy. The distance along the ray is the same in
+ * both spaces, unless the placement is scaled. Then the direction is made a
+ * unit vector again there, and the distance found is scaled back.
+ */
+
+int Instance_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
+{
+    PLACEMENT      *pl;
+    RAY             r;
+    double          len = 1.0;
+
+    pl = (PLACEMENT *) obj->obj;
+
+    VecSub(ray->pos, pl->offset, r.pos);
+    r.dir = ray->dir;
+
+    if (pl->turned)
+    {
+	Mat_apply(pl->inv, &r.pos, &r.pos);
+	Mat_apply(pl->inv, &r.dir, &r.dir);
+	len = VecNormalize(&r.dir);
+    }
+
+    if (use_stackless)
+    {
+	if (!Intersect_skip(pl->first, &r, inter, 0))
+	    return (0);
+    }
+    else if (!Intersect_tree(pl->tree, &r, inter, 0))
+	return (0);
+
+    if (pl->turned)
+	inter->t /= len;
+
+    inter->inst = obj;
+    return (1);
+}
+
+/*
+ * Placement_normal()
+ *
+ * Find the normal of an object of an instance definition which was hit in
+ * the given placement. The object's own normal routine is called where the
+ * object really is, in the space of the definition. A turned normal is
+ * taken back by the transpose of the inverse, which keeps it square to the
+ * surface when the placement is scaled unevenly.
+ */
+
+void Placement_normal(PLACEMENT *pl, OBJECT *obj, RAY *ray, VECTOR *ip,
+		      VECTOR *normal)
+{
+    RAY             r;
+    VECTOR          lip, n;
+
+    VecSub(*ip, pl->offset, lip);
+
+    if (!pl->turned)
+    {
+	(*obj->normal) (obj->obj, ray, &lip, normal);
+	return;
+    }
+
+    Mat_apply(pl->inv, &lip, &lip);
+    VecSub(ray->pos, pl->offset, r.pos);
+    Mat_apply(pl->inv, &r.pos, &r.pos);
+    Mat_apply(pl->inv, &ray->dir, &r.dir);
+    VecNormalize(&r.dir);
+
+    (*obj->normal) (obj->obj, &r, &lip, &n);
+
+    normal->x = pl->inv[0][0] * n.x + pl->inv[1][0] * n.y + pl->inv[2][0] * n.z;
+    normal->y = pl->inv[0][1] * n.x + pl->inv[1][1] * n.y + pl->inv[2][1] * n.z;
+    normal->z = pl->inv[0][2] * n.x + pl->inv[1][2] * n.y + pl->inv[2][2] * n.z;
+    VecNormalize(normal);
+}
+
+/*
+ * Instance_normal()
+ *
+ * Intersections with a placement are reported against the primitive which
+ * was hit, so this is never called.
+ */
+
+void Instance_normal(PLACEMENT *pl, RAY *ray, VECTOR *ip, VECTOR *normal)
+{
+    fprintf(stderr, "%s: internal error 03.\n", my_name);
+    exit(1);
+}
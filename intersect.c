@@ -16,17 +16,22 @@
 
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
 #include "rt.h"
 #include "externs.h"
+#include "kernels.h"
+
+static int      ray_id = 0;	/* mailbox stamp of the current ray */
 
 /*
- * Check_and_push()
+ * Hit_bbox()
  * 
- * Check to see of this ray penatrate this bbox around the object. If so, push
- * it on the stack.
+ * Check to see of this ray penatrate this bbox around the object. Return 1
+ * if it does, 0 if not. The flattened hierarchies call this before testing
+ * an object, so that they test just the objects this traversal does.
  */
 
-void Check_and_push(OBJECT *obj, RAY  *ray)
+int Hit_bbox(OBJECT *obj, RAY  *ray)
 {
     VECTOR	mn, mx, r_dir, r_org;
     double		t_near, t_far, t1, t2;
@@ -44,7 +49,7 @@ void Check_and_push(OBJECT *obj, RAY  *ray)
     if (fabs(r_dir.x) < MIN_T)	/* parralel to the X slab */
     {
 	if (r_org.x < mn.x || r_org.x > mx.x)
-	    return;	/* can't possible hit this puppy */
+	    return (0);	/* can't possible hit this puppy */
     }
     else
     {
@@ -69,17 +74,17 @@ void Check_and_push(OBJECT *obj, RAY  *ray)
 	}
 
 	if (t_near > t_far)
-	    return;	/* no hitter			 */
+	    return (0);	/* no hitter			 */
 
 	if (t_far < MIN_T)
-	    return;	/* no hitter			 */
+	    return (0);	/* no hitter			 */
     }
 
     /* test the Y slab */
     if (fabs(r_dir.y) < MIN_T)	/* parralel to the Y slab */
     {
 	if (r_org.y < mn.y || r_org.y > mx.y)
-	    return;	/* can't possible hit this puppy */
+	    return (0);	/* can't possible hit this puppy */
     }
     else
     {
@@ -104,17 +109,17 @@ void Check_and_push(OBJECT *obj, RAY  *ray)
 	}
 
 	if (t_near > t_far)
-	    return;	/* no hitter			 */
+	    return (0);	/* no hitter			 */
 
 	if (t_far < MIN_T)
-	    return;	/* no hitter			 */
+	    return (0);	/* no hitter			 */
     }
 
     /* test the Z slab */
     if (fabs(r_dir.z) < MIN_T)	/* parralel to the Z slab */
     {
 	if (r_org.z < mn.z || r_org.z > mx.z)
-	    return;	/* can't possible hit this puppy */
+	    return (0);	/* can't possible hit this puppy */
     }
     else
     {
@@ -139,19 +144,31 @@ void Check_and_push(OBJECT *obj, RAY  *ray)
 	}
 
 	if (t_near > t_far)
-	    return;	/* no hitter			 */
+	    return (0);	/* no hitter			 */
 
 	if (t_far < MIN_T)
-	    return;	/* no hitter			 */
+	    return (0);	/* no hitter			 */
     }
 
     /*
      * This object passed all of the test. So this ray will hit this
-     * puppy. Push at on the stack.
+     * puppy.
      */
 
-    Push_object(obj);
+    return (1);
+}
+
+/*
+ * Check_and_push()
+ * 
+ * Check to see of this ray penatrate this bbox around the object. If so, push
+ * it on the stack.
+ */
 
+void Check_and_push(OBJECT *obj, RAY  *ray)
+{
+    if (Hit_bbox(obj, ray))
+	Push_object(obj);
 }
 
 /*
@@ -163,30 +180,73 @@ void Check_and_push(OBJECT *obj, RAY  *ray)
 
 int Intersect(RAY *ray, INTERSECT *inter)
 {
-    int             i, iflag;
-    INTERSECT       minter;
-    OBJECT         *obj;
-    COMPOSITE      *cd;
+    int             i;
 
-    iflag = 0;
     /*
      * If the root object is not a slab, then slimply call its inter
      * intersect routine and return.
      */
 
-    if (root->type != T_COMPOSITE)
+    if (!IS_NODE(root))
+    {
+	inter->inst = NULL;
 	return ((*root->inter) (root, ray, inter));
+    }
+
+    /*
+     * If objects can be reached through more than one leaf, stamp each
+     * one with the ray's id when it is tested so that it is only tested
+     * once. Clear all of the stamps when the id wraps around.
+     */
+
+    if (mailbox)
+    {
+	if (ray_id == INT_MAX)
+	{
+	    for (i = 0; i < nobjects; i++)
+		objects[i]->active = 0;
+	    ray_id = 0;
+	}
+	++ray_id;
+    }
+
+    if (use_stackless)
+	return (Intersect_skip(0, ray, inter, mailbox ? ray_id : 0));
+
+    if (use_qbvh)
+	return (Intersect_qbvh(ray, inter, mailbox ? ray_id : 0));
+
+    return (Intersect_tree(root, ray, inter, mailbox));
+}
+
+/*
+ * Intersect_tree()
+ * 
+ * Find the closest intersection of the ray with the objects under the given
+ * composite node. If 'stamp' is set, objects are stamped with the ray's id.
+ * The hierarchies of instance definitions are traced from inside of this,
+ * so only the part of the object stack above where it started is used.
+ */
+
+int Intersect_tree(OBJECT *node, RAY *ray, INTERSECT *inter, int stamp)
+{
+    int             i, iflag, base;
+    INTERSECT       minter;
+    OBJECT         *obj;
+    COMPOSITE      *cd;
+
+    iflag = 0;
 
     /*
      * Push root node an top of stack and check to set if we hit
      * anything.
      */
 
-    stack_cnt = 0;
+    base = stack_cnt;
 
-    Check_and_push(root, ray);
+    Check_and_push(node, ray);
 
-    while (stack_cnt != 0)
+    while (stack_cnt != base)
     {
 
 	obj = Pop_object();
@@ -197,7 +257,7 @@ int Intersect(RAY *ray, INTERSECT *inter)
 	 */
 
 
-	if (obj->type == T_COMPOSITE)
+	if (IS_NODE(obj))
 	{
 	    cd = (COMPOSITE *) obj->obj;
 	    for (i = 0; i < cd->num; i++)
@@ -205,19 +265,26 @@ int Intersect(RAY *ray, INTERSECT *inter)
 	}
 	else
 	{
+	    if (stamp)
+	    {
+		if (obj->active == ray_id)
+		    continue;
+		obj->active = ray_id;
+	    }
+
+	    /*
+	     * Keep the whole intersect record of the closest hit, so
+	     * that the inside flag is the one of that hit and not of
+	     * whatever was tested last.
+	     */
 
-	    if ((*obj->inter) (obj, ray, inter))
+	    inter->inst = NULL;
+	    if (INTERSECT_OBJECT(obj, ray, inter))
 	    {
-		if (iflag == 0)	/* first intersection */
+		if (iflag == 0 || CLOSER(inter, &minter))
 		{
 		    iflag = 1;
-		    minter.t = inter->t;
-		    minter.obj = inter->obj;
-		}
-		else if (minter.t > inter->t)
-		{
-		    minter.t = inter->t;
-		    minter.obj = obj;
+		    minter = *inter;
 		}
 	    }
 	}
@@ -225,12 +292,10 @@ int Intersect(RAY *ray, INTERSECT *inter)
 
     if (iflag)
     {
-	inter->t = minter.t;
-	inter->obj = minter.obj;
+	*inter = minter;
 	return (1);
     }
     else
 	return (0);
 
 }
-
@@ -0,0 +1,193 @@
+/*
+ * kernels.h - the intersect routines of the primitives which make up the
+ * big scenes: spheres, mesh triangles, and triangles and convex quads.
+ *
+ * They are kept here as static inline routines so that the traversals can
+ * test an object of one of these types without a call through its function
+ * pointer, and so with the routine compiled right into the loop.
+ * Sphere_intersect(), Tri_intersect() and Convex_intersect() are the same
+ * routines, for the function pointers and the other callers.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <math.h>
+
+/*
+ * Sphere_hit()
+ *
+ * Check given sphere for intersection with given ray. Return TRUE if an
+ * intersection takes place.
+ */
+
+static inline int Sphere_hit(OBJECT *obj, RAY *ray, INTERSECT *inter)
+{
+    SPHERE         *s;
+    VECTOR          oc;
+    double          l2oc, tca, t2hc, disc;
+    double          t;
+
+    s = obj->obj;
+
+    /* calculate the origin to center vector */
+
+    VecSub(s->center, ray->pos, oc);
+    l2oc = VecDot(oc, oc);
+
+    /* find out the closest approach along the ray */
+    tca = VecDot(oc, ray->dir);
+    t2hc = s->radius2 - l2oc + (tca * tca);
+
+    /* if the discriminator < 0, then the ray will not hit */
+    if (t2hc < MIN_T)
+	return (0);
+
+    disc = sqrt(t2hc);
+
+    /* if ray is inside object, set the inside flag */
+    if (l2oc > s->radius2 + MIN_T)
+    {
+	inter->inside = 0;
+	t = tca - disc;
+    }
+    else
+    {
+	inter->inside = 1;
+	t = tca + disc;
+    }
+
+    if (t < MIN_T)
+	return (0);
+
+    inter->obj = obj;
+    inter->t = t;
+
+    return (1);
+}
+
+/*
+ * Tri_hit()
+ *
+ * Check a triangle of a mesh for intersection with the given ray, by the
+ * Moller-Trumbore test.
+ */
+
+static inline int Tri_hit(OBJECT *obj, RAY *ray, INTERSECT *inter)
+{
+    TRIANGLE       *tri;
+    VECTOR         *v0, e1, e2, p, s, q;
+    double          det, inv, u, v, t;
+
+    tri = obj->obj;
+    v0 = &tri->mesh->verts[tri->v[0]];
+
+    VecSub(tri->mesh->verts[tri->v[1]], *v0, e1);
+    VecSub(tri->mesh->verts[tri->v[2]], *v0, e2);
+
+    VecCross(ray->dir, e2, p);
+    det = VecDot(e1, p);
+
+    /* the ray runs along the plane, or the triangle is a line */
+    if (det == 0.0)
+	return (0);
+
+    inv = 1.0 / det;
+
+    VecSub(ray->pos, *v0, s);
+    u = VecDot(s, p) * inv;
+    if (u < 0.0 || u > 1.0)
+	return (0);
+
+    VecCross(s, e1, q);
+    v = VecDot(ray->dir, q) * inv;
+    if (v < 0.0 || u + v > 1.0)
+	return (0);
+
+    t = VecDot(e2, q) * inv;
+    if (t < MIN_T)
+	return (0);
+
+    inter->t = t;
+    inter->obj = obj;
+    inter->inside = 0;
+
+    return (1);
+}
+
+/*
+ * Convex_hit()
+ *
+ * Check a triangle or convex quad for intersection with the given ray, the
+ * same way Poly_intersect() does, but with the lines of its edges worked out
+ * ahead of time. The point hit on the plane is inside if it is well on the
+ * inner side of every edge, so there is no division past the one for the
+ * plane. A point within EDGE_BAND of an edge is left to Poly_crossing(),
+ * so that an edge shared by two polygons belongs to just one of them.
+ */
+
+static inline int Convex_hit(OBJECT *obj, RAY *ray, INTERSECT *inter)
+{
+    POLYGON        *p;
+    REAL            (*e)[3];
+    double          vo, vd, t, u, v, d;
+    int             i, near;
+
+    p = obj->obj;
+
+    vd = VecDot(ray->dir, p->normal);
+
+    if (fabs(vd) < MIN_T)
+	return (0);
+
+    vo = VecDot(ray->pos, p->normal) + p->d;
+
+    t = -vo / vd;
+    if (t < MIN_T)
+	return (0);
+
+    /* the point of intersection on the plane of the dominant normals */
+    u = ((REAL *) &ray->pos)[p->p1] + t * ((REAL *) &ray->dir)[p->p1];
+    v = ((REAL *) &ray->pos)[p->p2] + t * ((REAL *) &ray->dir)[p->p2];
+
+    e = POLY_EDGES(p);
+    near = 0;
+
+    for (i = 0; i < p->npoints; i++)
+    {
+	d = e[i][0] * u + e[i][1] * v + e[i][2];
+	if (d < -EDGE_BAND)
+	    return (0);
+	if (d <= EDGE_BAND)
+	    near = 1;
+    }
+
+    if (near && !Poly_crossing(p, u, v))
+	return (0);
+
+    inter->t = t;
+    inter->obj = obj;
+    inter->inside = 0;
+
+    return (1);
+}
+
+/*
+ * Test an object for intersection. The types above are tested by the
+ * routines here, compiled into the caller; a polygon only if it uses the
+ * convex test. Everything else goes through its pointer.
+ */
+
+#define INTERSECT_OBJECT(o, r, i) \
+	((o)->type == T_SPHERE ? Sphere_hit(o, r, i) : \
+	 (o)->type == T_TRIANGLE ? Tri_hit(o, r, i) : \
+	 (o)->inter == Convex_intersect ? Convex_hit(o, r, i) : \
+	 (*(o)->inter) (o, r, i))
@@ -0,0 +1,124 @@
+/*
+ * layout.c
+ *
+ * This module works out the van Emde Boas order of a flattened hierarchy.
+ * The tree is cut across the middle of its height. The top half is laid out
+ * first, then each of the subtrees hanging below it, and every part is laid
+ * out the same way in turn. Whatever the size of a cache line or a page, a
+ * path from the root down to a leaf then crosses few of them, where depth
+ * first order keeps only the left-most paths together.
+ *
+ * The flattened copies of the hierarchy number their nodes their own ways,
+ * so the children of a node are asked for through a function.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rt.h"
+#include "externs.h"
+
+static int      (*children) (int node, int *child);
+static int     *order;
+static int      norder;
+
+static void     Lay_out_part(int node, int levels);
+
+/*
+ * Height()
+ *
+ * Return the number of levels of the subtree under the given node.
+ */
+
+static int Height(int node)
+{
+    int             child[MAX_GROUP];
+    int             i, n, h, best;
+
+    n = (*children) (node, child);
+
+    best = 0;
+    for (i = 0; i < n; i++)
+    {
+	h = Height(child[i]);
+	best = MAX(best, h);
+    }
+
+    return (best + 1);
+}
+
+/*
+ * Lay_out_below()
+ *
+ * Lay out the parts of the given levels of the subtrees which start the
+ * given number of levels below the given node.
+ */
+
+static void Lay_out_below(int node, int down, int levels)
+{
+    int             child[MAX_GROUP];
+    int             i, n;
+
+    if (down == 0)
+    {
+	Lay_out_part(node, levels);
+	return;
+    }
+
+    n = (*children) (node, child);
+    for (i = 0; i < n; i++)
+	Lay_out_below(child[i], down - 1, levels);
+}
+
+/*
+ * Lay_out_part()
+ *
+ * Add the top levels of the subtree under the given node to the order, top
+ * half first, then the parts below it.
+ */
+
+static void Lay_out_part(int node, int levels)
+{
+    int             top;
+
+    if (levels == 1)
+    {
+	order[norder++] = node;
+	return;
+    }
+
+    top = levels / 2;
+    Lay_out_part(node, top);
+    Lay_out_below(node, top, levels - top);
+}
+
+/*
+ * Veb_order()
+ *
+ * Put the nodes of the tree under the given root into 'order' in van Emde
+ * Boas order, and return how many there are. The root is always first.
+ * 'kids' fills in the children of a node and returns their number, which is
+ * at most MAX_GROUP.
+ */
+
+int Veb_order(int root, int (*kids) (int node, int *child), int *list)
+{
+    children = kids;
+    order = list;
+    norder = 0;
+
+    Lay_out_part(root, Height(root));
+
+    return (norder);
+}
@@ -0,0 +1,273 @@
+/*
+ * light.c
+ *
+ * This module finds the lights which can matter at a point. A light given
+ * without an intensity lights the whole scene, as it always has. One given
+ * with an intensity falls off with the square of the distance, so past
+ * some range what it adds is less than light_cutoff, and it is left out.
+ * Such lights are kept in a bounding box hierarchy of their own, over the
+ * spheres they reach, so a point in a scene of hundreds of fixtures only
+ * has to shade, and cast shadow rays to, the few that are near it.
+ *
+ * The hierarchy is a binary one, split at the median of the light
+ * positions along their longest side, and is built again for every frame.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "rt.h"
+#include "externs.h"
+
+#define LIGHT_LEAF	4	/* most lights in a leaf */
+
+/*
+ * One node of the light hierarchy. A leaf holds 'count' lights of the
+ * order list from 'first' on. An inner node has its first child right
+ * after it, and its second at 'first'.
+ */
+
+typedef struct light_node
+{
+	double          b_min[3];	/* box around the lights' reach	 */
+	double          b_max[3];
+	int             first;	/* first light, or second child	 */
+	int             count;	/* lights in a leaf, 0 if inner	 */
+}               LIGHT_NODE;
+
+static LIGHT_NODE *lnodes = NULL;
+static int      nlnodes;
+static int     *order = NULL;	/* lights with falloff, by node */
+static int     *plain = NULL;	/* lights without falloff	 */
+static int      nplain;
+static int      sort_axis;
+
+/*
+ * Light_coord()
+ *
+ * Return one coordinate of the position of a light.
+ */
+
+static double Light_coord(int l, int axis)
+{
+    switch (axis)
+    {
+    case 0:
+	return (lights[l]->pos.x);
+    case 1:
+	return (lights[l]->pos.y);
+    default:
+	return (lights[l]->pos.z);
+    }
+}
+
+/*
+ * Compare_lights()
+ *
+ * Compare the positions of two lights along sort_axis, for qsort().
+ */
+
+static int Compare_lights(const void *p1, const void *p2)
+{
+    double          c1, c2;
+
+    c1 = Light_coord(*(int *) p1, sort_axis);
+    c2 = Light_coord(*(int *) p2, sort_axis);
+
+    if (c1 < c2)
+	return (-1);
+    else if (c1 > c2)
+	return (1);
+    else
+	return (0);
+}
+
+/*
+ * Build_lnode()
+ *
+ * Build the node over the 'count' lights of the order list from 'first' on,
+ * and everything under it.
+ */
+
+static void Build_lnode(int first, int count)
+{
+    LIGHT_NODE     *ln;
+    double          lo[3], hi[3], c;
+    int             i, j, n, axis;
+
+    n = nlnodes++;
+    ln = &lnodes[n];
+
+    for (j = 0; j < 3; j++)
+    {
+	ln->b_min[j] = lo[j] = HUGE;
+	ln->b_max[j] = hi[j] = -HUGE;
+    }
+
+    for (i = first; i < first + count; i++)
+    {
+	for (j = 0; j < 3; j++)
+	{
+	    c = Light_coord(order[i], j);
+	    ln->b_min[j] = MIN(c - lights[order[i]]->range, ln->b_min[j]);
+	    ln->b_max[j] = MAX(c + lights[order[i]]->range, ln->b_max[j]);
+	    lo[j] = MIN(c, lo[j]);
+	    hi[j] = MAX(c, hi[j]);
+	}
+    }
+
+    if (count <= LIGHT_LEAF)
+    {
+	ln->first = first;
+	ln->count = count;
+	return;
+    }
+
+    axis = 0;
+    for (j = 1; j < 3; j++)
+	if (hi[j] - lo[j] > hi[axis] - lo[axis])
+	    axis = j;
+
+    sort_axis = axis;
+    qsort(order + first, count, sizeof(int), Compare_lights);
+
+    ln->count = 0;
+    Build_lnode(first, count / 2);
+    lnodes[n].first = nlnodes;
+    Build_lnode(first + count / 2, count - count / 2);
+}
+
+/*
+ * Build_light_tree()
+ *
+ * Work out how far each light with falloff reaches, and build the light
+ * hierarchy over them. The lights of the last frame are thrown away.
+ */
+
+void Build_light_tree()
+{
+    LIGHT          *l;
+    int             i, nfall;
+
+    free(lnodes);
+    free(order);
+    free(plain);
+
+    if ((lnodes = (LIGHT_NODE *) malloc(sizeof(LIGHT_NODE) *
+					(2 * nlights))) == NULL ||
+	(order = (int *) malloc(sizeof(int) * nlights)) == NULL ||
+	(plain = (int *) malloc(sizeof(int) * nlights)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    nlnodes = nplain = nfall = 0;
+
+    for (i = 0; i < nlights; i++)
+    {
+	l = lights[i];
+
+	if (!l->falloff)
+	{
+	    plain[nplain++] = i;
+	    continue;
+	}
+
+	/* past the range, intensity / d^2 is below the cutoff */
+	if (light_cutoff > 0.0)
+	    l->range = sqrt(l->intensity / light_cutoff);
+	else
+	    l->range = HUGE;
+
+	order[nfall++] = i;
+    }
+
+    if (nfall > 0)
+	Build_lnode(0, nfall);
+
+    if (verbose && nfall > 0)
+    {
+	fprintf(stderr, "%s: light hierarchy: %d lights with falloff in "
+		"%d nodes\n", my_name, nfall, nlnodes);
+    }
+}
+
+/*
+ * Start_lights()
+ *
+ * Start a walk over the lights which can reach the given point.
+ */
+
+void Start_lights(LIGHT_WALK *w, VECTOR *pos)
+{
+    w->pos = *pos;
+    w->plain = 0;
+    w->leaf = w->end = 0;
+    w->sp = 0;
+
+    if (nlnodes > 0)
+	w->stack[w->sp++] = 0;
+}
+
+/*
+ * Next_light()
+ *
+ * Return the next light of the walk, or -1 when there are no more. A light
+ * with falloff is only returned if the point is within its range.
+ */
+
+int Next_light(LIGHT_WALK *w)
+{
+    LIGHT_NODE     *ln;
+    VECTOR          d;
+    int             l;
+
+    if (w->plain < nplain)
+	return (plain[w->plain++]);
+
+    for (;;)
+    {
+	while (w->leaf < w->end)
+	{
+	    l = order[w->leaf++];
+	    VecSub(lights[l]->pos, w->pos, d);
+	    if (VecDot(d, d) <= lights[l]->range * lights[l]->range)
+		return (l);
+	}
+
+	if (w->sp == 0)
+	    return (-1);
+
+	ln = &lnodes[w->stack[--w->sp]];
+
+	if (w->pos.x < ln->b_min[0] || w->pos.x > ln->b_max[0] ||
+	    w->pos.y < ln->b_min[1] || w->pos.y > ln->b_max[1] ||
+	    w->pos.z < ln->b_min[2] || w->pos.z > ln->b_max[2])
+	    continue;
+
+	if (ln->count > 0)
+	{
+	    w->leaf = ln->first;
+	    w->end = ln->first + ln->count;
+	}
+	else
+	{
+	    /* the median split keeps the depth within the stack */
+	    w->stack[w->sp++] = ln->first;
+	    w->stack[w->sp++] = (ln - lnodes) + 1;
+	}
+    }
+}
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <ctype.h>
 #include <libgen.h>
 #include <getopt.h>
 
@@ -27,6 +28,23 @@
 
 #define VERSION "1.02"
 
+// Options which only have a long form
+#define OPT_SBVH_BUDGET		256
+#define OPT_REFIT_THRESHOLD	257
+#define OPT_BVH_CACHE		258
+#define OPT_QBVH		259
+#define OPT_BVH_STATS		260
+#define OPT_BRANCH_FACTOR	261
+#define OPT_LEAF_SIZE		262
+#define OPT_AUTOTUNE		263
+#define OPT_TREELETS		264
+#define OPT_STACKLESS		265
+#define OPT_BVH_LAYOUT		266
+#define OPT_SPLIT_POLYGONS	267
+#define OPT_SORT_RAYS		268
+#define OPT_PACKETS		269
+#define OPT_LIGHT_CUTOFF	270
+
 // Support command line options (passed to getopt())
 const struct option long_options[] = {
     {"help",			no_argument,           0, 'h'},
@@ -41,6 +59,23 @@ const struct option long_options[] = {
     {"start-y",			required_argument,  0, 'y'},
     {"inc-y",			required_argument,  0, 'i'},
     {"threads",			required_argument,  0, 't'},
+    {"sbvh",			no_argument,           0, 'b'},
+    {"sbvh-budget",		required_argument,  0, OPT_SBVH_BUDGET},
+    {"frames",			required_argument,  0, 'f'},
+    {"refit-threshold",	required_argument,  0, OPT_REFIT_THRESHOLD},
+    {"bvh-cache",		required_argument,  0, OPT_BVH_CACHE},
+    {"quantized-bvh",		no_argument,           0, OPT_QBVH},
+    {"bvh-stats",		optional_argument,  0, OPT_BVH_STATS},
+    {"branch-factor",		required_argument,  0, OPT_BRANCH_FACTOR},
+    {"leaf-size",		required_argument,  0, OPT_LEAF_SIZE},
+    {"autotune",		no_argument,           0, OPT_AUTOTUNE},
+    {"treelets",		optional_argument,  0, OPT_TREELETS},
+    {"stackless",		no_argument,           0, OPT_STACKLESS},
+    {"bvh-layout",		required_argument,  0, OPT_BVH_LAYOUT},
+    {"split-polygons",		optional_argument,  0, OPT_SPLIT_POLYGONS},
+    {"sort-rays",		no_argument,           0, OPT_SORT_RAYS},
+    {"packets",			optional_argument,  0, OPT_PACKETS},
+    {"light-cutoff",		required_argument,  0, OPT_LIGHT_CUTOFF},
     {0, 0, 0,  0}
 };
 
@@ -75,7 +110,71 @@ const char *help_msg =
     "        to 'incy'. This option is used when rt is invoked by prt.\n\n"
     "    -t thread-count, --threads thread-count\n"
     "        Set the number of ray tracer threads to 'thread_count' for this\n"
-    "        process. Not fully implemented or debugged!\n"
+    "        process. Not fully implemented or debugged!\n\n"
+    "    -b, --sbvh\n"
+    "        Build the bounding box hierarchy with spatial splits. Better\n"
+    "        for scenes with long, thin or overlapping objects.\n\n"
+    "    --sbvh-budget fraction\n"
+    "        Let spatial splits add at most 'fraction' times the number\n"
+    "        of objects in extra references (default 0.3).\n\n"
+    "    -f first-last, --frames first-last\n"
+    "        Render frames 'first' to 'last' of an animation. The file\n"
+    "        names are printf patterns which get the frame number, with\n"
+    "        one %%d in each.\n\n"
+    "    --refit-threshold factor\n"
+    "        Keep the hierarchy of the last frame, with its boxes refitted,\n"
+    "        until its cost grows by more than 'factor' (default 1.5). 0\n"
+    "        rebuilds every frame.\n\n"
+    "    --bvh-cache file\n"
+    "        Load the bounding box hierarchy from 'file' if it was saved\n"
+    "        there for the same scene, else build it and save it there.\n"
+    "        When running under prt, pass it as --bvh-cache=file.\n\n"
+    "    --quantized-bvh\n"
+    "        Trace through a compact copy of the hierarchy, which keeps\n"
+    "        the child boxes of each node in 8 bits per side.\n\n"
+    "    --bvh-stats[=areas]\n"
+    "        Build the hierarchy and print its SAH cost, depth, leaf\n"
+    "        sizes, overlap and memory use instead of rendering. With\n"
+    "        'areas', also list the box areas of every level.\n\n"
+    "    --branch-factor count\n"
+    "        Give each composite of the hierarchy up to 'count' children,\n"
+    "        2 to 16 (default 4).\n\n"
+    "    --leaf-size count\n"
+    "        Put up to 'count' objects in each leaf of the hierarchy, 1\n"
+    "        to 16 (default 4).\n\n"
+    "    --autotune\n"
+    "        Try a few branching factors and leaf sizes on a sample of\n"
+    "        rays and keep the fastest for the full render.\n\n"
+    "    --treelets[=passes]\n"
+    "        After building the hierarchy, rearrange small groups of its\n"
+    "        nodes to lower its SAH cost, 'passes' times over (default 1).\n"
+    "        Uses the number of threads given with -t.\n\n"
+    "    --stackless\n"
+    "        Trace through a copy of the hierarchy with links past each\n"
+    "        subtree, which needs no object stack. Can't be used with\n"
+    "        --quantized-bvh.\n\n"
+    "    --bvh-layout order\n"
+    "        Lay out the nodes of --quantized-bvh or --stackless in\n"
+    "        'depth-first' (default) or 'veb' order. The van Emde Boas\n"
+    "        order keeps each path from the root on fewer cache lines.\n\n"
+    "    --split-polygons[=factor]\n"
+    "        Cut up polygons whose bounding boxes have more than 'factor'\n"
+    "        times the median box area of the scene (default 16) before\n"
+    "        building the hierarchy, so that big floors and walls don't\n"
+    "        overlap everything.\n\n"
+    "    --sort-rays\n"
+    "        Trace the picture in tiles of scan lines. The reflected and\n"
+    "        refracted rays of a tile are gathered up, sorted by direction\n"
+    "        and origin and traced together, a level at a time.\n\n"
+    "    --packets[=size]\n"
+    "        Trace the primary rays in packets of 'size' by 'size' pixels,\n"
+    "        2 or 4 (default 2), which go down the hierarchy together. Only\n"
+    "        used with one sample per pixel. Can't be used with --stackless,\n"
+    "        --quantized-bvh or --sort-rays.\n\n"
+    "    --light-cutoff intensity\n"
+    "        Leave out lights given with an intensity where they have\n"
+    "        fallen off below 'intensity' (default 0.001). 0 shades every\n"
+    "        light everywhere.\n"
     "\n";
 
 /*
@@ -94,11 +193,56 @@ void bad_opt_value(const char *opt_name)
     Usage();
 }
 
+/*
+ * Frame_pattern()
+ *
+ * Check that a file name of an animation is a printf pattern with one
+ * integer conversion for the frame number, and nothing else which would
+ * want an argument. "%%" is a percent sign. Exit if it isn't.
+ */
+
+void Frame_pattern(const char *name)
+{
+    const char     *p;
+    int             n = 0;
+
+    for (p = name; *p; p++)
+    {
+	if (*p != '%')
+	    continue;
+
+	if (*++p == '%')
+	    continue;
+
+	while (*p && strchr("-+ #0", *p))
+	    p++;
+	while (isdigit((unsigned char) *p))
+	    p++;
+	if (*p == '.')
+	    for (p++; isdigit((unsigned char) *p); p++)
+		;
+
+	if (*p != 'd' && *p != 'i')
+	    break;
+	n++;
+    }
+
+    if (*p || n != 1)
+    {
+	fprintf(stderr, "%s: file name %s needs one %%d for the frame "
+		"number\n", my_name, name);
+	exit(1);
+    }
+}
+
 int main(int argc, char *argv[])
 {
     long		timest, timeend;
-    int		i;
+    int		i, nplain;
     int		c;
+    int		animate = 0;
+    int		frame, first_frame = 0, last_frame = 0;
+    char	in_pattern[MAX_NAME], out_pattern[MAX_NAME];
 
     time(&timest);
 
@@ -113,7 +257,7 @@ int main(int argc, char *argv[])
 	int option_index = 0;
 
 
-	c = getopt_long(argc, argv, "hvVslrdzc:y:i:t:",
+	c = getopt_long(argc, argv, "hvVslrdzbc:y:i:t:f:",
 			long_options, &option_index);
 
 	if (c == -1)
@@ -163,6 +307,121 @@ int main(int argc, char *argv[])
 	    }
 	    break;
 
+	case 'b':
+	    use_sbvh = 1;
+	    break;
+
+	case OPT_SBVH_BUDGET:
+	    sbvh_budget = atof( optarg );
+	    if( sbvh_budget < 0 )
+	    {
+		bad_opt_value("sbvh budget");
+	    }
+	    break;
+
+	case 'f':
+	    if (sscanf(optarg, "%d-%d", &first_frame, &last_frame) != 2 ||
+		first_frame < 0 || last_frame < first_frame)
+	    {
+		bad_opt_value("frames");
+	    }
+	    animate = 1;
+	    break;
+
+	case OPT_REFIT_THRESHOLD:
+	    refit_threshold = atof( optarg );
+	    if( refit_threshold < 0 )
+	    {
+		bad_opt_value("refit threshold");
+	    }
+	    break;
+
+	case OPT_BVH_CACHE:
+	    bvh_cache = optarg;
+	    break;
+
+	case OPT_QBVH:
+	    use_qbvh = 1;
+	    break;
+
+	case OPT_BRANCH_FACTOR:
+	    branch_factor = atoi( optarg );
+	    if( branch_factor < 2 || branch_factor > MAX_GROUP )
+	    {
+		bad_opt_value("branch factor");
+	    }
+	    break;
+
+	case OPT_LEAF_SIZE:
+	    leaf_size = atoi( optarg );
+	    if( leaf_size < 1 || leaf_size > MAX_GROUP )
+	    {
+		bad_opt_value("leaf size");
+	    }
+	    break;
+
+	case OPT_AUTOTUNE:
+	    autotune = 1;
+	    break;
+
+	case OPT_STACKLESS:
+	    use_stackless = 1;
+	    break;
+
+	case OPT_BVH_LAYOUT:
+	    if (!strcmp(optarg, "depth-first"))
+		bvh_layout = LAYOUT_DFS;
+	    else if (!strcmp(optarg, "veb"))
+		bvh_layout = LAYOUT_VEB;
+	    else
+		bad_opt_value("bvh-layout");
+	    break;
+
+	case OPT_SPLIT_POLYGONS:
+	    split_factor = (optarg == NULL) ? SPLIT_FACTOR : atof( optarg );
+	    if( split_factor <= 0 )
+	    {
+		bad_opt_value("split-polygons");
+	    }
+	    break;
+
+	case OPT_SORT_RAYS:
+	    sort_rays = 1;
+	    break;
+
+	case OPT_PACKETS:
+	    packet_size = (optarg == NULL) ? 2 : atoi( optarg );
+	    if( packet_size != 2 && packet_size != 4 )
+	    {
+		bad_opt_value("packets");
+	    }
+	    break;
+
+	case OPT_LIGHT_CUTOFF:
+	    light_cutoff = atof( optarg );
+	    if( light_cutoff < 0 )
+	    {
+		bad_opt_value("light-cutoff");
+	    }
+	    break;
+
+	case OPT_TREELETS:
+	    treelet_passes = (optarg == NULL) ? 1 : atoi( optarg );
+	    if( treelet_passes < 1 )
+	    {
+		bad_opt_value("treelets");
+	    }
+	    break;
+
+	case OPT_BVH_STATS:
+	    if (optarg == NULL)
+		bvh_stats = 1;
+	    else if (!strcmp(optarg, "areas"))
+		bvh_stats = 2;
+	    else
+		bad_opt_value("bvh-stats");
+	    break;
+
 	case 'c':
 	    sample_cnt = atol( optarg );
 	    if( sample_cnt < 1 )
@@ -192,7 +451,21 @@ int main(int argc, char *argv[])
 	}
     }
 
-    if (argc == optind)
+    if (use_stackless && use_qbvh)
+    {
+	fprintf(stderr, "%s: --stackless and --quantized-bvh can't be used "
+		"together\n", my_name);
+	exit(1);
+    }
+
+    if (packet_size && (use_stackless || use_qbvh || sort_rays))
+    {
+	fprintf(stderr, "%s: --packets can't be used with --stackless, "
+		"--quantized-bvh or --sort-rays\n", my_name);
+	exit(1);
+    }
+
+    if (argc == optind && !animate)
     {
 	use_stdio = 1;
 	strcpy(input_file, "STDIN");
@@ -201,6 +474,14 @@ int main(int argc, char *argv[])
     else if ((argc - optind) == 2)
     {
 	use_stdio = 0;
+
+	if (strlen(argv[optind]) >= MAX_NAME ||
+	    strlen(argv[optind + 1]) + strlen(".ppm") >= MAX_NAME)
+	{
+	    fprintf(stderr, "%s: file name too long\n", my_name);
+	    exit(1);
+	}
+
 	strcpy(input_file, argv[optind]);
 	strcpy(output_file, argv[optind + 1]);
 	strcat(output_file, ".ppm");
@@ -213,93 +494,169 @@ int main(int argc, char *argv[])
     }
 
     /*
-     * Read the input file. Will exit on error.
+     * For an animation, the file names are patterns which get the frame
+     * number filled in.
      */
 
-    if (use_stdio)
-	Read_input_file(NULL);
-    else
-	Read_input_file(input_file);
-
-    /*
-     * Check to make sure that there was at least one object and one
-     * light source specified.
-     */
-
-    if (nlights == 0)
+    if (animate)
     {
-	fprintf(stderr, "%s: no light sources were specified.\n", my_name);
-	exit(1);
+	Frame_pattern(input_file);
+	Frame_pattern(output_file);
+
+	strcpy(in_pattern, input_file);
+	strcpy(out_pattern, output_file);
     }
 
-    if (nobjects == 0)
+    for (frame = first_frame; frame <= last_frame; frame++)
     {
-	fprintf(stderr, "%s: no objects were specified.\n", my_name);
-	exit(1);
-    }
+	if (animate)
+	{
+	    if (frame != first_frame)
+		Reset_scene();
 
-    /*
-     * Adjust the intensity of each light
-     */
+	    if (snprintf(input_file, MAX_NAME, in_pattern,
+			 frame) >= MAX_NAME ||
+		snprintf(output_file, MAX_NAME, out_pattern,
+			 frame) >= MAX_NAME)
+	    {
+		fprintf(stderr, "%s: file name of frame %d is too long\n",
+			my_name, frame);
+		exit(1);
+	    }
+	}
 
-    for (i = 0; i < nlights; i++)
-    {
-	lights[i]->intensity = sqrt((double) nlights) / (double) nlights;
-    }
+	/*
+	 * Read the input file. Will exit on error.
+	 */
 
-    /*
-     * Open the output file.
-     */
-	
-    if (use_stdio)
-	Init_output_file(NULL);
-    else
-	Init_output_file(output_file);
+	if (use_stdio)
+	    Read_input_file(NULL);
+	else
+	    Read_input_file(input_file);
 
-    /*
-     * If verbose flag is on, print some info.
-     */
+	/*
+	 * Check to make sure that there was at least one object and one
+	 * light source specified.
+	 */
 
-    if (verbose)
-    {
-	fprintf(stderr, "%s: version %s\n", my_name, VERSION);
-	fprintf(stderr, "%s: input file = %s\n", my_name, input_file);
-	fprintf(stderr, "%s: output file = %s\n", my_name, output_file);
-	fprintf(stderr, "%s: %d objects were specified\n", my_name, nobjects);
-	fprintf(stderr, "%s: %d lights were specified\n", my_name, nlights);
-	fprintf(stderr, "%s: output image is %d x %d\n", my_name,
-		view.x_res, view.y_res);
-    }
+	if (nlights == 0)
+	{
+	    fprintf(stderr, "%s: no light sources were specified.\n", my_name);
+	    exit(1);
+	}
 
-    /*
-     * Build the bounding box structures.
-     */
+	if (nobjects == 0)
+	{
+	    fprintf(stderr, "%s: no objects were specified.\n", my_name);
+	    exit(1);
+	}
 
-    Build_bounding_slabs();
+	/*
+	 * Adjust the intensity of each light which was given none, and
+	 * build the hierarchy over the ones which fall off.
+	 */
 
-    if (verbose)
-    {
-	fprintf(stderr, "%s: %d objects after adding bounding volumes\n", my_name,
-		nobjects);
-    }
+	for (i = nplain = 0; i < nlights; i++)
+	    if (!lights[i]->falloff)
+		++nplain;
 
-    /*
-     * Raytrace the picture.
-     */
+	for (i = 0; i < nlights; i++)
+	{
+	    if (!lights[i]->falloff)
+		lights[i]->intensity = sqrt((double) nplain) / (double) nplain;
+	}
 
-    Raytrace();
+	Build_light_tree();
 
-    /*
-     * Close output file and exit
-     */
+	/*
+	 * Open the output file, unless there is nothing to render.
+	 */
 
-    if(output_file[0] == 0)
-	Close_output_file(NULL);
-    else
-	Close_output_file(output_file);
+	if (bvh_stats)
+	    ;
+	else if (use_stdio)
+	    Init_output_file(NULL);
+	else
+	    Init_output_file(output_file);
+
+	/*
+	 * If verbose flag is on, print some info.
+	 */
+
+	if (verbose)
+	{
+	    fprintf(stderr, "%s: version %s\n", my_name, VERSION);
+	    fprintf(stderr, "%s: input file = %s\n", my_name, input_file);
+	    fprintf(stderr, "%s: output file = %s\n", my_name, output_file);
+	    fprintf(stderr, "%s: %d objects were specified\n", my_name, nobjects);
+	    fprintf(stderr, "%s: %d lights were specified\n", my_name, nlights);
+	    fprintf(stderr, "%s: output image is %d x %d\n", my_name,
+		    view.x_res, view.y_res);
+	}
+
+	/*
+	 * Build the bounding box structures. The frames of an animation
+	 * try to refit the tree of the frame before. The shape of the tree
+	 * is tuned on the first frame only.
+	 */
+
+	/*
+	 * Cut up oversized polygons before anything is built over them.
+	 */
+
+	if (split_factor > 0.0)
+	    Split_polygons();
+
+	if (autotune && frame == first_frame)
+	    Autotune();
+
+	if (animate)
+	    Build_frame_hierarchy(frame == first_frame);
+	else
+	    Build_hierarchy();
+
+	Pack_sphere_leaves();
+	if (use_qbvh)
+	    Build_qbvh();
+	if (use_stackless)
+	    Build_skip_tree();
+
+	if (verbose)
+	{
+	    fprintf(stderr, "%s: %d objects after adding bounding volumes\n",
+		    my_name, nobjects);
+	}
+
+	/*
+	 * When only the hierarchy is wanted, report on it and go on to
+	 * the next frame.
+	 */
+
+	if (bvh_stats)
+	{
+	    Print_bvh_stats(bvh_stats == 2);
+	    continue;
+	}
+
+	/*
+	 * Raytrace the picture.
+	 */
+
+	Raytrace();
+
+	/*
+	 * Close output file
+	 */
+
+	if(output_file[0] == 0)
+	    Close_output_file(NULL);
+	else
+	    Close_output_file(output_file);
+
+	if(verbose)
+	    fprintf(stderr, "\n");
+    }
 
-    if(verbose)
-	fprintf(stderr, "\n");
 
     /*
      * If verbose mode is on, then print some stats.
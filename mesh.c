@@ -0,0 +1,102 @@
+/*
+ * mesh.c - This module contains all of the code that relates to triangle
+ * meshes.
+ *
+ * A mesh keeps its vertices once, in one array, and its triangles as
+ * indexes into it. Each triangle is an object of its own, so the hierarchy
+ * is built over them as over any other primitive, but all that a triangle
+ * has of its own is its three indexes.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "rt.h"
+#include "externs.h"
+#include "kernels.h"
+
+void		Tri_normal();
+
+/*
+ * Build_mesh()
+ *
+ * Given a mesh, build an object for each of its triangles. Every triangle
+ * gets one, even if its points are in a line, so that the objects of a mesh
+ * are its triangles in order.
+ */
+
+void Build_mesh(MESH *m)
+{
+    OBJECT         *o;
+    TRIANGLE       *tri;
+    VECTOR         *v0, *v1, *v2;
+    int             i;
+
+    for (i = 0; i < m->ntris; i++)
+    {
+	tri = &m->tris[i];
+	v0 = &m->verts[tri->v[0]];
+	v1 = &m->verts[tri->v[1]];
+	v2 = &m->verts[tri->v[2]];
+
+	o = New_object(T_TRIANGLE, NULL, 0);
+	o->obj = tri;
+	o->inter = Tri_intersect;
+	o->normal = Tri_normal;
+
+	o->b_min.x = MIN(MIN(v0->x, v1->x), v2->x);
+	o->b_min.y = MIN(MIN(v0->y, v1->y), v2->y);
+	o->b_min.z = MIN(MIN(v0->z, v1->z), v2->z);
+
+	o->b_max.x = MAX(MAX(v0->x, v1->x), v2->x);
+	o->b_max.y = MAX(MAX(v0->y, v1->y), v2->y);
+	o->b_max.z = MAX(MAX(v0->z, v1->z), v2->z);
+    }
+}
+
+/*
+ * Tri_intersect()
+ *
+ * Check given triangle for intersection with given ray. Return TRUE if an
+ * intersection takes place. This is the Moller-Trumbore test, which finds
+ * the distance and the barycentric coordinates of the hit together, with
+ * one division. The test is Tri_hit(), in kernels.h.
+ */
+
+int Tri_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
+{
+    return (Tri_hit(obj, ray, inter));
+}
+
+/*
+ * Tri_normal()
+ *
+ * Return the normal to a triangle, on the side the ray comes from.
+ */
+
+void Tri_normal(TRIANGLE *tri, RAY *ray, VECTOR *ip, VECTOR *normal)
+{
+    VECTOR         *v0, e1, e2;
+
+    v0 = &tri->mesh->verts[tri->v[0]];
+
+    VecSub(tri->mesh->verts[tri->v[1]], *v0, e1);
+    VecSub(tri->mesh->verts[tri->v[2]], *v0, e2);
+    VecCross(e1, e2, *normal);
+    VecNormalize(normal);
+
+    if (VecDot(ray->dir, *normal) >= 0)
+	VecNegate(*normal);
+}
@@ -0,0 +1,557 @@
+/*
+ * packet.c
+ *
+ * This module traces primary rays in packets, a square of neighboring pixels
+ * at a time. The rays of a packet start at the eye and go nearly the same
+ * way, so they mostly pass through the same boxes of the hierarchy and hit
+ * the same objects. A packet goes down the hierarchy once for all of its
+ * rays, with a mask of the rays which are in each box. Boxes, spheres and
+ * polygons are tested against a SIMD register of rays at a time, two with
+ * SSE2 or four with AVX, in the same steps as Check_and_push(),
+ * Sphere_intersect() and the polygon tests, so that each ray gets the hit it
+ * would get on its own. Other objects are tested one ray at a time.
+ *
+ * A packet of primary rays also comes with the pyramid from the eye which
+ * holds all of its rays. A box which is wholly outside of one of its faces
+ * can't be hit by any of them, so it is passed over before the rays are
+ * tested against it one by one, and a packet which only sees the background
+ * takes one such test.
+ *
+ * Once only one ray of a packet is left in a box, it goes on through that
+ * part of the hierarchy by itself. Packets with a ray which runs along a
+ * slab, which the box test treats apart, are traced one ray at a time, and
+ * so is every packet without SSE2.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "rt.h"
+#include "externs.h"
+#include "kernels.h"
+
+#if defined(__AVX__)
+
+#include <immintrin.h>
+
+#define LANES		4
+typedef __m256d VREG;
+
+#define V_SET(a)	_mm256_set1_pd(a)
+#define V_LOAD(p)	_mm256_loadu_pd(p)
+#define V_STORE(p, a)	_mm256_storeu_pd(p, a)
+#define V_ADD(a, b)	_mm256_add_pd(a, b)
+#define V_SUB(a, b)	_mm256_sub_pd(a, b)
+#define V_MUL(a, b)	_mm256_mul_pd(a, b)
+#define V_DIV(a, b)	_mm256_div_pd(a, b)
+#define V_SQRT(a)	_mm256_sqrt_pd(a)
+#define V_MIN(a, b)	_mm256_min_pd(a, b)
+#define V_MAX(a, b)	_mm256_max_pd(a, b)
+#define V_GE(a, b)	_mm256_cmp_pd(a, b, _CMP_GE_OQ)
+#define V_GT(a, b)	_mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define V_LE(a, b)	_mm256_cmp_pd(a, b, _CMP_LE_OQ)
+#define V_LT(a, b)	_mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define V_AND(a, b)	_mm256_and_pd(a, b)
+#define V_OR(a, b)	_mm256_or_pd(a, b)
+#define V_XOR(a, b)	_mm256_xor_pd(a, b)
+#define V_PICK(m, a, b)	_mm256_blendv_pd(b, a, m)
+#define V_MASK(a)	_mm256_movemask_pd(a)
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define LANES		2
+typedef __m128d VREG;
+
+#define V_SET(a)	_mm_set1_pd(a)
+#define V_LOAD(p)	_mm_loadu_pd(p)
+#define V_STORE(p, a)	_mm_storeu_pd(p, a)
+#define V_ADD(a, b)	_mm_add_pd(a, b)
+#define V_SUB(a, b)	_mm_sub_pd(a, b)
+#define V_MUL(a, b)	_mm_mul_pd(a, b)
+#define V_DIV(a, b)	_mm_div_pd(a, b)
+#define V_SQRT(a)	_mm_sqrt_pd(a)
+#define V_MIN(a, b)	_mm_min_pd(a, b)
+#define V_MAX(a, b)	_mm_max_pd(a, b)
+#define V_GE(a, b)	_mm_cmpge_pd(a, b)
+#define V_GT(a, b)	_mm_cmpgt_pd(a, b)
+#define V_LE(a, b)	_mm_cmple_pd(a, b)
+#define V_LT(a, b)	_mm_cmplt_pd(a, b)
+#define V_AND(a, b)	_mm_and_pd(a, b)
+#define V_OR(a, b)	_mm_or_pd(a, b)
+#define V_XOR(a, b)	_mm_xor_pd(a, b)
+#define V_PICK(m, a, b)	_mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b))
+#define V_MASK(a)	_mm_movemask_pd(a)
+
+#endif
+
+#ifdef LANES
+
+#define LANE_BITS	((1 << LANES) - 1)
+#define FRUSTUM_SLACK	1e-9	/* rounding let off, per distance */
+
+/*
+ * The rays of a packet, with their origins and directions laid out by axis,
+ * and the closest hit found so far for each of them.
+ */
+
+typedef struct packet
+{
+	int             num;	/* number of rays		 */
+	RAY            *ray;	/* the rays themselves		 */
+	double          o[3][MAX_PACKET];	/* origins		 */
+	double          d[3][MAX_PACKET];	/* directions		 */
+	FRUSTUM        *fr;	/* pyramid around them, or NULL	 */
+	INTERSECT      *inter;	/* closest hit of each ray	 */
+	int             hits;	/* mask of rays which hit	 */
+}               PACKET;
+
+static OBJECT  *pstack[STACK_SIZE];	/* boxes left to go into	 */
+static int      pmask[STACK_SIZE];	/* and the rays in each one	 */
+static int      npstack;
+
+/*
+ * Load_packet()
+ *
+ * Lay out the origins and directions of the rays. Return 0 if one of them
+ * runs along a slab, so that the packet has to be traced a ray at a time.
+ */
+
+static int Load_packet(PACKET *pk, RAY *ray, int num, FRUSTUM *fr,
+		       INTERSECT *inter)
+{
+    int             k;
+
+    for (k = 0; k < num; k++)
+    {
+	if (fabs(ray[k].dir.x) < MIN_T || fabs(ray[k].dir.y) < MIN_T ||
+	    fabs(ray[k].dir.z) < MIN_T)
+	    return (0);
+
+	pk->o[0][k] = ray[k].pos.x;
+	pk->o[1][k] = ray[k].pos.y;
+	pk->o[2][k] = ray[k].pos.z;
+	pk->d[0][k] = ray[k].dir.x;
+	pk->d[1][k] = ray[k].dir.y;
+	pk->d[2][k] = ray[k].dir.z;
+    }
+
+    pk->num = num;
+    pk->ray = ray;
+    pk->fr = fr;
+    pk->inter = inter;
+    pk->hits = 0;
+
+    return (1);
+}
+
+/*
+ * Keep()
+ *
+ * Keep a hit of one of the rays if it is the closest one so far.
+ */
+
+static void Keep(PACKET *pk, int k, INTERSECT *hit)
+{
+    if (!(pk->hits & (1 << k)) || CLOSER(hit, &pk->inter[k]))
+    {
+	pk->inter[k] = *hit;
+	pk->hits |= 1 << k;
+    }
+}
+
+/*
+ * Box_mask()
+ *
+ * Return which of the given rays go through the box of the object.
+ */
+
+static int Box_mask(PACKET *pk, OBJECT *obj, int mask)
+{
+    VREG            mn[3], mx[3], o, d, t1, t2, t_near, t_far, min_t;
+    int             a, c, hit;
+
+    mn[0] = V_SET(obj->b_min.x);
+    mn[1] = V_SET(obj->b_min.y);
+    mn[2] = V_SET(obj->b_min.z);
+    mx[0] = V_SET(obj->b_max.x);
+    mx[1] = V_SET(obj->b_max.y);
+    mx[2] = V_SET(obj->b_max.z);
+    min_t = V_SET(MIN_T);
+
+    hit = 0;
+    for (c = 0; c < pk->num; c += LANES)
+    {
+	if (((mask >> c) & LANE_BITS) == 0)
+	    continue;
+
+	t_near = V_SET(-HUGE);
+	t_far = V_SET(HUGE);
+
+	for (a = 0; a < 3; a++)
+	{
+	    o = V_LOAD(pk->o[a] + c);
+	    d = V_LOAD(pk->d[a] + c);
+	    t1 = V_DIV(V_SUB(mn[a], o), d);
+	    t2 = V_DIV(V_SUB(mx[a], o), d);
+	    t_near = V_MAX(t_near, V_MIN(t1, t2));
+	    t_far = V_MIN(t_far, V_MAX(t1, t2));
+	}
+
+	hit |= V_MASK(V_AND(V_LE(t_near, t_far), V_GE(t_far, min_t))) << c;
+    }
+
+    return (hit & mask);
+}
+
+/*
+ * Outside_frustum()
+ *
+ * Return 1 if the box of the object is wholly outside of one of the faces
+ * of the frustum. The corner of the box farthest along the face's normal is
+ * tested, with some room for the rounding of the rays' directions.
+ */
+
+static int Outside_frustum(FRUSTUM *fr, OBJECT *obj)
+{
+    double          p[3], dist;
+    int             i;
+
+    for (i = 0; i < 4; i++)
+    {
+	p[0] = (fr->n[i][0] >= 0 ? obj->b_max.x : obj->b_min.x) - fr->eye[0];
+	p[1] = (fr->n[i][1] >= 0 ? obj->b_max.y : obj->b_min.y) - fr->eye[1];
+	p[2] = (fr->n[i][2] >= 0 ? obj->b_max.z : obj->b_min.z) - fr->eye[2];
+
+	dist = fabs(p[0]) + fabs(p[1]) + fabs(p[2]);
+	if (fr->n[i][0] * p[0] + fr->n[i][1] * p[1] + fr->n[i][2] * p[2] <
+	    -FRUSTUM_SLACK * dist)
+	    return (1);
+    }
+
+    return (0);
+}
+
+/*
+ * Check_and_push_packet()
+ *
+ * Push the object on the packet's stack with the rays which go through its
+ * box, if there are any. Boxes outside of the packet's frustum are passed
+ * over without testing the rays.
+ */
+
+static void Check_and_push_packet(PACKET *pk, OBJECT *obj, int mask)
+{
+    if (pk->fr != NULL && Outside_frustum(pk->fr, obj))
+	return;
+
+    if ((mask = Box_mask(pk, obj, mask)) == 0)
+	return;
+
+    if (npstack == STACK_SIZE)
+    {
+	fprintf(stderr, "%s: packet stack overflow\n", my_name);
+	exit(1);
+    }
+
+    pstack[npstack] = obj;
+    pmask[npstack++] = mask;
+}
+
+/*
+ * Sphere_packet()
+ *
+ * Test a sphere against the given rays, with the steps of
+ * Sphere_intersect().
+ */
+
+static void Sphere_packet(PACKET *pk, OBJECT *obj, int mask)
+{
+    SPHERE         *s;
+    INTERSECT       hit;
+    VREG            cx, cy, cz, r2, min_t, dx, dy, dz;
+    VREG            ox, oy, oz, l2oc, tca, t2hc, disc, out, t, ok;
+    double          tv[LANES];
+    int             c, j, m, o;
+
+    s = (SPHERE *) obj->obj;
+    cx = V_SET(s->center.x);
+    cy = V_SET(s->center.y);
+    cz = V_SET(s->center.z);
+    r2 = V_SET(s->radius2);
+    min_t = V_SET(MIN_T);
+
+    hit.obj = obj;
+    hit.inst = NULL;
+
+    for (c = 0; c < pk->num; c += LANES)
+    {
+	if (((mask >> c) & LANE_BITS) == 0)
+	    continue;
+
+	ox = V_SUB(cx, V_LOAD(pk->o[0] + c));
+	oy = V_SUB(cy, V_LOAD(pk->o[1] + c));
+	oz = V_SUB(cz, V_LOAD(pk->o[2] + c));
+	dx = V_LOAD(pk->d[0] + c);
+	dy = V_LOAD(pk->d[1] + c);
+	dz = V_LOAD(pk->d[2] + c);
+
+	l2oc = V_ADD(V_ADD(V_MUL(ox, ox), V_MUL(oy, oy)), V_MUL(oz, oz));
+	tca = V_ADD(V_ADD(V_MUL(ox, dx), V_MUL(oy, dy)), V_MUL(oz, dz));
+	t2hc = V_ADD(V_SUB(r2, l2oc), V_MUL(tca, tca));
+
+	ok = V_GE(t2hc, min_t);
+	if ((V_MASK(ok) & (mask >> c)) == 0)
+	    continue;
+
+	disc = V_SQRT(V_AND(t2hc, ok));
+	out = V_GT(l2oc, V_ADD(r2, min_t));
+	t = V_PICK(out, V_SUB(tca, disc), V_ADD(tca, disc));
+
+	m = V_MASK(V_AND(ok, V_GE(t, min_t))) & (mask >> c) & LANE_BITS;
+	if (m == 0)
+	    continue;
+
+	V_STORE(tv, t);
+	o = V_MASK(out);
+	for (j = 0; j < LANES; j++)
+	{
+	    if (!(m & (1 << j)))
+		continue;
+
+	    hit.t = tv[j];
+	    hit.inside = !((o >> j) & 1);
+	    Keep(pk, c + j, &hit);
+	}
+    }
+}
+
+/*
+ * Poly_packet()
+ *
+ * Test a polygon against the given rays, with the steps of
+ * Convex_intersect() or Poly_intersect(), whichever the polygon uses.
+ */
+
+static void Poly_packet(PACKET *pk, OBJECT *obj, int mask)
+{
+    POLYGON        *p;
+    REAL            (*e)[3];
+    INTERSECT       hit;
+    VREG            nx, ny, nz, pd, zero, min_t, neg_min_t;
+    VREG            vd, vo, t, u, v, ok, in, below_i, below_j, cross;
+    VREG            band, neg_band, dist, clear;
+    double          tv[LANES], uv[2][LANES];
+    int             c, i, j, m, convex, out;
+
+    p = (POLYGON *) obj->obj;
+    e = POLY_EDGES(p);
+    convex = (obj->inter == Convex_intersect);
+
+    nx = V_SET(p->normal.x);
+    ny = V_SET(p->normal.y);
+    nz = V_SET(p->normal.z);
+    pd = V_SET(p->d);
+    zero = V_SET(0.0);
+    min_t = V_SET(MIN_T);
+    neg_min_t = V_SET(-MIN_T);
+    band = V_SET(EDGE_BAND);
+    neg_band = V_SET(-EDGE_BAND);
+
+    hit.obj = obj;
+    hit.inst = NULL;
+    hit.inside = 0;
+
+    for (c = 0; c < pk->num; c += LANES)
+    {
+	if (((mask >> c) & LANE_BITS) == 0)
+	    continue;
+
+	out = 0;
+
+	/* the plane, if the ray doesn't run along it */
+	vd = V_ADD(V_ADD(V_MUL(V_LOAD(pk->d[0] + c), nx),
+			 V_MUL(V_LOAD(pk->d[1] + c), ny)),
+		   V_MUL(V_LOAD(pk->d[2] + c), nz));
+	ok = V_OR(V_GE(vd, min_t), V_LE(vd, neg_min_t));
+
+	vo = V_ADD(V_ADD(V_ADD(V_MUL(V_LOAD(pk->o[0] + c), nx),
+			       V_MUL(V_LOAD(pk->o[1] + c), ny)),
+			 V_MUL(V_LOAD(pk->o[2] + c), nz)), pd);
+	t = V_DIV(V_SUB(zero, vo), vd);
+
+	ok = V_AND(ok, V_GE(t, min_t));
+	if ((V_MASK(ok) & (mask >> c)) == 0)
+	    continue;
+
+	/* the point hit on the plane of the dominant normals */
+	u = V_ADD(V_LOAD(pk->o[p->p1] + c),
+		  V_MUL(t, V_LOAD(pk->d[p->p1] + c)));
+	v = V_ADD(V_LOAD(pk->o[p->p2] + c),
+		  V_MUL(t, V_LOAD(pk->d[p->p2] + c)));
+
+	if (convex)
+	{
+	    /* lanes near an edge are settled by Poly_crossing() */
+	    clear = ok;
+	    for (i = 0; i < p->npoints; i++)
+	    {
+		dist = V_ADD(V_ADD(V_MUL(V_SET(e[i][0]), u),
+				   V_MUL(V_SET(e[i][1]), v)), V_SET(e[i][2]));
+		ok = V_AND(ok, V_GE(dist, neg_band));
+		clear = V_AND(clear, V_GT(dist, band));
+	    }
+
+	    m = V_MASK(ok) & ~V_MASK(clear) & (mask >> c) & LANE_BITS;
+	    if (m != 0)
+	    {
+		V_STORE(uv[0], u);
+		V_STORE(uv[1], v);
+		for (j = 0; j < LANES; j++)
+		    if ((m & (1 << j)) && !Poly_crossing(p, uv[0][j], uv[1][j]))
+			out |= 1 << j;
+	    }
+	}
+	else
+	{
+	    in = zero;
+	    for (i = 0, j = p->npoints - 1; i < p->npoints; j = i++)
+	    {
+		below_j = V_LT(V_SET(e[j][1]), v);
+		below_i = V_LT(V_SET(e[i][1]), v);
+		cross = V_LT(V_ADD(V_SET(e[j][0]),
+				   V_MUL(V_SUB(v, V_SET(e[j][1])),
+					 V_SET(e[j][2]))), V_ADD(u, min_t));
+		in = V_XOR(in, V_AND(V_XOR(below_i, below_j), cross));
+	    }
+	    ok = V_AND(ok, in);
+	}
+
+	m = V_MASK(ok) & (mask >> c) & LANE_BITS & ~out;
+	if (m == 0)
+	    continue;
+
+	V_STORE(tv, t);
+	for (j = 0; j < LANES; j++)
+	{
+	    if (!(m & (1 << j)))
+		continue;
+
+	    hit.t = tv[j];
+	    Keep(pk, c + j, &hit);
+	}
+    }
+}
+
+/*
+ * Trace_packet()
+ *
+ * Trace the rays of a packet through the hierarchy together, the same way
+ * Intersect_tree() traces each one. Objects reached through more than one
+ * leaf are tested again, which gives the same hit.
+ */
+
+static int Trace_packet(PACKET *pk)
+{
+    OBJECT         *obj;
+    COMPOSITE      *cd;
+    INTERSECT       hit;
+    int             i, k, mask;
+
+    npstack = 0;
+    Check_and_push_packet(pk, root, (1 << pk->num) - 1);
+
+    while (npstack > 0)
+    {
+	--npstack;
+	obj = pstack[npstack];
+	mask = pmask[npstack];
+
+	/* a ray left by itself goes on alone */
+	if ((mask & (mask - 1)) == 0)
+	{
+	    for (k = 0; !(mask & (1 << k)); k++)
+		;
+
+	    if (Intersect_tree(obj, &pk->ray[k], &hit, 0))
+		Keep(pk, k, &hit);
+	    continue;
+	}
+
+	if (IS_NODE(obj))
+	{
+	    cd = (COMPOSITE *) obj->obj;
+	    for (i = 0; i < cd->num; i++)
+		Check_and_push_packet(pk, cd->child[i], mask);
+	    continue;
+	}
+
+	switch (obj->type)
+	{
+	case T_SPHERE:
+	    Sphere_packet(pk, obj, mask);
+	    break;
+
+	case T_POLYGON:
+	    Poly_packet(pk, obj, mask);
+	    break;
+
+	default:
+	    for (k = 0; k < pk->num; k++)
+	    {
+		if (!(mask & (1 << k)))
+		    continue;
+
+		hit.inst = NULL;
+		if (INTERSECT_OBJECT(obj, &pk->ray[k], &hit))
+		    Keep(pk, k, &hit);
+	    }
+	    break;
+	}
+    }
+
+    return (pk->hits);
+}
+
+#endif
+
+/*
+ * Intersect_packet()
+ *
+ * Find the closest intersection of each of the given rays, which should
+ * start at the same point and go nearly the same way. There can be up to
+ * MAX_PACKET of them, in a multiple of four. 'fr', if not NULL, is a frustum
+ * which holds all of them. Return a mask of the rays which hit anything,
+ * with their hits filled in.
+ */
+
+int Intersect_packet(RAY *ray, int num, FRUSTUM *fr, INTERSECT *inter)
+{
+    int             k, hits;
+#ifdef LANES
+    PACKET          pk;
+
+    if (IS_NODE(root) && Load_packet(&pk, ray, num, fr, inter))
+	return (Trace_packet(&pk));
+#endif
+
+    hits = 0;
+    for (k = 0; k < num; k++)
+	if (Intersect(&ray[k], &inter[k]))
+	    hits |= 1 << k;
+
+    return (hits);
+}
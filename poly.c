@@ -16,10 +16,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "rt.h"
 #include "externs.h"
+#include "kernels.h"
 
 
 int             Poly_intersect();
@@ -29,7 +31,8 @@ extern int      line;
 /*
  * Build_poly()
  * 
- * Given some info on a polygon, build the entire object structure.
+ * Given some info on a polygon, build the entire object structure. The
+ * polygon is copied into the object.
  */
 
 void Build_poly(POLYGON *p)
@@ -38,25 +41,11 @@ void Build_poly(POLYGON *p)
     VECTOR          pt1, pt2;
     int             i;
 
-    if (nobjects == MAX_PRIMS)
-    {
-	fprintf(stderr, "%s: too many objects specified\n", my_name);
-	exit(1);
-    }
-
-    if ((o = (OBJECT *) malloc(sizeof(OBJECT))) == NULL)
-    {
-	fprintf(stderr, "%s: malloc failed\n", my_name);
-	exit(1);
-    }
-
-    o->type = T_POLYGON;
-    o->obj = p;
-    o->surf = cur_surface;
+    o = New_object(T_POLYGON, p, POLY_SIZE(p->npoints));
     o->inter = Poly_intersect;
     o->normal = Poly_normal;
 
-    objects[nobjects++] = o;
+    p = (POLYGON *) o->obj;
 
     /*
      * Calculate the normals and the D coefficient by various cross
@@ -120,25 +109,139 @@ void Build_poly(POLYGON *p)
 	o->b_max.y = MAX(p->points[i].y, o->b_max.y);
 	o->b_max.z = MAX(p->points[i].z, o->b_max.z);
     }
+
+    Poly_edges(o);
+}
+
+/*
+ * Crossing_edges()
+ *
+ * Work out the edges of a polygon for Poly_intersect(): for each point, where
+ * it is on the plane of the dominant normals and how far the edge from it to
+ * the next point moves across for each step up. Edges which run straight
+ * across are never crossed, and get no slope.
+ */
+
+static void Crossing_edges(POLYGON *p)
+{
+    REAL            (*e)[3];
+    int             i, j;
+
+    e = POLY_EDGES(p);
+
+    for (i = 0; i < p->npoints; i++)
+    {
+	e[i][0] = ((REAL *) &p->points[i])[p->p1];
+	e[i][1] = ((REAL *) &p->points[i])[p->p2];
+    }
+
+    for (i = 0; i < p->npoints; i++)
+    {
+	j = (i + 1) % p->npoints;
+
+	if (e[j][1] == e[i][1])
+	    e[i][2] = 0.0;
+	else
+	    e[i][2] = (e[j][0] - e[i][0]) / (e[j][1] - e[i][1]);
+    }
+}
+
+/*
+ * Poly_edges()
+ * 
+ * Work out the edges of a polygon ahead of time. A triangle or a convex quad
+ * gets the lines of its edges, on the plane of its dominant normals, so that
+ * Convex_intersect() can test it. They are turned so that the inside is
+ * where all of them are positive, and scaled so that they give the distance
+ * from the edge. Any other polygon is left to Poly_intersect(), with the
+ * edges it needs.
+ */
+
+void Poly_edges(OBJECT *o)
+{
+    POLYGON        *p;
+    REAL            line[4][3];
+    double          u[4], v[4], area, len;
+    int             i, j, k;
+
+    p = (POLYGON *) o->obj;
+    o->inter = Poly_intersect;
+
+    Crossing_edges(p);
+
+    if (p->npoints > 4)
+	return;
+
+    for (i = 0; i < p->npoints; i++)
+    {
+	u[i] = ((REAL *) &p->points[i])[p->p1];
+	v[i] = ((REAL *) &p->points[i])[p->p2];
+    }
+
+    area = 0.0;
+    for (i = 0; i < p->npoints; i++)
+    {
+	j = (i + 1) % p->npoints;
+
+	line[i][0] = v[i] - v[j];
+	line[i][1] = u[j] - u[i];
+	line[i][2] = u[i] * v[j] - u[j] * v[i];
+
+	area += line[i][2];
+    }
+
+    /* a polygon seen edge on is left to the general test */
+    if (area == 0.0)
+	return;
+
+    if (area < 0.0)
+    {
+	for (i = 0; i < p->npoints; i++)
+	{
+	    line[i][0] = -line[i][0];
+	    line[i][1] = -line[i][1];
+	    line[i][2] = -line[i][2];
+	}
+    }
+
+    /* every point has to be inside of every edge */
+    for (i = 0; i < p->npoints; i++)
+	for (k = 0; k < p->npoints; k++)
+	    if (line[i][0] * u[k] + line[i][1] * v[k] + line[i][2] < 0.0)
+		return;
+
+    for (i = 0; i < p->npoints; i++)
+    {
+	len = sqrt(line[i][0] * line[i][0] + line[i][1] * line[i][1]);
+	if (len == 0.0)
+	    return;	/* two points the same */
+
+	line[i][0] /= len;
+	line[i][1] /= len;
+	line[i][2] /= len;
+    }
+
+    memcpy(POLY_EDGES(p), line, sizeof(REAL) * 3 * p->npoints);
+    o->inter = Convex_intersect;
 }
 
 /*
  * Poly_intersect()
  * 
  * Check given ploy for intersection with given ray. Return TRUE if an
- * intersection takes place.
+ * intersection takes place. The point hit on the plane is inside if a line
+ * from it toward smaller values of the first dominant normal crosses the
+ * edges an odd number of times. The edges were worked out by
+ * Crossing_edges(), so each one the line could cross takes a compare and a
+ * multiply.
  */
 
 int Poly_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
 {
     POLYGON        *p;
-    VECTOR          ipoint;
-    double          vo, vd;
-    double          t, b, m;
-    double          pi[3], pj[3], ip[3];
-    int             qi, qj, ri, rj, i, j;
-    int             n1, n2, l;
-
+    REAL            (*e)[3];
+    double          vo, vd, t, u, v;
+    int             i, j, in;
 
     p = obj->obj;
 
@@ -164,65 +267,24 @@ int Poly_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
      * use the Jordon Curve Theorem to do this.
      */
 
-    /* get the point of intersection on the plane */
-    VecAddS(t, ray->dir, ray->pos, ipoint);
-    ip[0] = ipoint.x;
-    ip[1] = ipoint.y;
-    ip[2] = ipoint.z;
-
-    /* get the dominant normals */
-    n1 = p->p1;
-    n2 = p->p2;
+    /* the point of intersection on the plane of the dominant normals */
+    u = ((REAL *) &ray->pos)[p->p1] + t * ((REAL *) &ray->dir)[p->p1];
+    v = ((REAL *) &ray->pos)[p->p2] + t * ((REAL *) &ray->dir)[p->p2];
 
-    /* ok, do it */
+    e = POLY_EDGES(p);
+    in = 0;
 
-    l = 0;
-    for (i = 0; i < p->npoints; i++)
+    /* the edge from point j to point i, for each i */
+    for (i = 0, j = p->npoints - 1; i < p->npoints; j = i++)
     {
-	j = (i + 1) % p->npoints;
-	qi = qj = ri = rj = 0;
-
-	pi[0] = p->points[i].x;
-	pi[1] = p->points[i].y;
-	pi[2] = p->points[i].z;
-
-	pj[0] = p->points[j].x;
-	pj[1] = p->points[j].y;
-	pj[2] = p->points[j].z;
-
-	/* check for horizontal line and ignore them */
-	if (pi[n2] == pj[n2])
-	    continue;
-
-	if (pi[n2] < ip[n2])
-	    qi = 1;
-	if (pj[n2] < ip[n2])
-	    qj = 1;
-	if (qi == qj)
+	if ((e[j][1] < v) == (e[i][1] < v))
 	    continue;
 
-	if (pi[n1] < ip[n1])
-	    ri = 1;
-	if (pj[n1] < ip[n1])
-	    rj = 1;
-
-	if (ri & rj)
-	{
-	    ++l;	/* crossed an edge		 */
-	    continue;
-	}
-
-	if (!(rj | ri))
-	    continue;
-
-	m = (pj[n2] - pi[n2]) / (pj[n1] - pi[n1]);
-	b = (pj[n2] - ip[n2]) - (m * (pj[n1] - ip[n1]));
-
-	if ((-b / m) < MIN_T)
-	    ++l;
+	if (e[j][0] + (v - e[j][1]) * e[j][2] < u + MIN_T)
+	    in = !in;
     }
 
-    if ((l % 2) == 0)
+    if (!in)
 	return (0);
 
     /*
@@ -238,6 +300,54 @@ int Poly_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
 }
 
 
+/*
+ * Poly_crossing()
+ *
+ * The crossing test of Poly_intersect(), for a convex polygon, whose room
+ * after the points holds the lines of its edges instead. The slopes are
+ * worked out here the way Crossing_edges() does it, so the answer is the
+ * same as Poly_intersect() would give, down to who owns a shared edge.
+ */
+
+int Poly_crossing(POLYGON *p, double u, double v)
+{
+    REAL            ui, vi, uj, vj, slope;
+    int             i, j, in;
+
+    in = 0;
+
+    for (i = 0, j = p->npoints - 1; i < p->npoints; j = i++)
+    {
+	ui = ((REAL *) &p->points[i])[p->p1];
+	vi = ((REAL *) &p->points[i])[p->p2];
+	uj = ((REAL *) &p->points[j])[p->p1];
+	vj = ((REAL *) &p->points[j])[p->p2];
+
+	if ((vj < v) == (vi < v))
+	    continue;
+
+	slope = (ui - uj) / (vi - vj);
+	if (uj + (v - vj) * slope < u + MIN_T)
+	    in = !in;
+    }
+
+    return (in);
+}
+
+/*
+ * Convex_intersect()
+ * 
+ * Check a triangle or convex quad for intersection with the given ray, the
+ * same way Poly_intersect() does, but with the lines of its edges worked out
+ * ahead of time. The test is Convex_hit(), in kernels.h.
+ */
+
+int Convex_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
+{
+    return (Convex_hit(obj, ray, inter));
+}
+
+
 /*
  * Poly_normal()
  * 
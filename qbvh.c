@@ -0,0 +1,508 @@
+/*
+ * qbvh.c
+ *
+ * This module keeps a compact copy of the bounding box hierarchy for
+ * tracing. The composites are flattened into an array of nodes in depth
+ * first order. A node holds the boxes of all of its children, each stored
+ * as 8 bit steps across the node's own box. Nodes have as many children as
+ * their composites, so they are of different sizes and are packed into an
+ * array of words. The steps are rounded outward,
+ * so a child's quantized box always holds its real one. A child box then
+ * takes 6 bytes instead of the 48 of a pair of VECTORs. The nodes can be put
+ * in van Emde Boas order after they are flattened.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rt.h"
+#include "externs.h"
+#include "kernels.h"
+
+#define QUANT_STEPS	255	/* steps across a node's box	 */
+
+/*
+ * A flattened composite. The header is followed by num child entries and
+ * then by num boxes of 6 steps each (low x, y, z, high x, y, z), padded out
+ * to a word. Children at or above zero are the word offsets of nodes, the
+ * others are -1 - the index of the object in qprims[].
+ */
+
+typedef struct qnode
+{
+	float           origin[3];	/* low corner of the node's box	 */
+	float           scale[3];	/* size of one step on each axis */
+	int             num;	/* number of children		 */
+}               QNODE;
+
+#define QNODE_WORDS(n)	((sizeof(QNODE) + sizeof(int) * (n) + \
+			  ((6 * (n) + 3) & ~3)) / sizeof(int))
+#define QCHILD(qn)	((int *) ((qn) + 1))
+#define QBOX(qn)	((unsigned char *) (QCHILD(qn) + (qn)->num))
+
+static int     *qdata = NULL;	/* nodes, root first		 */
+static OBJECT **qprims = NULL;	/* objects in the order reached	 */
+static int      nqwords, nqnodes, nqprims;
+
+/*
+ * Count_nodes()
+ *
+ * Count the words of the nodes and the object references under the given
+ * node.
+ */
+
+static void Count_nodes(OBJECT *obj, int *words, int *prims)
+{
+    COMPOSITE      *cd;
+    int             i;
+
+    if (!IS_NODE(obj))
+    {
+	++*prims;
+	return;
+    }
+
+    cd = (COMPOSITE *) obj->obj;
+    *words += QNODE_WORDS(cd->num);
+    for (i = 0; i < cd->num; i++)
+	Count_nodes(cd->child[i], words, prims);
+}
+
+/*
+ * Quant_axis()
+ *
+ * Pick the origin and step size of one axis of a node's box. The origin is
+ * rounded down to a float, and the step is made big enough for the last
+ * step to reach the top of the box, computed the same way the traversal
+ * will compute it.
+ */
+
+static void Quant_axis(double lo, double hi, float *origin, float *scale)
+{
+    float           o, s;
+
+    o = (float) lo;
+    if ((double) o > lo)
+	o = nextafterf(o, -HUGE_VALF);
+
+    s = (float) ((hi - (double) o) / QUANT_STEPS);
+    while ((double) o + QUANT_STEPS * (double) s < hi)
+	s = nextafterf(s, HUGE_VALF);
+
+    *origin = o;
+    *scale = s;
+}
+
+/*
+ * Quant_low(), Quant_high()
+ *
+ * Return the step at or below, or at or above, the given value.
+ */
+
+static int Quant_low(double v, float origin, float scale)
+{
+    int             q;
+
+    if (scale == 0.0)
+	return (0);
+
+    q = (int) floor((v - (double) origin) / (double) scale);
+    q = MAX(q, 0);
+    q = MIN(q, QUANT_STEPS);
+
+    while (q > 0 && (double) origin + q * (double) scale > v)
+	--q;
+
+    return (q);
+}
+
+static int Quant_high(double v, float origin, float scale)
+{
+    int             q;
+
+    if (scale == 0.0)
+	return (0);
+
+    q = (int) ceil((v - (double) origin) / (double) scale);
+    q = MAX(q, 0);
+    q = MIN(q, QUANT_STEPS);
+
+    while (q < QUANT_STEPS && (double) origin + q * (double) scale < v)
+	++q;
+
+    return (q);
+}
+
+/*
+ * Flatten()
+ *
+ * Add the given composite and everything under it to the node array, in
+ * depth first order, and return its offset.
+ */
+
+static int Flatten(OBJECT *obj)
+{
+    COMPOSITE      *cd;
+    QNODE          *qn;
+    OBJECT         *ch;
+    unsigned char  *q;
+    int             n, i, c;
+
+    cd = (COMPOSITE *) obj->obj;
+
+    n = nqwords;
+    nqwords += QNODE_WORDS(cd->num);
+    ++nqnodes;
+
+    qn = (QNODE *) (qdata + n);
+    qn->num = cd->num;
+
+    if (cd->num == 0)
+	return (n);
+
+    Quant_axis(obj->b_min.x, obj->b_max.x, &qn->origin[0], &qn->scale[0]);
+    Quant_axis(obj->b_min.y, obj->b_max.y, &qn->origin[1], &qn->scale[1]);
+    Quant_axis(obj->b_min.z, obj->b_max.z, &qn->origin[2], &qn->scale[2]);
+
+    for (i = 0; i < cd->num; i++)
+    {
+	ch = cd->child[i];
+	q = QBOX(qn) + 6 * i;
+
+	q[0] = Quant_low(ch->b_min.x, qn->origin[0], qn->scale[0]);
+	q[1] = Quant_low(ch->b_min.y, qn->origin[1], qn->scale[1]);
+	q[2] = Quant_low(ch->b_min.z, qn->origin[2], qn->scale[2]);
+
+	q[3] = Quant_high(ch->b_max.x, qn->origin[0], qn->scale[0]);
+	q[4] = Quant_high(ch->b_max.y, qn->origin[1], qn->scale[1]);
+	q[5] = Quant_high(ch->b_max.z, qn->origin[2], qn->scale[2]);
+    }
+
+    for (i = 0; i < cd->num; i++)
+    {
+	ch = cd->child[i];
+
+	if (IS_NODE(ch))
+	    c = Flatten(ch);
+	else
+	{
+	    qprims[nqprims] = ch;
+	    c = -1 - nqprims++;
+	}
+
+	QCHILD(qn)[i] = c;
+    }
+
+    return (n);
+}
+
+/*
+ * Qnode_children()
+ *
+ * Fill in the child nodes of the node at the given offset, and return their
+ * number.
+ */
+
+static int Qnode_children(int node, int *child)
+{
+    QNODE          *qn;
+    int             i, n;
+
+    qn = (QNODE *) (qdata + node);
+
+    n = 0;
+    for (i = 0; i < qn->num; i++)
+	if (QCHILD(qn)[i] >= 0)
+	    child[n++] = QCHILD(qn)[i];
+
+    return (n);
+}
+
+/*
+ * Reorder()
+ *
+ * Put the nodes into van Emde Boas order, and move the child offsets along
+ * with them.
+ */
+
+static void Reorder()
+{
+    QNODE          *qn;
+    int            *order, *offset, *data;
+    int             i, j, n, words;
+
+    if ((order = (int *) malloc(sizeof(int) * nqnodes)) == NULL ||
+	(offset = (int *) malloc(sizeof(int) * nqwords)) == NULL ||
+	(data = (int *) malloc(sizeof(int) * nqwords)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    if (Veb_order(0, Qnode_children, order) != nqnodes)
+    {
+	fprintf(stderr, "%s: internal error 04.\n", my_name);
+	exit(1);
+    }
+
+    /*
+     * Work out where each node goes, then copy them over.
+     */
+
+    n = 0;
+    for (i = 0; i < nqnodes; i++)
+    {
+	offset[order[i]] = n;
+	n += QNODE_WORDS(((QNODE *) (qdata + order[i]))->num);
+    }
+
+    for (i = 0; i < nqnodes; i++)
+    {
+	qn = (QNODE *) (qdata + order[i]);
+	words = QNODE_WORDS(qn->num);
+	memcpy(data + offset[order[i]], qn, sizeof(int) * words);
+
+	qn = (QNODE *) (data + offset[order[i]]);
+	for (j = 0; j < qn->num; j++)
+	    if (QCHILD(qn)[j] >= 0)
+		QCHILD(qn)[j] = offset[QCHILD(qn)[j]];
+    }
+
+    free(qdata);
+    qdata = data;
+
+    free(offset);
+    free(order);
+}
+
+/*
+ * Build_qbvh()
+ *
+ * Build the compact copy of the hierarchy under the root. This has to be
+ * done again whenever the hierarchy changes.
+ */
+
+void Build_qbvh()
+{
+    int             words = 0, prims = 0, i;
+    long            old_size, new_size;
+
+    if (!IS_NODE(root))
+	return;
+
+    Count_nodes(root, &words, &prims);
+
+    free(qdata);
+    free(qprims);
+
+    if ((qdata = (int *) malloc(sizeof(int) * words)) == NULL ||
+	(qprims = (OBJECT **) malloc(sizeof(OBJECT *) * prims)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    nqwords = nqnodes = nqprims = 0;
+    Flatten(root);
+
+    if (bvh_layout == LAYOUT_VEB)
+	Reorder();
+
+    if (verbose)
+    {
+	/*
+	 * A composite in the object tree is an OBJECT and a COMPOSITE.
+	 * The boxes of its children are in the children's OBJECTs.
+	 */
+
+	old_size = 0;
+	for (i = 0; i < nobjects; i++)
+	    if (objects[i]->type == T_COMPOSITE)
+		old_size += sizeof(OBJECT) + sizeof(COMPOSITE) +
+		    sizeof(OBJECT *) * (((COMPOSITE *) objects[i]->obj)->num - 1);
+	new_size = Qbvh_memory();
+
+	fprintf(stderr, "%s: quantized hierarchy: %d nodes of %d bytes, "
+		"%ld Kbytes (was %d bytes per node, %ld Kbytes)\n",
+		my_name, nqnodes, (int) (sizeof(int) * nqwords / nqnodes),
+		new_size / 1024, (int) (old_size / nqnodes), old_size / 1024);
+    }
+}
+
+/*
+ * Qbvh_memory()
+ *
+ * Return the number of bytes taken by the compact hierarchy.
+ */
+
+long Qbvh_memory()
+{
+    return ((long) nqwords * sizeof(int) + (long) nqprims * sizeof(OBJECT *));
+}
+
+/*
+ * Intersect_qbvh()
+ *
+ * Trace the ray through the compact hierarchy, the same way Intersect()
+ * traces it through the object tree. If 'stamp' is not zero, objects are
+ * stamped with it so that each one is only tested once.
+ */
+
+int Intersect_qbvh(RAY *ray, INTERSECT *inter, int stamp)
+{
+    int             stack[STACK_SIZE];
+    int             sp, i, c, iflag;
+    int             par_x, par_y, par_z;
+    double          inv_x = 0, inv_y = 0, inv_z = 0;
+    double          t_near, t_far, t1, t2, lo, hi;
+    INTERSECT       minter;
+    QNODE          *qn;
+    OBJECT         *obj;
+    unsigned char  *box;
+
+    /*
+     * Rays parallel to a slab are tested against the origin, as in
+     * Check_and_push(). The others get their inverse direction once.
+     */
+
+    par_x = fabs(ray->dir.x) < MIN_T;
+    par_y = fabs(ray->dir.y) < MIN_T;
+    par_z = fabs(ray->dir.z) < MIN_T;
+
+    if (!par_x)
+	inv_x = 1.0 / ray->dir.x;
+    if (!par_y)
+	inv_y = 1.0 / ray->dir.y;
+    if (!par_z)
+	inv_z = 1.0 / ray->dir.z;
+
+    iflag = 0;
+    sp = 0;
+    stack[sp++] = 0;
+
+    while (sp != 0)
+    {
+	qn = (QNODE *) (qdata + stack[--sp]);
+	box = QBOX(qn);
+
+	for (i = 0; i < qn->num; i++, box += 6)
+	{
+	    t_near = -HUGE;
+	    t_far = HUGE;
+
+	    lo = qn->origin[0] + box[0] * (double) qn->scale[0];
+	    hi = qn->origin[0] + box[3] * (double) qn->scale[0];
+
+	    if (par_x)
+	    {
+		if (ray->pos.x < lo || ray->pos.x > hi)
+		    continue;
+	    }
+	    else
+	    {
+		t1 = (lo - ray->pos.x) * inv_x;
+		t2 = (hi - ray->pos.x) * inv_x;
+		t_near = MIN(t1, t2);
+		t_far = MAX(t1, t2);
+	    }
+
+	    lo = qn->origin[1] + box[1] * (double) qn->scale[1];
+	    hi = qn->origin[1] + box[4] * (double) qn->scale[1];
+
+	    if (par_y)
+	    {
+		if (ray->pos.y < lo || ray->pos.y > hi)
+		    continue;
+	    }
+	    else
+	    {
+		t1 = (lo - ray->pos.y) * inv_y;
+		t2 = (hi - ray->pos.y) * inv_y;
+		t_near = MAX(t_near, MIN(t1, t2));
+		t_far = MIN(t_far, MAX(t1, t2));
+	    }
+
+	    lo = qn->origin[2] + box[2] * (double) qn->scale[2];
+	    hi = qn->origin[2] + box[5] * (double) qn->scale[2];
+
+	    if (par_z)
+	    {
+		if (ray->pos.z < lo || ray->pos.z > hi)
+		    continue;
+	    }
+	    else
+	    {
+		t1 = (lo - ray->pos.z) * inv_z;
+		t2 = (hi - ray->pos.z) * inv_z;
+		t_near = MAX(t_near, MIN(t1, t2));
+		t_far = MIN(t_far, MAX(t1, t2));
+	    }
+
+	    /* widened as in Intersect_skip() */
+	    if (t_near * (1 - BOX_SLACK) > t_far * (1 + BOX_SLACK) ||
+		t_far * (1 + BOX_SLACK) < MIN_T)
+		continue;
+
+	    /*
+	     * The ray hits this child's box. Push a node, or test an
+	     * object right away.
+	     */
+
+	    c = QCHILD(qn)[i];
+	    if (c >= 0)
+	    {
+		if (sp == STACK_SIZE)
+		{
+		    fprintf(stderr, "%s: object stack overflow\n", my_name);
+		    exit(1);
+		}
+		stack[sp++] = c;
+		continue;
+	    }
+
+	    obj = qprims[-1 - c];
+
+	    /* as in Intersect_skip() */
+	    if (!Hit_bbox(obj, ray))
+		continue;
+
+	    if (stamp)
+	    {
+		if (obj->active == stamp)
+		    continue;
+		obj->active = stamp;
+	    }
+
+	    inter->inst = NULL;
+	    if (INTERSECT_OBJECT(obj, ray, inter))
+	    {
+		if (iflag == 0 || CLOSER(inter, &minter))
+		{
+		    iflag = 1;
+		    minter = *inter;
+		}
+	    }
+	}
+    }
+
+    if (iflag)
+    {
+	*inter = minter;
+	return (1);
+    }
+    else
+	return (0);
+}
@@ -22,39 +22,152 @@
 #include "rt.h"
 #include "externs.h"
 
-int             Quadric_intersect();
+int             Quadric_intersect(), Square_intersect();
 void		Quadric_normal();
 
 /*
- * Build_quadric()
- * 
- * Given some info on a quadric, build the entire object structure.
+ * Square_bounds()
+ *
+ * Bound a quadric with no cross terms, where each axis is either squared,
+ * linear or missing. With the squares completed, the squared terms add up
+ * to what the linear ones and the constant leave, and when they all have
+ * the same sign, each one is at most that much. The linear axes are taken
+ * at the far side of the given box. Returns 0 if there is no such bound.
  */
 
-void Build_quadric(QUADRIC *q)
+static int Square_bounds(double *sq, double *lin, double j, VECTOR *b_min,
+			 VECTOR *b_max, double *lo, double *hi)
 {
-    OBJECT         *o;
+    double          c[3], k, sign;
+    REAL           *umin, *umax;
+    int             n;
 
-    if (nobjects == MAX_PRIMS)
+    umin = (REAL *) b_min;
+    umax = (REAL *) b_max;
+
+    /* turn it so that the squared terms are positive */
+    sign = 0.0;
+    for (n = 0; n < 3; n++)
     {
-	fprintf(stderr, "%s: too many objects specified\n", my_name);
-	exit(1);
+	if (sq[n] == 0.0)
+	    continue;
+	if (sign == 0.0)
+	    sign = sq[n] > 0.0 ? 1.0 : -1.0;
+	else if (sq[n] * sign < 0.0)
+	    return (0);
     }
 
-    if ((o = (OBJECT *) malloc(sizeof(OBJECT))) == NULL)
+    if (sign == 0.0)
+	return (0);
+
+    k = -j * sign;
+    for (n = 0; n < 3; n++)
     {
-	fprintf(stderr, "%s: malloc failed\n", my_name);
-	exit(1);
+	if (sq[n] != 0.0)
+	{
+	    c[n] = -lin[n] / sq[n];
+	    k += lin[n] * lin[n] / (sq[n] * sign);
+	}
+	else if (lin[n] != 0.0)
+	    k += MAX(-2.0 * lin[n] * sign * umin[n],
+		     -2.0 * lin[n] * sign * umax[n]);
     }
 
+    if (k < 0.0)
+	return (0);
+
+    for (n = 0; n < 3; n++)
+    {
+	if (sq[n] != 0.0)
+	{
+	    lo[n] = c[n] - sqrt(k / (sq[n] * sign));
+	    hi[n] = c[n] + sqrt(k / (sq[n] * sign));
+	}
+	else
+	{
+	    lo[n] = umin[n];
+	    hi[n] = umax[n];
+	}
+    }
+
+    return (1);
+}
+
+/*
+ * Ellipsoid_bounds()
+ *
+ * Bound a quadric whose matrix is definite, an ellipsoid turned any way.
+ * Its center is where the gradient is zero, and along each axis it reaches
+ * the square root of the level there times that entry of the inverse
+ * matrix. Returns 0 if it is not an ellipsoid.
+ */
+
+static int Ellipsoid_bounds(QUADRIC *q, double *lo, double *hi)
+{
+    double          inv[3][3], det, sign, k;
+    double          ctr[3], lin[3];
+    int             n;
+
+    /* turn it so that the matrix is positive, if it is definite */
+    sign = q->a > 0.0 ? 1.0 : -1.0;
+
+    inv[0][0] = q->e * q->h - q->f * q->f;
+    inv[0][1] = q->c * q->f - q->b * q->h;
+    inv[0][2] = q->b * q->f - q->c * q->e;
+    inv[1][1] = q->a * q->h - q->c * q->c;
+    inv[1][2] = q->b * q->c - q->a * q->f;
+    inv[2][2] = q->a * q->e - q->b * q->b;
+    inv[1][0] = inv[0][1];
+    inv[2][0] = inv[0][2];
+    inv[2][1] = inv[1][2];
+
+    det = q->a * inv[0][0] + q->b * inv[0][1] + q->c * inv[0][2];
+
+    if (q->a * sign <= 0.0 || inv[2][2] <= 0.0 || det * sign <= 0.0)
+	return (0);
+
+    lin[0] = q->d;
+    lin[1] = q->g;
+    lin[2] = q->i;
+
+    k = -q->j;
+    for (n = 0; n < 3; n++)
+    {
+	ctr[n] = -(inv[n][0] * lin[0] + inv[n][1] * lin[1] +
+		   inv[n][2] * lin[2]) / det;
+	k -= lin[n] * ctr[n];
+    }
+
+    if (k * sign < 0.0)
+	return (0);
+
+    for (n = 0; n < 3; n++)
+    {
+	lo[n] = ctr[n] - sqrt(k * inv[n][n] / det);
+	hi[n] = ctr[n] + sqrt(k * inv[n][n] / det);
+    }
+
+    return (1);
+}
+
+/*
+ * Build_quadric()
+ * 
+ * Given some info on a quadric, build the entire object structure. The
+ * quadric is copied into the object.
+ */
+
+void Build_quadric(QUADRIC *q)
+{
+    OBJECT         *o;
+    double          sq[3], lin[3], lo[3], hi[3];
+    REAL           *bmin, *bmax;
+    int             n, bounded;
 
-    o->type = T_QUADRIC;
-    o->obj = q;
-    o->surf = cur_surface;
-    o->inter = Quadric_intersect;
+    o = New_object(T_QUADRIC, q, sizeof(QUADRIC));
     o->normal = Quadric_normal;
 
-    objects[nobjects++] = o;
+    q = (QUADRIC *) o->obj;
 
     /*
      * Calculate some constants that we will need in the intersect
@@ -70,55 +183,95 @@ void Build_quadric(QUADRIC *q)
     q->i2 = q->i * 2.0;
 
     /*
-     * Setup the min and the max values for the bouding box. For now,
-     * just use what the user specifies.
+     * Setup the min and the max values for the bouding box. The one the
+     * user specifies is cut down to the one of the surface, when it is
+     * bounded, or bounded across its axis. The intersect routines only
+     * take hits inside the user's box, so this only makes them faster.
      */
 
     o->b_min = q->min;
     o->b_max = q->max;
 
+    if (q->b == 0.0 && q->c == 0.0 && q->f == 0.0)
+    {
+	o->inter = Square_intersect;
+
+	sq[0] = q->a;
+	sq[1] = q->e;
+	sq[2] = q->h;
+	lin[0] = q->d;
+	lin[1] = q->g;
+	lin[2] = q->i;
+
+	bounded = Square_bounds(sq, lin, q->j, &q->min, &q->max, lo, hi);
+    }
+    else
+    {
+	o->inter = Quadric_intersect;
+	bounded = Ellipsoid_bounds(q, lo, hi);
+    }
+
+    if (!bounded)
+	return;
+
+    /* a surface all outside of the user's box keeps that box */
+    bmin = (REAL *) &q->min;
+    bmax = (REAL *) &q->max;
+    for (n = 0; n < 3; n++)
+	if (MAX(lo[n], bmin[n]) > MIN(hi[n], bmax[n]))
+	    return;
+
+    bmin = (REAL *) &o->b_min;
+    bmax = (REAL *) &o->b_max;
+    for (n = 0; n < 3; n++)
+    {
+	bmin[n] = MAX(lo[n], bmin[n]);
+	bmax[n] = MIN(hi[n], bmax[n]);
+    }
 }
 
 /*
- * Quadric_intersect()
- * 
- * Check given quadratic for intersection with given ray. Return TRUE if an
- * intersection takes place.
+ * In_box()
+ *
+ * Return TRUE if the point at distance t along the ray is inside the box
+ * the user gave the quadric.
  */
 
-int Quadric_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
+static int In_box(QUADRIC *q, RAY *ray, double t)
 {
-    QUADRIC        *q;
-    VECTOR          rd, rp;
-    double          aq, nbq, cq;
-    double          t, disc;
-    double          ka, kb;
+    double          x, y, z;
 
-    q = (QUADRIC *) obj->obj;
+    x = ray->pos.x + t * ray->dir.x;
+    y = ray->pos.y + t * ray->dir.y;
+    z = ray->pos.z + t * ray->dir.z;
 
-    rd = ray->dir;
-    rp = ray->pos;
-
-    /*
-     * Compute Aq, Bq, Cq.
-     */
+    return (x >= q->min.x && x <= q->max.x &&
+	    y >= q->min.y && y <= q->max.y &&
+	    z >= q->min.z && z <= q->max.z);
+}
 
-    aq = rd.x * (q->a * rd.x + q->b2 * rd.y + q->c2 * rd.z) +
-	rd.y * (q->e * rd.y + q->f2 * rd.z) +
-	q->h * rd.z * rd.z;
+/*
+ * Quadric_roots()
+ *
+ * Given the coefficients of the quadratic along the ray, Aq, -Bq and Cq,
+ * find its closest root inside the quadric's box. Only the part of the
+ * surface in the box the user gave is there, so if the near root is
+ * outside of it, the far one is taken, which is seen through the cut.
+ */
 
-    nbq = rd.x * (q->a * rp.x + q->b * rp.y + q->c * rp.z + q->d) +
-	rd.y * (q->b * rp.x + q->e * rp.y + q->f * rp.z + q->g) +
-	rd.z * (q->c * rp.x + q->f * rp.y + q->h * rp.z + q->i);
+static int Quadric_roots(OBJECT *obj, RAY *ray, double aq, double nbq,
+			 double cq, INTERSECT *inter)
+{
+    QUADRIC        *q;
+    double          t, disc;
+    double          ka, kb;
 
-    cq = rp.x * (q->a * rp.x + q->b2 * rp.y + q->c2 * rp.z + q->d2) +
-	rp.y * (q->e * rp.y + q->f2 * rp.z + q->g2) +
-	rp.z * (q->h * rp.z + q->i2) + q->j;
+    q = (QUADRIC *) obj->obj;
 
     if (fabs(aq) < MIN_T)
     {
 	t = -cq / (2 * nbq);
-	if (t < MIN_T)
+	if (t < MIN_T || !In_box(q, ray, t))
 	    return (0);	/* no hit */
 
 	inter->obj = obj;
@@ -140,10 +293,10 @@ int Quadric_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
 
     t = ka - sqrt(disc);
 
-    if (t < MIN_T)
+    if (t < MIN_T || !In_box(q, ray, t))
     {
 	t = ka + sqrt(disc);
-	if (t < MIN_T)
+	if (t < MIN_T || !In_box(q, ray, t))
 	    return (0);
 	inter->inside = 1;
     }
@@ -156,6 +309,76 @@ int Quadric_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
     return (1);
 }
 
+/*
+ * Quadric_intersect()
+ * 
+ * Check given quadratic for intersection with given ray. Return TRUE if an
+ * intersection takes place.
+ */
+
+int Quadric_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
+{
+    QUADRIC        *q;
+    VECTOR          rd, rp;
+    double          aq, nbq, cq;
+
+    q = (QUADRIC *) obj->obj;
+
+    rd = ray->dir;
+    rp = ray->pos;
+
+    /*
+     * Compute Aq, Bq, Cq.
+     */
+
+    aq = rd.x * (q->a * rd.x + q->b2 * rd.y + q->c2 * rd.z) +
+	rd.y * (q->e * rd.y + q->f2 * rd.z) +
+	q->h * rd.z * rd.z;
+
+    nbq = rd.x * (q->a * rp.x + q->b * rp.y + q->c * rp.z + q->d) +
+	rd.y * (q->b * rp.x + q->e * rp.y + q->f * rp.z + q->g) +
+	rd.z * (q->c * rp.x + q->f * rp.y + q->h * rp.z + q->i);
+
+    cq = rp.x * (q->a * rp.x + q->b2 * rp.y + q->c2 * rp.z + q->d2) +
+	rp.y * (q->e * rp.y + q->f2 * rp.z + q->g2) +
+	rp.z * (q->h * rp.z + q->i2) + q->j;
+
+    return (Quadric_roots(obj, ray, aq, nbq, cq, inter));
+}
+
+/*
+ * Square_intersect()
+ *
+ * Check a quadric with no cross terms, such as an ellipsoid, cylinder or
+ * paraboloid along the axes, for intersection with the given ray. The sums
+ * are those of Quadric_intersect() without the terms which are zero, which
+ * takes a little over half of the multiplies.
+ */
+
+int Square_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
+{
+    QUADRIC        *q;
+    VECTOR          rd, rp;
+    double          aq, nbq, cq;
+
+    q = (QUADRIC *) obj->obj;
+
+    rd = ray->dir;
+    rp = ray->pos;
+
+    aq = rd.x * (q->a * rd.x) + rd.y * (q->e * rd.y) + q->h * rd.z * rd.z;
+
+    nbq = rd.x * (q->a * rp.x + q->d) +
+	rd.y * (q->e * rp.y + q->g) +
+	rd.z * (q->h * rp.z + q->i);
+
+    cq = rp.x * (q->a * rp.x + q->d2) +
+	rp.y * (q->e * rp.y + q->g2) +
+	rp.z * (q->h * rp.z + q->i2) + q->j;
+
+    return (Quadric_roots(obj, ray, aq, nbq, cq, inter));
+}
+
 
 /*
  * Quadric_normal()
@@ -0,0 +1,245 @@
+/*
+ * refit.c
+ *
+ * This module lets the frames of an animation share one bounding box
+ * hierarchy. When a frame has the same objects as the one before it, only
+ * moved around, the old tree is kept and its boxes are recomputed from the
+ * bottom up. The tree is only built from scratch when this makes it too
+ * much worse than it was after its last full build.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rt.h"
+#include "externs.h"
+
+static OBJECT **frame_prims = NULL;	/* primitives in input file order */
+static OBJECT **frame_tree = NULL;	/* object list after the build	 */
+static OBJECT  *frame_root;		/* root of the kept tree	 */
+static int      frame_nprims = 0;	/* number of primitives		 */
+static int      frame_nobjects = 0;	/* primitives and composites	 */
+static double   frame_cost;		/* SAH cost after the last build */
+
+/*
+ * Free_composites()
+ *
+ * Release the composite objects of the kept tree.
+ */
+
+static void Free_composites()
+{
+    int             i;
+
+    for (i = frame_nprims; i < frame_nobjects; i++)
+    {
+	free(frame_tree[i]->obj);
+	free(frame_tree[i]);
+    }
+}
+
+/*
+ * Free_data()
+ *
+ * Release the data of a primitive which is not in the block of its object.
+ * The triangles of a mesh share its block, which goes with the last of them.
+ */
+
+static void Free_data(OBJECT *o)
+{
+    TRIANGLE       *tri;
+
+    if (o->type == T_TRIANGLE)
+    {
+	tri = (TRIANGLE *) o->obj;
+	if (tri == &tri->mesh->tris[tri->mesh->ntris - 1])
+	    free(tri->mesh);
+    }
+}
+
+/*
+ * Keep_hierarchy()
+ *
+ * Build a new tree over the current objects, which must be in input file
+ * order, and remember it for the following frames.
+ */
+
+static void Keep_hierarchy()
+{
+    frame_nprims = nobjects;
+    frame_prims = (OBJECT **) realloc(frame_prims,
+				      sizeof(OBJECT *) * frame_nprims);
+    if (frame_prims == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+    memcpy(frame_prims, objects, sizeof(OBJECT *) * frame_nprims);
+
+    Build_hierarchy();
+
+    frame_nobjects = nobjects;
+    frame_tree = (OBJECT **) realloc(frame_tree,
+				     sizeof(OBJECT *) * frame_nobjects);
+    if (frame_tree == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+    memcpy(frame_tree, objects, sizeof(OBJECT *) * frame_nobjects);
+
+    frame_root = root;
+    frame_cost = Sah_cost(root);
+}
+
+/*
+ * Refit_composites()
+ *
+ * Recompute the box of every composite from its children. The builders add
+ * each composite to the object list after all of its children, so one pass
+ * in list order does the whole tree from the bottom up.
+ */
+
+static void Refit_composites()
+{
+    OBJECT         *cp;
+    COMPOSITE      *cd;
+    int             i, j;
+
+    for (i = frame_nprims; i < frame_nobjects; i++)
+    {
+	cp = frame_tree[i];
+	cd = (COMPOSITE *) cp->obj;
+
+	cp->b_min.x = cp->b_min.y = cp->b_min.z = HUGE;
+	cp->b_max.x = cp->b_max.y = cp->b_max.z = -HUGE;
+
+	for (j = 0; j < cd->num; j++)
+	{
+	    cp->b_min.x = MIN(cd->child[j]->b_min.x, cp->b_min.x);
+	    cp->b_min.y = MIN(cd->child[j]->b_min.y, cp->b_min.y);
+	    cp->b_min.z = MIN(cd->child[j]->b_min.z, cp->b_min.z);
+
+	    cp->b_max.x = MAX(cd->child[j]->b_max.x, cp->b_max.x);
+	    cp->b_max.y = MAX(cd->child[j]->b_max.y, cp->b_max.y);
+	    cp->b_max.z = MAX(cd->child[j]->b_max.z, cp->b_max.z);
+	}
+    }
+}
+
+/*
+ * Refit_hierarchy()
+ *
+ * Try to reuse the tree of the last frame for the objects just read in.
+ * The objects must match the last frame's one for one, in input file order,
+ * type and size. The new data is moved into the old objects so that the
+ * tree's pointers stay good. Returns 1 if the old tree is in use again.
+ */
+
+static int Refit_hierarchy()
+{
+    OBJECT         *o;
+    double          cost;
+    int             i, size;
+
+    if (frame_tree == NULL || nobjects != frame_nprims)
+	return (0);
+
+    for (i = 0; i < nobjects; i++)
+	if (objects[i]->type != frame_prims[i]->type ||
+	    Data_size(objects[i]) != Data_size(frame_prims[i]))
+	    return (0);
+
+    for (i = 0; i < nobjects; i++)
+    {
+	o = frame_prims[i];
+	Free_data(o);
+	size = Data_size(objects[i]);
+	*o = *objects[i];
+	o->active = 0;
+
+	/* the data in the block goes along with the object */
+	if (size > 0)
+	{
+	    memcpy(o + 1, objects[i] + 1, size);
+	    o->obj = (void *) (o + 1);
+	}
+
+	free(objects[i]);
+	objects[i] = o;
+    }
+
+    Refit_composites();
+
+    cost = Sah_cost(frame_root);
+
+    if (cost > frame_cost * refit_threshold)
+    {
+	if (verbose)
+	{
+	    fprintf(stderr, "%s: refit cost %g vs %g, rebuilding\n",
+		    my_name, cost, frame_cost);
+	}
+
+	Free_composites();
+	free(frame_tree);
+	frame_tree = NULL;
+	return (0);
+    }
+
+    memcpy(objects, frame_tree, sizeof(OBJECT *) * frame_nobjects);
+    nobjects = frame_nobjects;
+    root = frame_root;
+
+    if (verbose)
+    {
+	fprintf(stderr, "%s: refit cost %g vs %g, kept the old tree\n",
+		my_name, cost, frame_cost);
+    }
+
+    return (1);
+}
+
+/*
+ * Build_frame_hierarchy()
+ *
+ * Set up the hierarchy for the frame just read in. The first frame, and any
+ * frame that does not match the last one, gets a new tree.
+ */
+
+void Build_frame_hierarchy(int first)
+{
+    int             i;
+
+    if (!first && refit_threshold > 0.0 && Refit_hierarchy())
+	return;
+
+    /*
+     * If the old tree was not refitted, its objects are gone for good.
+     */
+
+    if (frame_tree != NULL)
+    {
+	for (i = 0; i < frame_nprims; i++)
+	{
+	    Free_data(frame_prims[i]);
+	    free(frame_prims[i]);
+	}
+	Free_composites();
+    }
+
+    Keep_hierarchy();
+}
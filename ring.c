@@ -29,7 +29,8 @@ extern int      line;
 /*
  * Build_ring()
  * 
- * Given some info on a ring, build the entire object structure.
+ * Given some info on a ring, build the entire object structure. The ring
+ * is copied into the object.
  */
 
 void Build_ring(RING *r)
@@ -37,26 +38,11 @@ void Build_ring(RING *r)
     OBJECT         *o;
     VECTOR          pt1, pt2;
 
-    if (nobjects == MAX_PRIMS)
-    {
-	fprintf(stderr, "%s: too many objects specified\n", my_name);
-	exit(1);
-    }
-
-    if ((o = (OBJECT *) malloc(sizeof(OBJECT))) == NULL)
-    {
-	fprintf(stderr, "%s: malloc failed\n", my_name);
-	exit(1);
-    }
-
-
-    o->type = T_RING;
-    o->obj = r;
-    o->surf = cur_surface;
+    o = New_object(T_RING, r, sizeof(RING));
     o->inter = Ring_intersect;
     o->normal = Ring_normal;
 
-    objects[nobjects++] = o;
+    r = (RING *) o->obj;
 
     /*
      * Calculate the normals and the D coefficient by various cross
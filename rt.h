@@ -19,14 +19,22 @@
  * Define some stuff
  */
 
-#define	MAX_LIGHTS	8	/* maximum number of light sources */
 #define	MAX_PRIMS	800000	/* maximum number of primitives	 */
 #define MAX_INSTANCE	64	/* maximum number of instances	   */
-#define MAX_TOKENS	17
-#define MIN_T		1e-12
+#define MAX_TOKENS	18
 #define MAX_LEVEL	5	/* maxmimum recursion level	   */
-#define GROUP_SIZE	4
+#define MAX_NAME	64	/* room for a file name		   */
+#define GROUP_SIZE	4	/* default branching and leaf size */
+#define MAX_GROUP	16	/* most children of a composite	   */
+#define SAH_PRIM	2.0	/* cost of a primitive test vs a box test */
+#define LAYOUT_DFS	0	/* flattened hierarchies in depth first */
+#define LAYOUT_VEB	1	/* or van Emde Boas order		   */
+#define SPLIT_FACTOR	16.0	/* polygon box area vs the median  */
 #define STACK_SIZE	512
+#define MAX_PACKET	16	/* most rays traced as one packet */
+#define BOX_SLACK	1e-14	/* widening of multiplied box tests */
+#define LIGHT_CUTOFF	0.001	/* least intensity a light is shaded with */
+#define LIGHT_STACK	64	/* depth of the light hierarchy walk */
 
 /*
  * Object types
@@ -39,6 +47,8 @@
 #define T_CONE		4
 #define T_RING		5
 #define T_QUADRIC	6
+#define T_INSTANCE	7
+#define T_TRIANGLE	8
 
 /*
  * Instance type flags
@@ -52,13 +62,33 @@
  * Structures
  */
 
+/*
+ * Points, directions and the sizes of the primitives are kept in REAL,
+ * which is a double unless rt is built with -DSINGLE. Then it is a float,
+ * so the geometry and the boxes take half the room, and SIMD registers
+ * hold twice as many of them. Distances along rays, colors and the
+ * coefficients of quadrics stay in double either way. Points hit on a
+ * surface are only good to the precision of a float, so rays sent out from
+ * them skip a longer stretch before they can hit anything.
+ */
+
+#ifdef SINGLE
+typedef float   REAL;
+#define R_FMT		"%g"	/* scanf format of a REAL	 */
+#define MIN_T		1e-4
+#else
+typedef double  REAL;
+#define R_FMT		"%lg"
+#define MIN_T		1e-12
+#endif
+
 /* vector */
 
 typedef struct vector
 {
-	double          x;
-	double          y;
-	double          z;
+	REAL            x;
+	REAL            y;
+	REAL            z;
 }               VECTOR;
 
 
@@ -93,28 +123,82 @@ typedef struct surface
 typedef struct composite
 {
 	int             num;	/* number of object in this group */
-	struct object  *child[GROUP_SIZE];	/* pointer to members		 */
+	struct sphere_leaf *leaf;	/* children packed as spheres	 */
+	struct object  *child[1];	/* pointer to members		 */
 }               COMPOSITE;
 
+/*
+ * The spheres of a composite whose children are all spheres, kept as arrays
+ * of each value so that they can be tested several at once. The arrays are
+ * padded out to a whole number of SIMD lanes with copies of the last one.
+ */
+
+typedef struct sphere_leaf
+{
+	int             num;	/* number of entries, padded	 */
+	REAL           *cx, *cy, *cz;	/* centers			 */
+	REAL           *r2;	/* squared radii		 */
+	struct object **obj;	/* objects of the spheres	 */
+}               SPHERE_LEAF;
+
+/*
+ * Composites are gone down into when traced, unless they are traced as a
+ * leaf by their own intersect routine.
+ */
+
+#define IS_NODE(o)	((o)->type == T_COMPOSITE && \
+			 ((COMPOSITE *) (o)->obj)->leaf == NULL)
+
 /* n-point polygon */
 
 typedef struct polygon
 {
 	int             npoints;/* number of points		 */
 	VECTOR          normal;	/* surface normal (normalized)	 */
-	double          d;	/* the D coefficient		 */
+	REAL            d;	/* the D coefficient		 */
 	int             p1, p2;	/* the dominant normals		 */
 	VECTOR          points[1];	/* actual points		 */
 }               POLYGON;
 
+/*
+ * A polygon is allocated with room for three numbers for each edge, as seen
+ * on the plane of its dominant normals, after its points. Triangles and
+ * convex quads keep the lines of their edges there, and other polygons the
+ * points and slopes of theirs.
+ */
+
+#define POLY_SIZE(n)	(sizeof(POLYGON) + sizeof(VECTOR) * ((n) - 1) + \
+			 sizeof(REAL) * 3 * (n))
+#define POLY_EDGES(p)	((REAL (*)[3]) &(p)->points[(p)->npoints])
+#define EDGE_BAND	(4 * MIN_T)	/* nearer an edge, Poly_crossing() decides */
+
+/*
+ * Triangle mesh. The vertices and triangles are kept in one block after the
+ * mesh itself, and each triangle is an object of its own.
+ */
+
+typedef struct triangle
+{
+	struct mesh    *mesh;	/* mesh it belongs to		 */
+	int             v[3];	/* indexes of its vertices	 */
+}               TRIANGLE;
+
+typedef struct mesh
+{
+	int             nverts;	/* number of vertices		 */
+	int             ntris;	/* number of triangles		 */
+	VECTOR         *verts;	/* the vertices			 */
+	TRIANGLE       *tris;	/* and the triangles		 */
+}               MESH;
+
 
 /* sphere */
 
 typedef struct sphere
 {
 	VECTOR          center;	/* center of sphere		 */
-	double          radius;	/* and its radius		 */
-	double          radius2;/* radius * radius		 */
+	REAL            radius;	/* and its radius		 */
+	REAL            radius2;/* radius * radius		 */
 }               SPHERE;
 
 /* hallow sphere */
@@ -122,10 +206,10 @@ typedef struct sphere
 typedef struct hsphere
 {
 	VECTOR          center;	/* center of sphere		 */
-	double          radius;	/* and its radius		 */
-	double          radius2;/* radius * radius		 */
-	double          i_radius;	/* inner_radius = outer - tickness */
-	double          i_radius2;	/* i_radius * i_radius		 */
+	REAL            radius;	/* and its radius		 */
+	REAL            radius2;/* radius * radius		 */
+	REAL            i_radius;	/* inner_radius = outer - tickness */
+	REAL            i_radius2;	/* i_radius * i_radius		 */
 }               HSPHERE;
 
 
@@ -134,17 +218,17 @@ typedef struct hsphere
 typedef struct cone
 {
 	VECTOR          base;	/* center of base		 */
-	double          base_radius;	/* base radius			 */
-	double          base_d;	/* base D coefficient		 */
+	REAL            base_radius;	/* base radius			 */
+	REAL            base_d;	/* base D coefficient		 */
 	VECTOR          apex;	/* center of apex		 */
-	double          apex_radius;	/* apex radius			 */
+	REAL            apex_radius;	/* apex radius			 */
 	VECTOR          u;
 	VECTOR          v;
 	VECTOR          w;
-	double          height;	/* apex - base			 */
-	double          slope;	/* slope of the damn thing	 */
-	double          min_d;
-	double          max_d;
+	REAL            height;	/* apex - base			 */
+	REAL            slope;	/* slope of the damn thing	 */
+	REAL            min_d;
+	REAL            max_d;
 }               CONE;
 
 /* ring */
@@ -155,11 +239,11 @@ typedef struct ring
 	VECTOR          point1;	/* one point on surface		 */
 	VECTOR          point2;	/* another point on surface	 */
 	VECTOR          normal;	/* surface normal		 */
-	double          d;	/* the D coefficient		 */
-	double          o_radius;	/* outer radius			 */
-	double          i_radius;	/* inner radius			 */
-	double          o_radius2;	/* o_radius * o_radius		 */
-	double          i_radius2;	/* i_radius * i_radius		 */
+	REAL            d;	/* the D coefficient		 */
+	REAL            o_radius;	/* outer radius			 */
+	REAL            i_radius;	/* inner radius			 */
+	REAL            o_radius2;	/* o_radius * o_radius		 */
+	REAL            i_radius2;	/* i_radius * i_radius		 */
 }               RING;
 
 /*
@@ -179,20 +263,44 @@ typedef struct quadric
 
 /*
  * The OBJECT data type is built from all of the previous types.
+ *
+ * The data of a primitive is kept in the same block as its object, right
+ * after it, so that testing it does not go to another block. The fields
+ * which a trace reads for every child it comes to, the box, the type, the
+ * stamp and the data pointer, come first and take 64 bytes, one cache line
+ * when the block starts on one. The fields only used for shading are last,
+ * next to the data.
  */
 
 typedef struct object
 {
-	int             type;	/* T_* goes here		 */
-	void           *obj;	/* actually point to type CONE, etc. */
 	VECTOR          b_min;	/* bounding box in values	 */
 	VECTOR          b_max;	/* bounding box max values	 */
-	int             active;	/* TRUE if on active hit list	 */
-	SURFACE        *surf;	/* object surface properties	 */
+	int             type;	/* T_* goes here		 */
+	int             active;	/* stamp of the last ray tested	 */
+	int             id;	/* order it was made in		 */
+	void           *obj;	/* actually point to type CONE, etc. */
 	int             (*inter) ();	/* pointer to intersect routine  */
 	void            (*normal) ();	/* pointer to normal routine	 */
+	SURFACE        *surf;	/* object surface properties	 */
 }               OBJECT;
 
+/*
+ * One placement of an instance definition. The tree is shared by all of the
+ * placements of the same definition. A placement which is turned or scaled
+ * as well as moved keeps the matrix it was given, and its inverse.
+ */
+
+typedef struct placement
+{
+	OBJECT         *tree;	/* hierarchy of the definition	 */
+	VECTOR          offset;	/* where it is placed		 */
+	int             first;	/* its entry in the stackless tree */
+	int             turned;	/* set if it has a matrix	 */
+	double          m[3][3];	/* definition to scene		 */
+	double          inv[3][3];	/* scene to definition		 */
+}               PLACEMENT;
+
 /*
  * This data type contains info about object intersection
  */
@@ -200,10 +308,22 @@ typedef struct object
 typedef struct intersect
 {
 	OBJECT         *obj;	/* object that caused the intersect */
+	OBJECT         *inst;	/* placement it was hit in, or NULL */
 	double          t;	/* distance				 */
 	int             inside;	/* 1 = ray is inside object		 */
 }               INTERSECT;
 
+/*
+ * TRUE if hit a is closer than hit b. Hits at the same distance go by the
+ * order the objects were made in, and then by that of their placements, so
+ * that every traversal picks the same one whatever order it visits them.
+ */
+
+#define INST_ID(h)	((h)->inst != NULL ? (h)->inst->id : -1)
+#define CLOSER(a, b)	((a)->t < (b)->t || ((a)->t == (b)->t && \
+			 ((a)->obj->id < (b)->obj->id || \
+			  ((a)->obj == (b)->obj && INST_ID(a) < INST_ID(b)))))
+
 /*
  * This date type conatins info about the image and observer.
  */
@@ -237,9 +357,25 @@ typedef struct light
 	VECTOR          pos;	/* light position		 */
 	COLOR           col;	/* color of light		 */
 	double          intensity;	/* light intensity		 */
+	int             falloff;	/* set if it falls off with distance */
+	double          range;	/* how far it reaches, if it does */
 	OBJECT         *cache[MAX_LEVEL];	/* shadow cache			 */
 }               LIGHT;
 
+/*
+ * A walk over the lights which can reach a point. Lights which don't fall
+ * off come first, then the ones found in the light hierarchy.
+ */
+
+typedef struct light_walk
+{
+	VECTOR          pos;	/* point being lit		 */
+	int             plain;	/* next light without falloff	 */
+	int             leaf, end;	/* lights of the current leaf	 */
+	int             sp;	/* nodes still to visit		 */
+	int             stack[LIGHT_STACK];
+}               LIGHT_WALK;
+
 /*
  * This data type contains info about rays.
  */
@@ -250,6 +386,19 @@ typedef struct ray
 	VECTOR          dir;	/* ray direction		 */
 }               RAY;
 
+/*
+ * The pyramid from the eye which holds a packet of primary rays. A point p
+ * is on the inner side of face i if the dot product of n[i] and p - eye is
+ * not negative. It is kept in double even in a SINGLE build, so its faces
+ * are as close to the rays as they can be.
+ */
+
+typedef struct frustum
+{
+	double          eye[3];	/* apex				 */
+	double          n[4][3];	/* inward normals of the faces	 */
+}               FRUSTUM;
+
 /*
  * Instance info holder
  */
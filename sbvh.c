@@ -0,0 +1,738 @@
+/*
+ * sbvh.c
+ *
+ * This module contains the spatial split bounding volume hierarchy builder.
+ * It works top down like a regular surface area heuristic (SAH) build, but
+ * besides partitioning the objects of a node it may also cut the node with a
+ * plane and put a clipped reference to each straddling object on both sides.
+ * Long, thin polygons and cones then stop inflating every box above them.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "rt.h"
+#include "externs.h"
+
+#define SPLIT_BINS	32	/* spatial split candidates per axis */
+#define SPLIT_ALPHA	1e-5	/* min overlap/root area to try spatial */
+#define SPLIT_DEPTH	64	/* no spatial splits below this depth */
+
+#define AXIS(v, a)	(((REAL *) &(v))[a])
+
+/*
+ * An object reference. The box is the part of the object's box which lies in
+ * the node the reference belongs to.
+ */
+
+typedef struct sref
+{
+    OBJECT         *obj;	/* the referenced object	 */
+    VECTOR          b_min;	/* clipped bounding box		 */
+    VECTOR          b_max;
+}               SREF;
+
+/*
+ * One bin of the spatial split search.
+ */
+
+typedef struct sbin
+{
+    VECTOR          b_min;	/* box of the clipped refs	 */
+    VECTOR          b_max;
+    int             enter;	/* refs which start in this bin	 */
+    int             exit;	/* refs which end in this bin	 */
+}               SBIN;
+
+/*
+ * The result of a split search.
+ */
+
+typedef struct split
+{
+    double          cost;	/* SAH cost of the split	 */
+    int             axis;	/* split axis			 */
+    int             spatial;	/* 1 if this is a spatial split	 */
+    int             index;	/* object split: first right ref */
+    double          pos;	/* spatial split: plane position */
+}               SPLIT;
+
+static int      axis;
+static int      nrefs;		/* references in the hierarchy	 */
+static int      max_refs;	/* reference budget		 */
+static int      n_spatial;	/* spatial splits made		 */
+static double   root_area;	/* surface area of the scene box */
+
+/*
+ * Empty_box()
+ *
+ * Make the given box empty so that anything grown into it replaces it.
+ */
+
+static void Empty_box(VECTOR *b_min, VECTOR *b_max)
+{
+    b_min->x = b_min->y = b_min->z = HUGE;
+    b_max->x = b_max->y = b_max->z = -HUGE;
+}
+
+/*
+ * Grow_box()
+ *
+ * Grow the first box to contain the second one. Empty boxes are ignored.
+ */
+
+static void Grow_box(VECTOR *b_min, VECTOR *b_max, VECTOR *o_min, VECTOR *o_max)
+{
+    if (o_min->x > o_max->x || o_min->y > o_max->y || o_min->z > o_max->z)
+	return;
+
+    b_min->x = MIN(o_min->x, b_min->x);
+    b_min->y = MIN(o_min->y, b_min->y);
+    b_min->z = MIN(o_min->z, b_min->z);
+
+    b_max->x = MAX(o_max->x, b_max->x);
+    b_max->y = MAX(o_max->y, b_max->y);
+    b_max->z = MAX(o_max->z, b_max->z);
+}
+
+/*
+ * Clip_box()
+ *
+ * Shrink the first box to its overlap with the second one.
+ */
+
+static void Clip_box(VECTOR *b_min, VECTOR *b_max, VECTOR *o_min, VECTOR *o_max)
+{
+    b_min->x = MAX(o_min->x, b_min->x);
+    b_min->y = MAX(o_min->y, b_min->y);
+    b_min->z = MAX(o_min->z, b_min->z);
+
+    b_max->x = MIN(o_max->x, b_max->x);
+    b_max->y = MIN(o_max->y, b_max->y);
+    b_max->z = MIN(o_max->z, b_max->z);
+}
+
+/*
+ * Split_ref()
+ *
+ * Cut the given reference with the plane at 'pos' on 'axis'. For polygons
+ * and triangles, the polygon itself is clipped against the plane so that
+ * each side only gets the bounds of the part of the polygon that lies there. For everything
+ * else the box is simply cut in two. A side which does not get any part of
+ * the object is returned as an empty box.
+ */
+
+static void Split_ref(SREF *ref, int ax, double pos, SREF *left, SREF *right)
+{
+    POLYGON        *p;
+    TRIANGLE       *tri;
+    VECTOR         *vi, *vj, ip, *points, corner[3];
+    double          a, b, t;
+    int             i, n = 0;
+
+    *left = *right = *ref;
+    points = NULL;
+
+    if (ref->obj->type == T_POLYGON)
+    {
+	p = (POLYGON *) ref->obj->obj;
+	points = p->points;
+	n = p->npoints;
+    }
+    else if (ref->obj->type == T_TRIANGLE)
+    {
+	tri = (TRIANGLE *) ref->obj->obj;
+	for (i = 0; i < 3; i++)
+	    corner[i] = tri->mesh->verts[tri->v[i]];
+	points = corner;
+	n = 3;
+    }
+
+    if (points != NULL)
+    {
+	Empty_box(&left->b_min, &left->b_max);
+	Empty_box(&right->b_min, &right->b_max);
+
+	for (i = 0; i < n; i++)
+	{
+	    vi = &points[i];
+	    vj = &points[i + 1 == n ? 0 : i + 1];
+	    a = AXIS(*vi, ax);
+	    b = AXIS(*vj, ax);
+
+	    if (a <= pos)
+		Grow_box(&left->b_min, &left->b_max, vi, vi);
+	    if (a >= pos)
+		Grow_box(&right->b_min, &right->b_max, vi, vi);
+
+	    if ((a < pos && b > pos) || (a > pos && b < pos))
+	    {
+		t = (pos - a) / (b - a);
+		ip.x = vi->x + t * (vj->x - vi->x);
+		ip.y = vi->y + t * (vj->y - vi->y);
+		ip.z = vi->z + t * (vj->z - vi->z);
+		AXIS(ip, ax) = pos;
+
+		Grow_box(&left->b_min, &left->b_max, &ip, &ip);
+		Grow_box(&right->b_min, &right->b_max, &ip, &ip);
+	    }
+	}
+
+	Clip_box(&left->b_min, &left->b_max, &ref->b_min, &ref->b_max);
+	Clip_box(&right->b_min, &right->b_max, &ref->b_min, &ref->b_max);
+    }
+
+    AXIS(left->b_max, ax) = MIN(AXIS(left->b_max, ax), pos);
+    AXIS(right->b_min, ax) = MAX(AXIS(right->b_min, ax), pos);
+}
+
+/*
+ * Empty_ref()
+ *
+ * Return 1 if the reference's box is empty.
+ */
+
+static int Empty_ref(SREF *ref)
+{
+    return (ref->b_min.x > ref->b_max.x || ref->b_min.y > ref->b_max.y ||
+	    ref->b_min.z > ref->b_max.z);
+}
+
+/*
+ * Compcentroids()
+ *
+ * Compare the centroids of the given references on the current axis.
+ */
+
+static int Compcentroids(const void *p1, const void *p2)
+{
+    SREF           *a = (SREF *) p1;
+    SREF           *b = (SREF *) p2;
+    double          am, bm;
+
+    am = AXIS(a->b_min, axis) + AXIS(a->b_max, axis);
+    bm = AXIS(b->b_min, axis) + AXIS(b->b_max, axis);
+
+    if (am < bm)
+	return (-1);
+    else if (am == bm)
+	return (0);
+    else
+	return (1);
+}
+
+/*
+ * Object_split()
+ *
+ * Find the cheapest way to partition the references along any axis by a
+ * sweep over the references sorted by centroid.
+ */
+
+static void Object_split(SREF *refs, int n, SPLIT *best)
+{
+    VECTOR          mn, mx;
+    double         *r_area, cost;
+    int             i;
+
+    if ((r_area = (double *) malloc(sizeof(double) * n)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    best->cost = HUGE;
+    best->spatial = 0;
+
+    for (axis = 0; axis < 3; axis++)
+    {
+	qsort((char *) refs, n, sizeof(SREF), Compcentroids);
+
+	Empty_box(&mn, &mx);
+	for (i = n - 1; i > 0; i--)
+	{
+	    Grow_box(&mn, &mx, &refs[i].b_min, &refs[i].b_max);
+	    r_area[i] = Box_area(&mn, &mx);
+	}
+
+	Empty_box(&mn, &mx);
+	for (i = 1; i < n; i++)
+	{
+	    Grow_box(&mn, &mx, &refs[i - 1].b_min, &refs[i - 1].b_max);
+	    cost = Box_area(&mn, &mx) * i + r_area[i] * (n - i);
+
+	    if (cost < best->cost)
+	    {
+		best->cost = cost;
+		best->axis = axis;
+		best->index = i;
+	    }
+	}
+    }
+
+    free(r_area);
+}
+
+/*
+ * Spatial_split()
+ *
+ * Chop every reference into the bins along each axis of the node box, and
+ * find the cheapest bin boundary to split the node at.
+ */
+
+static void Spatial_split(SREF *refs, int n, VECTOR *n_min, VECTOR *n_max,
+			  SPLIT *best)
+{
+    SBIN            bins[SPLIT_BINS];
+    SREF            cur, left, right;
+    VECTOR          mn, mx;
+    double          r_area[SPLIT_BINS], lo, width, cost;
+    int             r_cnt[SPLIT_BINS], first, last, nl, i, j;
+
+    best->cost = HUGE;
+    best->spatial = 1;
+
+    for (axis = 0; axis < 3; axis++)
+    {
+	lo = AXIS(*n_min, axis);
+	width = (AXIS(*n_max, axis) - lo) / SPLIT_BINS;
+	if (width <= MIN_T)
+	    continue;
+
+	for (i = 0; i < SPLIT_BINS; i++)
+	{
+	    Empty_box(&bins[i].b_min, &bins[i].b_max);
+	    bins[i].enter = bins[i].exit = 0;
+	}
+
+	for (j = 0; j < n; j++)
+	{
+	    first = (int) ((AXIS(refs[j].b_min, axis) - lo) / width);
+	    last = (int) ((AXIS(refs[j].b_max, axis) - lo) / width);
+	    first = MAX(0, MIN(first, SPLIT_BINS - 1));
+	    last = MAX(first, MIN(last, SPLIT_BINS - 1));
+
+	    cur = refs[j];
+	    for (i = first; i < last; i++)
+	    {
+		Split_ref(&cur, axis, lo + width * (i + 1), &left, &right);
+		Grow_box(&bins[i].b_min, &bins[i].b_max,
+			 &left.b_min, &left.b_max);
+		cur = right;
+	    }
+	    Grow_box(&bins[last].b_min, &bins[last].b_max,
+		     &cur.b_min, &cur.b_max);
+
+	    bins[first].enter++;
+	    bins[last].exit++;
+	}
+
+	Empty_box(&mn, &mx);
+	r_cnt[0] = 0;
+	for (i = SPLIT_BINS - 1; i > 0; i--)
+	{
+	    Grow_box(&mn, &mx, &bins[i].b_min, &bins[i].b_max);
+	    r_area[i] = Box_area(&mn, &mx);
+	    r_cnt[i] = bins[i].exit + (i < SPLIT_BINS - 1 ? r_cnt[i + 1] : 0);
+	}
+
+	Empty_box(&mn, &mx);
+	nl = 0;
+	for (i = 1; i < SPLIT_BINS; i++)
+	{
+	    Grow_box(&mn, &mx, &bins[i - 1].b_min, &bins[i - 1].b_max);
+	    nl += bins[i - 1].enter;
+
+	    if (nl == 0 || r_cnt[i] == 0)
+		continue;
+
+	    cost = Box_area(&mn, &mx) * nl + r_area[i] * r_cnt[i];
+	    if (cost < best->cost)
+	    {
+		best->cost = cost;
+		best->axis = axis;
+		best->pos = lo + width * i;
+	    }
+	}
+    }
+}
+
+/*
+ * Partition()
+ *
+ * Split the references into two new lists using the given split. Returns 0
+ * if the split did not separate anything.
+ */
+
+static int Partition(SREF *refs, int n, SPLIT *s, SREF **lp, int *nlp,
+		     SREF **rp, int *nrp)
+{
+    SREF           *l, *r, lref, rref;
+    VECTOR          l_min, l_max, r_min, r_max, mn, mx;
+    double          c_split, c_left, c_right;
+    int             nl, nr, i, ax;
+
+    if ((l = (SREF *) malloc(sizeof(SREF) * n)) == NULL ||
+	(r = (SREF *) malloc(sizeof(SREF) * n)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    nl = nr = 0;
+
+    if (!s->spatial)
+    {
+	axis = s->axis;
+	qsort((char *) refs, n, sizeof(SREF), Compcentroids);
+
+	for (i = 0; i < s->index; i++)
+	    l[nl++] = refs[i];
+	for (; i < n; i++)
+	    r[nr++] = refs[i];
+    }
+    else
+    {
+	ax = s->axis;
+
+	/*
+	 * First put everything which is entirely on one side in place,
+	 * so that the boxes of both sides are known when deciding what
+	 * to do with the straddlers.
+	 */
+
+	Empty_box(&l_min, &l_max);
+	Empty_box(&r_min, &r_max);
+
+	for (i = 0; i < n; i++)
+	{
+	    if (AXIS(refs[i].b_max, ax) <= s->pos)
+	    {
+		l[nl++] = refs[i];
+		Grow_box(&l_min, &l_max, &refs[i].b_min, &refs[i].b_max);
+	    }
+	    else if (AXIS(refs[i].b_min, ax) >= s->pos)
+	    {
+		r[nr++] = refs[i];
+		Grow_box(&r_min, &r_max, &refs[i].b_min, &refs[i].b_max);
+	    }
+	}
+
+	for (i = 0; i < n; i++)
+	{
+	    if (AXIS(refs[i].b_max, ax) <= s->pos ||
+		AXIS(refs[i].b_min, ax) >= s->pos)
+		continue;
+
+	    Split_ref(&refs[i], ax, s->pos, &lref, &rref);
+
+	    if (Empty_ref(&rref))
+	    {
+		l[nl++] = lref;
+		Grow_box(&l_min, &l_max, &lref.b_min, &lref.b_max);
+		continue;
+	    }
+
+	    if (Empty_ref(&lref))
+	    {
+		r[nr++] = rref;
+		Grow_box(&r_min, &r_max, &rref.b_min, &rref.b_max);
+		continue;
+	    }
+
+	    /*
+	     * See if it is cheaper to leave the whole reference on
+	     * one side than to duplicate it. Duplicating is also out
+	     * if we have used up the reference budget.
+	     */
+
+	    c_split = Box_area(&l_min, &l_max) * (nl + 1) +
+		Box_area(&r_min, &r_max) * (nr + 1);
+
+	    mn = l_min, mx = l_max;
+	    Grow_box(&mn, &mx, &refs[i].b_min, &refs[i].b_max);
+	    c_left = Box_area(&mn, &mx) * (nl + 1) +
+		Box_area(&r_min, &r_max) * nr;
+
+	    mn = r_min, mx = r_max;
+	    Grow_box(&mn, &mx, &refs[i].b_min, &refs[i].b_max);
+	    c_right = Box_area(&l_min, &l_max) * nl +
+		Box_area(&mn, &mx) * (nr + 1);
+
+	    if (nrefs >= max_refs)
+		c_split = HUGE;
+
+	    if (c_split < c_left && c_split < c_right)
+	    {
+		l[nl++] = lref;
+		r[nr++] = rref;
+		Grow_box(&l_min, &l_max, &lref.b_min, &lref.b_max);
+		Grow_box(&r_min, &r_max, &rref.b_min, &rref.b_max);
+		++nrefs;
+	    }
+	    else if (c_left <= c_right)
+	    {
+		l[nl++] = refs[i];
+		Grow_box(&l_min, &l_max, &refs[i].b_min, &refs[i].b_max);
+	    }
+	    else
+	    {
+		r[nr++] = refs[i];
+		Grow_box(&r_min, &r_max, &refs[i].b_min, &refs[i].b_max);
+	    }
+	}
+
+	if (nl == 0 || nr == 0 || nl == n || nr == n)
+	{
+	    nrefs -= nl + nr - n;
+	    free(l);
+	    free(r);
+	    return (0);
+	}
+
+	++n_spatial;
+    }
+
+    *lp = l;
+    *nlp = nl;
+    *rp = r;
+    *nrp = nr;
+    return (1);
+}
+
+/*
+ * Split_refs()
+ *
+ * Split the given references in two, using a spatial split if it is cheaper
+ * than the best object partition and the budget allows it.
+ */
+
+static void Split_refs(SREF *refs, int n, int depth, SREF **lp, int *nlp,
+		       SREF **rp, int *nrp)
+{
+    SPLIT           obj_split, sp_split;
+    VECTOR          n_min, n_max, l_min, l_max, r_min, r_max;
+    int             i;
+
+    Object_split(refs, n, &obj_split);
+
+    /*
+     * Only look for a spatial split if the children of the object split
+     * overlap by a noticeable amount.
+     */
+
+    if (depth < SPLIT_DEPTH && nrefs < max_refs)
+    {
+	axis = obj_split.axis;
+	qsort((char *) refs, n, sizeof(SREF), Compcentroids);
+
+	Empty_box(&n_min, &n_max);
+	Empty_box(&l_min, &l_max);
+	Empty_box(&r_min, &r_max);
+
+	for (i = 0; i < n; i++)
+	{
+	    Grow_box(&n_min, &n_max, &refs[i].b_min, &refs[i].b_max);
+	    if (i < obj_split.index)
+		Grow_box(&l_min, &l_max, &refs[i].b_min, &refs[i].b_max);
+	    else
+		Grow_box(&r_min, &r_max, &refs[i].b_min, &refs[i].b_max);
+	}
+
+	Clip_box(&l_min, &l_max, &r_min, &r_max);
+
+	if (Box_area(&l_min, &l_max) > SPLIT_ALPHA * root_area)
+	{
+	    Spatial_split(refs, n, &n_min, &n_max, &sp_split);
+
+	    if (sp_split.cost < obj_split.cost &&
+		Partition(refs, n, &sp_split, lp, nlp, rp, nrp))
+		return;
+	}
+    }
+
+    Partition(refs, n, &obj_split, lp, nlp, rp, nrp);
+}
+
+/*
+ * Sbvh_node()
+ *
+ * Build the subtree for the given references and return its root. A node
+ * with more than leaf_size references is split in two, and then the half
+ * with the biggest box is split again until there are branch_factor
+ * children. Nodes are added to the object list after their children.
+ */
+
+static OBJECT *Sbvh_node(SREF *refs, int n, int depth)
+{
+    SREF           *group[MAX_GROUP], *l, *r;
+    OBJECT         *child[MAX_GROUP], *cp;
+    VECTOR          mn, mx, g_min, g_max;
+    double          area, a;
+    int             count[MAX_GROUP], owned[MAX_GROUP];
+    int             ngroups, nc, nl, nr, i, j, k;
+
+    Empty_box(&mn, &mx);
+    for (i = 0; i < n; i++)
+	Grow_box(&mn, &mx, &refs[i].b_min, &refs[i].b_max);
+
+    group[0] = refs;
+    count[0] = n;
+    owned[0] = 0;
+    ngroups = 1;
+
+    if (n > leaf_size)
+    {
+	while (ngroups < branch_factor)
+	{
+	    /* split the group with the biggest box */
+
+	    k = -1;
+	    area = -1;
+	    for (i = 0; i < ngroups; i++)
+	    {
+		if (count[i] < 2)
+		    continue;
+
+		Empty_box(&g_min, &g_max);
+		for (j = 0; j < count[i]; j++)
+		    Grow_box(&g_min, &g_max,
+			     &group[i][j].b_min, &group[i][j].b_max);
+
+		if ((a = Box_area(&g_min, &g_max)) > area)
+		{
+		    area = a;
+		    k = i;
+		}
+	    }
+
+	    if (k < 0)
+		break;
+
+	    Split_refs(group[k], count[k], depth, &l, &nl, &r, &nr);
+
+	    if (owned[k])
+		free(group[k]);
+
+	    group[k] = l;
+	    count[k] = nl;
+	    owned[k] = 1;
+
+	    group[ngroups] = r;
+	    count[ngroups] = nr;
+	    owned[ngroups] = 1;
+	    ++ngroups;
+	}
+    }
+    else
+    {
+	/* a leaf, every reference becomes a child */
+
+	for (i = 1; i < n; i++)
+	{
+	    group[i] = refs + i;
+	    count[i] = 1;
+	    owned[i] = 0;
+	}
+	count[0] = MIN(n, 1);
+	ngroups = n;
+    }
+
+    /*
+     * Turn the groups into children. Pieces of the same object only go
+     * in once.
+     */
+
+    nc = 0;
+    for (i = 0; i < ngroups; i++)
+    {
+	if (count[i] == 1)
+	{
+	    for (j = 0; j < nc; j++)
+		if (child[j] == group[i][0].obj)
+		    break;
+	    if (j == nc)
+		child[nc++] = group[i][0].obj;
+	}
+	else
+	{
+	    child[nc++] = Sbvh_node(group[i], count[i], depth + 1);
+	}
+
+	if (owned[i])
+	    free(group[i]);
+    }
+
+    cp = Make_composite(child, nc);
+
+    /* the clipped references may give a tighter box than the children */
+    Clip_box(&cp->b_min, &cp->b_max, &mn, &mx);
+
+    return (cp);
+}
+
+/*
+ * Build_sbvh()
+ *
+ * Build the hierarchy over all of the objects with the spatial split builder.
+ * The number of references may grow by at most 'sbvh_budget' times the
+ * number of objects.
+ */
+
+void Build_sbvh()
+{
+    SREF           *refs;
+    VECTOR          mn, mx;
+    int             n, i;
+
+    n = nobjects;
+
+    if ((refs = (SREF *) malloc(sizeof(SREF) * n)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    Empty_box(&mn, &mx);
+    for (i = 0; i < n; i++)
+    {
+	refs[i].obj = objects[i];
+	refs[i].b_min = objects[i]->b_min;
+	refs[i].b_max = objects[i]->b_max;
+	Grow_box(&mn, &mx, &refs[i].b_min, &refs[i].b_max);
+
+	objects[i]->active = 0;
+    }
+
+    root_area = Box_area(&mn, &mx);
+    nrefs = n;
+    max_refs = n + (int) (sbvh_budget * n);
+    n_spatial = 0;
+
+    root = Sbvh_node(refs, n, 0);
+    free(refs);
+
+    /*
+     * Objects which got split can be reached through several leaves, so
+     * Intersect() has to make sure it only tests them once per ray.
+     */
+
+    mailbox = (nrefs > n);
+
+    if (verbose)
+    {
+	fprintf(stderr, "%s: %d spatial splits, %d references to %d objects\n",
+		my_name, n_spatial, nrefs, n);
+    }
+}
@@ -62,47 +62,99 @@ int Refract(double n1, double  n2, VECTOR  *i, VECTOR  *n, VECTOR  *r)
 
 
 /*
- * Illuminate()
+ * Surface_at()
  * 
- * Apply the proper illumination model to determine the color of the object at
- * the given point.
+ * Find the surface normal at the given point of an intersection, and return
+ * the surface to shade it with.
  */
 
-COLOR 
-Illuminate(INTERSECT *inter, RAY *ray, VECTOR *ip, int n)
+SURFACE        *
+Surface_at(INTERSECT *inter, RAY *ray, VECTOR *ip, VECTOR *normal)
 {
-    COLOR           col, c;
-    OBJECT         *obj, *scache;
+    OBJECT         *obj;
     SURFACE        *surf;
-    VECTOR          normal, l_dir;
-    INTERSECT       test_inter;
-    RAY             ray2;
-    double          l_dist, incident, spec;
-    double          n1, n2, intensity;
-    int                l;
+
+    obj = inter->obj;
+    surf = obj->surf;
 
     /*
-     * If the maximum level of recusion has been reached, then return
-     * peacefully.
+     * If the object was hit in a placement of an instance, its normal
+     * has to be found where the object really is, in the space of the
+     * instance definition. Objects without a surface of their own take
+     * the placement's.
      */
 
-    if (n >= MAX_LEVEL)
+    if (inter->inst != NULL)
     {
-	col.r = col.g = col.b = 0;
-	return (col);
+	Placement_normal((PLACEMENT *) inter->inst->obj, obj, ray, ip, normal);
+
+	if (surf == NULL)
+	    surf = inter->inst->surf;
+    }
+    else
+    {
+	/* get the surface normal */
+	(*obj->normal) (obj->obj, ray, ip, normal);
     }
 
-    obj = inter->obj;
-    surf = obj->surf;
+    return (surf);
+}
 
-    /* get the surface normal */
-    (*obj->normal) (obj->obj, ray, ip, &normal);
+
+/*
+ * Self_first()
+ *
+ * TRUE if the shadow ray would hit the object it leaves before the hit
+ * found on the cached object. Intersect() would then find the object
+ * itself, which casts no shadow, so the cached hit can't be taken. The
+ * cache only saves work; what it holds, which depends on the order the
+ * points are shaded in, must not change the picture.
+ */
+
+static int Self_first(INTERSECT *inter, RAY *ray, INTERSECT *cached)
+{
+    OBJECT         *obj;
+    INTERSECT       self;
+
+    /* a primitive of a placement is only tested through the placement */
+    obj = (inter->inst != NULL) ? inter->inst : inter->obj;
+
+    self.inst = NULL;
+    if (!(*obj->inter) (obj, ray, &self))
+	return (0);
+
+    return (self.obj == inter->obj && self.inst == inter->inst &&
+	    CLOSER(&self, cached));
+}
+
+/*
+ * Direct_light()
+ * 
+ * Calculate the ambient, diffuse and specular color at the given point, from
+ * the light sources which aren't shadowed. 'n' is the level of recursion of
+ * the ray.
+ */
+
+COLOR 
+Direct_light(INTERSECT *inter, RAY *ray, VECTOR *ip, VECTOR *normal,
+	     SURFACE *surf, int n)
+{
+    COLOR           col;
+    OBJECT         *scache;
+    VECTOR          l_dir;
+    INTERSECT       test_inter;
+    RAY             ray2;
+    double          l_dist, incident, spec;
+    double          intensity;
+    LIGHT_WALK      lw;
+    int                l;
 
     /* first set the color to ambient color */
     col = surf->c_ambient;
 
-    /* foreach light source */
-    for (l = 0; l < nlights; l++)
+    /* foreach light source which can reach this point */
+    Start_lights(&lw, ip);
+    while ((l = Next_light(&lw)) >= 0)
     {
 	/*
 	 * get the vector from the light source to the intersection
@@ -111,12 +163,14 @@ Illuminate(INTERSECT *inter, RAY *ray, VECTOR *ip, int n)
 	VecSub(lights[l]->pos, *ip, l_dir);
 
 	intensity = lights[l]->intensity;
+	if (lights[l]->falloff)
+	    intensity /= VecDot(l_dir, l_dir);
 
 	/*
 	 * Calculate the angle of incident.
 	 */
 
-	if (VecDot(normal, l_dir) >= 0)
+	if (VecDot(*normal, l_dir) >= 0)
 	{
 	    /*
 	     * Test to see if any object is casting a shadow on
@@ -137,27 +191,40 @@ Illuminate(INTERSECT *inter, RAY *ray, VECTOR *ip, int n)
 		/*
 		 * If we do have a shadow cache entry for
 		 * this light at this level, try that first.
-		 * If it hits, then a shadow is casted. If it
+		 * If it hits, then a shadow is casted, unless
+		 * this object is in the way first. If it
 		 * doesn't hit, then try all of the other
 		 * primitives.
 		 */
 
 		if ((scache = lights[l]->cache[n]) != NULL)
 		{
+		    test_inter.inst = NULL;
 		    if ((*scache->inter) (scache, &ray2, &test_inter) &&
-			inter->obj != test_inter.obj &&
-			test_inter.t < l_dist - MIN_T)
+			(inter->obj != test_inter.obj ||
+			 inter->inst != test_inter.inst) &&
+			test_inter.t < l_dist - MIN_T &&
+			!Self_first(inter, &ray2, &test_inter))
 		    {
 			++n_shadinter;
 			continue;
 		    }
 		}
 
+		/*
+		 * A primitive inside of a placement can only be
+		 * tested through the placement, so cache that.
+		 */
+
 		if (Intersect(&ray2, &test_inter) &&
-		    inter->obj != test_inter.obj &&
+		    (inter->obj != test_inter.obj ||
+		     inter->inst != test_inter.inst) &&
 		    test_inter.t < l_dist - MIN_T)
 		{
-		    lights[l]->cache[n] = test_inter.obj;
+		    if (test_inter.inst != NULL)
+			lights[l]->cache[n] = test_inter.inst;
+		    else
+			lights[l]->cache[n] = test_inter.obj;
 		    ++n_shadinter;
 		    continue;
 		}
@@ -167,7 +234,7 @@ Illuminate(INTERSECT *inter, RAY *ray, VECTOR *ip, int n)
 		}
 	    }
 
-	    incident = VecDot(normal, l_dir);
+	    incident = VecDot(*normal, l_dir);
 	    /* calculate the diffuse color */
 	    col.r += incident * surf->c_diffuse.r * intensity;
 	    col.g += incident * surf->c_diffuse.g * intensity;
@@ -181,7 +248,7 @@ Illuminate(INTERSECT *inter, RAY *ray, VECTOR *ip, int n)
 
 	    if (surf->spec_width != 0.0)
 	    {
-		Reflect(&ray->dir, &normal, &ray2.dir);
+		Reflect(&ray->dir, normal, &ray2.dir);
 		spec = pow(VecDot(l_dir, ray2.dir), surf->spec_width);
 
 		col.r += spec * surf->c_specular.r * intensity;
@@ -191,6 +258,27 @@ Illuminate(INTERSECT *inter, RAY *ray, VECTOR *ip, int n)
 	}
     }
 
+    return (col);
+}
+
+
+/*
+ * Secondary_rays()
+ * 
+ * Set up the reflected and refracted rays to send out from the given point,
+ * if there are any, and return how many there are. Each one adds 'share'
+ * times 'tint' of its color to the point's.
+ */
+
+int 
+Secondary_rays(INTERSECT *inter, RAY *ray, VECTOR *ip, VECTOR *normal,
+	       SURFACE *surf, RAY *out, double *share, COLOR *tint)
+{
+    double          n1, n2;
+    int             k;
+
+    k = 0;
+
     /*
      * If reflections are enabled, calculat the reflection color.
      */
@@ -198,17 +286,11 @@ Illuminate(INTERSECT *inter, RAY *ray, VECTOR *ip, int n)
     if (reflect && surf->p_reflect != 0.0)
     {
 	++n_reflect;
-	ray2.pos = *ip;
-	Reflect(&ray->dir, &normal, &ray2.dir);
-
-	/*
-	 * Send out reflection ray.
-	 */
-
-	c = Trace_a_ray(&ray2, n + 1);
-	col.r += c.r * surf->p_reflect * surf->c_reflect.r;
-	col.g += c.g * surf->p_reflect * surf->c_reflect.g;
-	col.b += c.b * surf->p_reflect * surf->c_reflect.b;
+	out[k].pos = *ip;
+	Reflect(&ray->dir, normal, &out[k].dir);
+	share[k] = surf->p_reflect;
+	tint[k] = surf->c_reflect;
+	++k;
     }
 
     /*
@@ -234,19 +316,65 @@ Illuminate(INTERSECT *inter, RAY *ray, VECTOR *ip, int n)
 	    n2 = surf->i_refraction;
 	}
 
-	ray2.pos = *ip;
-	if (Refract(n1, n2, &ray->dir, &normal, &ray2.dir))
+	out[k].pos = *ip;
+	if (Refract(n1, n2, &ray->dir, normal, &out[k].dir))
 	{
 	    ++n_refract;
-	    c = Trace_a_ray(&ray2, n + 1);
-
-	    col.r += c.r * surf->p_refract * surf->c_refract.r;
-	    col.g += c.g * surf->p_refract * surf->c_refract.g;
-	    col.b += c.b * surf->p_refract * surf->c_refract.b;
+	    share[k] = surf->p_refract;
+	    tint[k] = surf->c_refract;
+	    ++k;
 	}
     }
 
+    return (k);
+}
+
+
+/*
+ * Illuminate()
+ * 
+ * Apply the proper illumination model to determine the color of the object at
+ * the given point.
+ */
+
+COLOR 
+Illuminate(INTERSECT *inter, RAY *ray, VECTOR *ip, int n)
+{
+    COLOR           col, c, tint[2];
+    SURFACE        *surf;
+    VECTOR          normal;
+    RAY             ray2[2];
+    double          share[2];
+    int             i, k;
+
+    /*
+     * If the maximum level of recusion has been reached, then return
+     * peacefully.
+     */
+
+    if (n >= MAX_LEVEL)
+    {
+	col.r = col.g = col.b = 0;
+	return (col);
+    }
+
+    surf = Surface_at(inter, ray, ip, &normal);
+    col = Direct_light(inter, ray, ip, &normal, surf, n);
+
+    /*
+     * Send out the reflection and refraction rays.
+     */
+
+    k = Secondary_rays(inter, ray, ip, &normal, surf, ray2, share, tint);
+
+    for (i = 0; i < k; i++)
+    {
+	c = Trace_a_ray(&ray2[i], n + 1);
+	col.r += c.r * share[i] * tint[i].r;
+	col.g += c.g * share[i] * tint[i].g;
+	col.b += c.b * share[i] * tint[i].b;
+    }
+
     /* return that color */
     return (col);
 }
-
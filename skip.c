@@ -0,0 +1,486 @@
+/*
+ * skip.c
+ *
+ * This module keeps a copy of the bounding box hierarchy which can be traced
+ * without a stack. Composites and objects are laid out in one array. A
+ * composite links to its first child, and every entry has a skip link to
+ * the entry which comes after its subtree in depth first order. A ray which
+ * hits a composite's box goes on to its first child, and one which misses a
+ * box, or is done with an object, follows the skip link. The trace is over
+ * when a skip link leads out of the subtree it started on.
+ *
+ * The entries are in depth first order, so that a trace mostly moves
+ * forward through memory, or in van Emde Boas order when that is asked for.
+ *
+ * The hierarchies of instance definitions are put in the same array, after
+ * the scene's, each one once however many placements it has.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rt.h"
+#include "externs.h"
+#include "kernels.h"
+
+/*
+ * One entry of the array. The box is rounded outward to floats, so it
+ * always holds the real one.
+ */
+
+typedef struct skip_node
+{
+	float           b_min[3];	/* bounding box			 */
+	float           b_max[3];
+	int             skip;	/* entry after this subtree, or -1 */
+	int             child;	/* first child of a composite	 */
+	OBJECT         *obj;	/* object, or NULL for a composite */
+}               SKIP_NODE;
+
+static SKIP_NODE *snodes = NULL;
+static int      nsnodes, max_snodes;
+static OBJECT **strees = NULL;	/* instance hierarchies laid out */
+static int     *sfirst = NULL;	/* and the entries they start at */
+static int      nstrees;
+
+/*
+ * Round_down(), Round_up()
+ *
+ * Return the float at or below, or at or above, the given value.
+ */
+
+static float Round_down(double v)
+{
+    float           f;
+
+    f = (float) v;
+    if ((double) f > v)
+	f = nextafterf(f, -HUGE_VALF);
+    return (f);
+}
+
+static float Round_up(double v)
+{
+    float           f;
+
+    f = (float) v;
+    if ((double) f < v)
+	f = nextafterf(f, HUGE_VALF);
+    return (f);
+}
+
+/*
+ * Count_entries()
+ *
+ * Count the entries of the subtree under the given object.
+ */
+
+static int Count_entries(OBJECT *obj)
+{
+    COMPOSITE      *cd;
+    int             i, n;
+
+    if (!IS_NODE(obj))
+	return (1);
+
+    cd = (COMPOSITE *) obj->obj;
+    n = 1;
+    for (i = 0; i < cd->num; i++)
+	n += Count_entries(cd->child[i]);
+
+    return (n);
+}
+
+/*
+ * Lay_out()
+ *
+ * Add the given object and everything under it to the array, in depth first
+ * order.
+ */
+
+static void Lay_out(OBJECT *obj)
+{
+    SKIP_NODE      *sn;
+    COMPOSITE      *cd;
+    int             i, n;
+
+    n = nsnodes++;
+    sn = &snodes[n];
+
+    sn->b_min[0] = Round_down(obj->b_min.x);
+    sn->b_min[1] = Round_down(obj->b_min.y);
+    sn->b_min[2] = Round_down(obj->b_min.z);
+    sn->b_max[0] = Round_up(obj->b_max.x);
+    sn->b_max[1] = Round_up(obj->b_max.y);
+    sn->b_max[2] = Round_up(obj->b_max.z);
+
+    if (IS_NODE(obj))
+    {
+	sn->obj = NULL;
+	sn->child = nsnodes;
+
+	cd = (COMPOSITE *) obj->obj;
+	for (i = 0; i < cd->num; i++)
+	    Lay_out(cd->child[i]);
+    }
+    else
+    {
+	sn->obj = obj;
+	sn->child = -1;
+    }
+
+    /* the array may have moved while the children were added */
+    snodes[n].skip = nsnodes;
+}
+
+/*
+ * Skip_children()
+ *
+ * Fill in the children of an entry of a hierarchy which is still in depth
+ * first order, and return their number.
+ */
+
+static int Skip_children(int node, int *child)
+{
+    int             c, n;
+
+    n = 0;
+    if (snodes[node].obj != NULL)
+	return (0);
+
+    for (c = snodes[node].child; c < snodes[node].skip; c = snodes[c].skip)
+	child[n++] = c;
+
+    return (n);
+}
+
+/*
+ * Reorder()
+ *
+ * Put the entries of the hierarchy from 'first' up to 'end' into van Emde
+ * Boas order, and move the links along with them.
+ */
+
+static void Reorder(int first, int end)
+{
+    SKIP_NODE      *sn;
+    int            *order, *perm;
+    int             i, n;
+
+    n = end - first;
+
+    if ((order = (int *) malloc(sizeof(int) * n)) == NULL ||
+	(perm = (int *) malloc(sizeof(int) * n)) == NULL ||
+	(sn = (SKIP_NODE *) malloc(sizeof(SKIP_NODE) * n)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    if (Veb_order(first, Skip_children, order) != n)
+    {
+	fprintf(stderr, "%s: internal error 04.\n", my_name);
+	exit(1);
+    }
+
+    for (i = 0; i < n; i++)
+	perm[order[i] - first] = first + i;
+
+    for (i = 0; i < n; i++)
+    {
+	sn[i] = snodes[order[i]];
+
+	if (sn[i].skip != end)
+	    sn[i].skip = perm[sn[i].skip - first];
+	if (sn[i].obj == NULL)
+	    sn[i].child = perm[sn[i].child - first];
+    }
+
+    memcpy(snodes + first, sn, sizeof(SKIP_NODE) * n);
+
+    free(sn);
+    free(perm);
+    free(order);
+}
+
+/*
+ * Lay_out_tree()
+ *
+ * Add a hierarchy to the end of the array, growing it as needed, and return
+ * the entry it starts at.
+ */
+
+static int Lay_out_tree(OBJECT *tree)
+{
+    int             n, end, i;
+
+    n = nsnodes + Count_entries(tree);
+    if (n > max_snodes)
+    {
+	max_snodes = n;
+	snodes = (SKIP_NODE *) realloc(snodes, sizeof(SKIP_NODE) * max_snodes);
+	if (snodes == NULL)
+	{
+	    fprintf(stderr, "%s: malloc failed\n", my_name);
+	    exit(1);
+	}
+    }
+
+    n = nsnodes;
+    Lay_out(tree);
+    end = nsnodes;
+
+    if (bvh_layout == LAYOUT_VEB)
+	Reorder(n, end);
+
+    /* links past the end of the hierarchy end the trace */
+    for (i = n; i < end; i++)
+	if (snodes[i].skip == end)
+	    snodes[i].skip = -1;
+
+    return (n);
+}
+
+/*
+ * Build_skip_tree()
+ *
+ * Build the stackless copy of the hierarchy under the root, and of every
+ * instance hierarchy placed in the scene. This has to be done again whenever
+ * the hierarchy changes.
+ */
+
+void Build_skip_tree()
+{
+    PLACEMENT      *pl;
+    int             i, j;
+
+    nsnodes = 0;
+    max_snodes = 0;
+    free(snodes);
+    snodes = NULL;
+
+    nstrees = 0;
+    free(strees);
+    free(sfirst);
+    if ((strees = (OBJECT **) malloc(sizeof(OBJECT *) *
+				     (num_instance + 1))) == NULL ||
+	(sfirst = (int *) malloc(sizeof(int) * (num_instance + 1))) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    Lay_out_tree(root);
+
+    /*
+     * Placements of the same definition share its entries. The ones
+     * which were laid out are remembered by their roots.
+     */
+
+    for (i = 0; i < nobjects; i++)
+    {
+	if (objects[i]->type != T_INSTANCE)
+	    continue;
+
+	pl = (PLACEMENT *) objects[i]->obj;
+
+	for (j = 0; j < nstrees; j++)
+	    if (strees[j] == pl->tree)
+		break;
+
+	if (j == nstrees)
+	{
+	    strees[j] = pl->tree;
+	    sfirst[j] = Lay_out_tree(pl->tree);
+	    ++nstrees;
+	}
+
+	pl->first = sfirst[j];
+    }
+
+    if (verbose)
+    {
+	fprintf(stderr, "%s: stackless hierarchy: %d entries of %d bytes, "
+		"%ld Kbytes, %d instance hierarchies\n", my_name, nsnodes,
+		(int) sizeof(SKIP_NODE), Skip_memory() / 1024, nstrees);
+    }
+}
+
+/*
+ * Skip_memory()
+ *
+ * Return the number of bytes taken by the stackless hierarchy.
+ */
+
+long Skip_memory()
+{
+    return ((long) nsnodes * sizeof(SKIP_NODE));
+}
+
+/*
+ * Intersect_skip()
+ *
+ * Trace the ray through the subtree which starts at the given entry, the
+ * same way Intersect_tree() traces it through the object tree. If 'stamp' is
+ * not zero, objects are stamped with it so that each one is only tested
+ * once.
+ */
+
+int Intersect_skip(int first, RAY *ray, INTERSECT *inter, int stamp)
+{
+    SKIP_NODE      *sn;
+    OBJECT         *obj;
+    INTERSECT       minter;
+    int             i, iflag;
+    int             par_x, par_y, par_z;
+    double          inv_x = 0, inv_y = 0, inv_z = 0;
+    double          t_near, t_far, t1, t2;
+
+    /*
+     * Rays parallel to a slab are tested against the origin, as in
+     * Check_and_push(). The others get their inverse direction once.
+     */
+
+    par_x = fabs(ray->dir.x) < MIN_T;
+    par_y = fabs(ray->dir.y) < MIN_T;
+    par_z = fabs(ray->dir.z) < MIN_T;
+
+    if (!par_x)
+	inv_x = 1.0 / ray->dir.x;
+    if (!par_y)
+	inv_y = 1.0 / ray->dir.y;
+    if (!par_z)
+	inv_z = 1.0 / ray->dir.z;
+
+    iflag = 0;
+
+    for (i = first; i >= 0;)
+    {
+	sn = &snodes[i];
+
+	t_near = -HUGE;
+	t_far = HUGE;
+
+	if (par_x)
+	{
+	    if (ray->pos.x < sn->b_min[0] || ray->pos.x > sn->b_max[0])
+	    {
+		i = sn->skip;
+		continue;
+	    }
+	}
+	else
+	{
+	    t1 = (sn->b_min[0] - ray->pos.x) * inv_x;
+	    t2 = (sn->b_max[0] - ray->pos.x) * inv_x;
+	    t_near = MIN(t1, t2);
+	    t_far = MAX(t1, t2);
+	}
+
+	if (par_y)
+	{
+	    if (ray->pos.y < sn->b_min[1] || ray->pos.y > sn->b_max[1])
+	    {
+		i = sn->skip;
+		continue;
+	    }
+	}
+	else
+	{
+	    t1 = (sn->b_min[1] - ray->pos.y) * inv_y;
+	    t2 = (sn->b_max[1] - ray->pos.y) * inv_y;
+	    t_near = MAX(t_near, MIN(t1, t2));
+	    t_far = MIN(t_far, MAX(t1, t2));
+	}
+
+	if (par_z)
+	{
+	    if (ray->pos.z < sn->b_min[2] || ray->pos.z > sn->b_max[2])
+	    {
+		i = sn->skip;
+		continue;
+	    }
+	}
+	else
+	{
+	    t1 = (sn->b_min[2] - ray->pos.z) * inv_z;
+	    t2 = (sn->b_max[2] - ray->pos.z) * inv_z;
+	    t_near = MAX(t_near, MIN(t1, t2));
+	    t_far = MIN(t_far, MAX(t1, t2));
+	}
+
+	/*
+	 * Multiplying by the inverse direction can round a distance a bit
+	 * differently from Check_and_push()'s division. Widening the span
+	 * a hair takes in every box that takes in, so a ray right on the
+	 * edge of a box still reaches the objects in it.
+	 */
+
+	if (t_near * (1 - BOX_SLACK) > t_far * (1 + BOX_SLACK) ||
+	    t_far * (1 + BOX_SLACK) < MIN_T)
+	{
+	    i = sn->skip;
+	    continue;
+	}
+
+	/*
+	 * The ray hits this box. Go down into a composite. An object is
+	 * tested, and then passed like a miss.
+	 */
+
+	if ((obj = sn->obj) == NULL)
+	{
+	    i = sn->child;
+	    continue;
+	}
+
+	i = sn->skip;
+
+	/*
+	 * The widened box takes in rays which run right along its edge.
+	 * Whether such a ray gets to test the object is left to the same
+	 * test Intersect_tree() makes, so both find the same hits.
+	 */
+
+	if (!Hit_bbox(obj, ray))
+	    continue;
+
+	if (stamp)
+	{
+	    if (obj->active == stamp)
+		continue;
+	    obj->active = stamp;
+	}
+
+	inter->inst = NULL;
+	if (INTERSECT_OBJECT(obj, ray, inter))
+	{
+	    if (iflag == 0 || CLOSER(inter, &minter))
+	    {
+		iflag = 1;
+		minter = *inter;
+	    }
+	}
+    }
+
+    if (iflag)
+    {
+	*inter = minter;
+	return (1);
+    }
+    else
+	return (0);
+}
@@ -0,0 +1,474 @@
+/*
+ * sleaf.c
+ *
+ * This module tests the spheres of a leaf of the hierarchy several at once.
+ * Each composite whose children are all spheres gets a copy of their centers
+ * and squared radii, laid out as an array of each value, and is then traced
+ * as one object. The spheres are tested a whole SIMD register at a time, two
+ * with SSE2 or four with AVX, in double precision and with the same steps as
+ * Sphere_intersect(), so the hits are exactly the ones it would find. Built
+ * with SINGLE, the copy is in floats and twice as many fit in a register;
+ * those only sort out the misses, and the rest go to Sphere_intersect().
+ *
+ * Without SSE2 no leaves are packed, and the spheres are tested one at a
+ * time as before.
+ *
+ * The children of the other leaves are put in order of their types, so that
+ * each leaf is traced a run of one type at a time.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rt.h"
+#include "externs.h"
+#include "kernels.h"
+
+#if defined(__AVX__)
+
+#include <immintrin.h>
+
+#ifdef SINGLE
+
+#define LANES		8
+typedef __m256  VREG;
+
+#define V_SET(a)	_mm256_set1_ps(a)
+#define V_LOAD(p)	_mm256_loadu_ps(p)
+#define V_ADD(a, b)	_mm256_add_ps(a, b)
+#define V_SUB(a, b)	_mm256_sub_ps(a, b)
+#define V_MUL(a, b)	_mm256_mul_ps(a, b)
+#define V_GE(a, b)	_mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define V_MASK(a)	_mm256_movemask_ps(a)
+
+#else
+
+#define LANES		4
+typedef __m256d VREG;
+
+#define V_SET(a)	_mm256_set1_pd(a)
+#define V_LOAD(p)	_mm256_loadu_pd(p)
+#define V_STORE(p, a)	_mm256_storeu_pd(p, a)
+#define V_ADD(a, b)	_mm256_add_pd(a, b)
+#define V_SUB(a, b)	_mm256_sub_pd(a, b)
+#define V_MUL(a, b)	_mm256_mul_pd(a, b)
+#define V_SQRT(a)	_mm256_sqrt_pd(a)
+#define V_GE(a, b)	_mm256_cmp_pd(a, b, _CMP_GE_OQ)
+#define V_GT(a, b)	_mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define V_AND(a, b)	_mm256_and_pd(a, b)
+#define V_PICK(m, a, b)	_mm256_blendv_pd(b, a, m)
+#define V_MASK(a)	_mm256_movemask_pd(a)
+
+#endif
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#ifdef SINGLE
+
+#define LANES		4
+typedef __m128  VREG;
+
+#define V_SET(a)	_mm_set1_ps(a)
+#define V_LOAD(p)	_mm_loadu_ps(p)
+#define V_ADD(a, b)	_mm_add_ps(a, b)
+#define V_SUB(a, b)	_mm_sub_ps(a, b)
+#define V_MUL(a, b)	_mm_mul_ps(a, b)
+#define V_GE(a, b)	_mm_cmpge_ps(a, b)
+#define V_MASK(a)	_mm_movemask_ps(a)
+
+#else
+
+#define LANES		2
+typedef __m128d VREG;
+
+#define V_SET(a)	_mm_set1_pd(a)
+#define V_LOAD(p)	_mm_loadu_pd(p)
+#define V_STORE(p, a)	_mm_storeu_pd(p, a)
+#define V_ADD(a, b)	_mm_add_pd(a, b)
+#define V_SUB(a, b)	_mm_sub_pd(a, b)
+#define V_MUL(a, b)	_mm_mul_pd(a, b)
+#define V_SQRT(a)	_mm_sqrt_pd(a)
+#define V_GE(a, b)	_mm_cmpge_pd(a, b)
+#define V_GT(a, b)	_mm_cmpgt_pd(a, b)
+#define V_AND(a, b)	_mm_and_pd(a, b)
+#define V_PICK(m, a, b)	_mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b))
+#define V_MASK(a)	_mm_movemask_pd(a)
+
+#endif
+
+#endif
+
+/*
+ * In floats, the test for a miss is let off by this much of the squared
+ * distance to the center, which is more than the rounding can take.
+ */
+
+#define SLACK		1e-5
+
+int             Sphere_leaf_intersect();
+
+static char    *pool = NULL;	/* all of the packed leaves	 */
+static long     pool_size, pool_used;
+static int      nleaves;
+
+#ifdef LANES
+
+/*
+ * Sphere_leaf()
+ *
+ * Return 1 if the composite's children are all spheres, and there are
+ * enough of them to be worth packing.
+ */
+
+static int Sphere_leaf(COMPOSITE *cd)
+{
+    int             i;
+
+    if (cd->num < 2)
+	return (0);
+
+    for (i = 0; i < cd->num; i++)
+	if (cd->child[i]->type != T_SPHERE)
+	    return (0);
+
+    return (1);
+}
+
+/*
+ * Leaf_size()
+ *
+ * Return the bytes taken by the packed copy of a leaf of n spheres.
+ */
+
+static long Leaf_size(int n)
+{
+    n = (n + LANES - 1) / LANES * LANES;
+
+    return (sizeof(SPHERE_LEAF) + sizeof(REAL) * 4 * n +
+	    sizeof(OBJECT *) * n);
+}
+
+/*
+ * Pack_leaf()
+ *
+ * Make the packed copy of the spheres of the given composite, from the
+ * pool.
+ */
+
+static void Pack_leaf(OBJECT *obj)
+{
+    COMPOSITE      *cd;
+    SPHERE_LEAF    *sl;
+    SPHERE         *s;
+    int             i, n;
+
+    cd = (COMPOSITE *) obj->obj;
+    n = (cd->num + LANES - 1) / LANES * LANES;
+
+    sl = (SPHERE_LEAF *) (pool + pool_used);
+    pool_used += Leaf_size(cd->num);
+
+    sl->num = n;
+    sl->cx = (REAL *) (sl + 1);
+    sl->cy = sl->cx + n;
+    sl->cz = sl->cy + n;
+    sl->r2 = sl->cz + n;
+    sl->obj = (OBJECT **) (sl->r2 + n);
+
+    for (i = 0; i < n; i++)
+    {
+	sl->obj[i] = cd->child[MIN(i, cd->num - 1)];
+
+	s = (SPHERE *) sl->obj[i]->obj;
+	sl->cx[i] = s->center.x;
+	sl->cy[i] = s->center.y;
+	sl->cz[i] = s->center.z;
+	sl->r2[i] = s->radius2;
+    }
+
+    cd->leaf = sl;
+    obj->inter = Sphere_leaf_intersect;
+    obj->active = 0;
+    ++nleaves;
+}
+
+#endif
+
+/*
+ * Sort_by_type()
+ *
+ * Put the children of a leaf in order of their types, keeping the order of
+ * those of the same type. A leaf is then traced one run of a type after
+ * another, so the type tests of INTERSECT_OBJECT() go the same way from one
+ * child to the next, and so does the call, for the types it leaves to the
+ * pointer. Composites which have others under them are left alone, as the
+ * order of their children is the one the hierarchy was built in.
+ */
+
+static void Sort_by_type(COMPOSITE *cd)
+{
+    OBJECT         *o;
+    int             i, j;
+
+    for (i = 0; i < cd->num; i++)
+	if (IS_NODE(cd->child[i]))
+	    return;
+
+    for (i = 1; i < cd->num; i++)
+    {
+	o = cd->child[i];
+	for (j = i; j > 0 && cd->child[j - 1]->type > o->type; j--)
+	    cd->child[j] = cd->child[j - 1];
+	cd->child[j] = o;
+    }
+}
+
+/*
+ * Walk_leaves()
+ *
+ * Go through the composites under the given object, and sort the children of
+ * the leaves by type. If 'pack' is set, pack the sphere leaves, else only add
+ * up the room they need.
+ */
+
+static void Walk_leaves(OBJECT *obj, int pack)
+{
+    COMPOSITE      *cd;
+    int             i;
+
+    if (obj->type != T_COMPOSITE)
+	return;
+
+    cd = (COMPOSITE *) obj->obj;
+    cd->leaf = NULL;
+
+    for (i = 0; i < cd->num; i++)
+	Walk_leaves(cd->child[i], pack);
+
+    if (!pack)
+	Sort_by_type(cd);
+
+#ifdef LANES
+    if (Sphere_leaf(cd))
+    {
+	if (pack)
+	    Pack_leaf(obj);
+	else
+	    pool_size += Leaf_size(cd->num);
+    }
+#endif
+}
+
+/*
+ * Walk_trees()
+ *
+ * Walk the leaves of the hierarchy under the root, and of each instance
+ * hierarchy placed in the scene once.
+ */
+
+static void Walk_trees(int pack)
+{
+    OBJECT        **done;
+    PLACEMENT      *pl;
+    int             i, j, ndone;
+
+    if ((done = (OBJECT **) malloc(sizeof(OBJECT *) *
+				   (num_instance + 1))) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    Walk_leaves(root, pack);
+
+    ndone = 0;
+    for (i = 0; i < nobjects; i++)
+    {
+	if (objects[i]->type != T_INSTANCE)
+	    continue;
+
+	pl = (PLACEMENT *) objects[i]->obj;
+
+	for (j = 0; j < ndone; j++)
+	    if (done[j] == pl->tree)
+		break;
+
+	if (j == ndone)
+	{
+	    done[ndone++] = pl->tree;
+	    Walk_leaves(pl->tree, pack);
+	}
+    }
+
+    free(done);
+}
+
+/*
+ * Pack_sphere_leaves()
+ *
+ * Sort the children of every leaf of the hierarchies by type, and pack the
+ * spheres of those which are made of only spheres. This has to be done again
+ * whenever the hierarchy or the spheres change, before the flattened copies
+ * of it are built.
+ */
+
+void Pack_sphere_leaves()
+{
+    free(pool);
+    pool = NULL;
+    pool_size = pool_used = 0;
+    nleaves = 0;
+
+    Walk_trees(0);
+
+    if (pool_size > 0 && (pool = (char *) malloc(pool_size)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    Walk_trees(1);
+
+    if (verbose && nleaves > 0)
+    {
+	fprintf(stderr, "%s: %d sphere leaves packed, %ld Kbytes\n",
+		my_name, nleaves, pool_size / 1024);
+    }
+}
+
+/*
+ * Sphere_leaf_intersect()
+ *
+ * Check the spheres of a packed leaf for intersection with the given ray,
+ * and return the closest hit the same way Sphere_intersect() would return
+ * it for that sphere.
+ */
+
+int Sphere_leaf_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
+{
+#ifdef LANES
+    SPHERE_LEAF    *sl;
+    VREG            px, py, pz, dx, dy, dz;
+    VREG            ox, oy, oz, l2oc, tca, t2hc, r2, ok;
+#ifdef SINGLE
+    INTERSECT       hit;
+    VREG            slack;
+#else
+    VREG            min_t, disc, out, t;
+    double          tv[LANES];
+#endif
+    int             i, j, m, best, best_out;
+    double          best_t;
+
+    sl = ((COMPOSITE *) obj->obj)->leaf;
+
+    px = V_SET(ray->pos.x);
+    py = V_SET(ray->pos.y);
+    pz = V_SET(ray->pos.z);
+    dx = V_SET(ray->dir.x);
+    dy = V_SET(ray->dir.y);
+    dz = V_SET(ray->dir.z);
+#ifdef SINGLE
+    slack = V_SET(-SLACK);
+#else
+    min_t = V_SET(MIN_T);
+#endif
+
+    best = -1;
+    best_t = 0.0;
+    best_out = 0;
+
+    for (i = 0; i < sl->num; i += LANES)
+    {
+	/* the origin to center vector and its length */
+	ox = V_SUB(V_LOAD(sl->cx + i), px);
+	oy = V_SUB(V_LOAD(sl->cy + i), py);
+	oz = V_SUB(V_LOAD(sl->cz + i), pz);
+	l2oc = V_ADD(V_ADD(V_MUL(ox, ox), V_MUL(oy, oy)), V_MUL(oz, oz));
+
+	/* the closest approach along the ray */
+	tca = V_ADD(V_ADD(V_MUL(ox, dx), V_MUL(oy, dy)), V_MUL(oz, dz));
+	r2 = V_LOAD(sl->r2 + i);
+	t2hc = V_ADD(V_SUB(r2, l2oc), V_MUL(tca, tca));
+
+#ifdef SINGLE
+
+	/*
+	 * In floats only the clear misses are thrown out. The spheres which
+	 * are left are tested again by Sphere_intersect(), so the hits are
+	 * still the ones it finds.
+	 */
+
+	ok = V_GE(t2hc, V_MUL(l2oc, slack));
+	if ((m = V_MASK(ok)) == 0)
+	    continue;
+
+	for (j = 0; j < LANES; j++)
+	{
+	    if (!(m & (1 << j)) || !Sphere_hit(sl->obj[i + j], ray, &hit))
+		continue;
+
+	    if (best < 0 || hit.t < best_t || (hit.t == best_t &&
+			   sl->obj[i + j]->id < sl->obj[best]->id))
+	    {
+		best = i + j;
+		best_t = hit.t;
+		best_out = !hit.inside;
+	    }
+	}
+#else
+	ok = V_GE(t2hc, min_t);
+	if (V_MASK(ok) == 0)
+	    continue;
+
+	/* the far side from inside, else the near side */
+	disc = V_SQRT(V_AND(t2hc, ok));
+	out = V_GT(l2oc, V_ADD(r2, min_t));
+	t = V_PICK(out, V_SUB(tca, disc), V_ADD(tca, disc));
+
+	ok = V_AND(ok, V_GE(t, min_t));
+	if ((m = V_MASK(ok)) == 0)
+	    continue;
+
+	V_STORE(tv, t);
+	for (j = 0; j < LANES; j++)
+	{
+	    if (!(m & (1 << j)))
+		continue;
+
+	    if (best < 0 || tv[j] < best_t || (tv[j] == best_t &&
+			   sl->obj[i + j]->id < sl->obj[best]->id))
+	    {
+		best = i + j;
+		best_t = tv[j];
+		best_out = (V_MASK(out) >> j) & 1;
+	    }
+	}
+#endif
+    }
+
+    if (best < 0)
+	return (0);
+
+    inter->obj = sl->obj[best];
+    inter->t = best_t;
+    inter->inside = !best_out;
+
+    return (1);
+#else
+    return (0);
+#endif
+}
@@ -19,41 +19,27 @@
 
 #include "rt.h"
 #include "externs.h"
+#include "kernels.h"
 
-int            Sphere_intersect();
 void		Sphere_normal();
 
 /*
  * Build_sphere()
  * 
  * Given some info on a sphere object, build a complete object stucture.
+ * The sphere is copied into the object.
  */
 
 void Build_sphere(SPHERE         *s)
 {
     OBJECT         *o;
 
-    if (nobjects == MAX_PRIMS)
-    {
-	fprintf(stderr, "%s: too many objects specified\n", my_name);
-	exit(1);
-    }
-
-    if ((o = (OBJECT *) malloc(sizeof(OBJECT))) == NULL)
-    {
-	fprintf(stderr, "%s: malloc failed\n", my_name);
-	exit(1);
-    }
-
-    s->radius2 = s->radius * s->radius;
-
-    o->type = T_SPHERE;
-    o->obj = s;
-    o->surf = cur_surface;
+    o = New_object(T_SPHERE, s, sizeof(SPHERE));
     o->inter = Sphere_intersect;
     o->normal = Sphere_normal;
 
-    objects[nobjects++] = o;
+    s = (SPHERE *) o->obj;
+    s->radius2 = s->radius * s->radius;
 
     /*
      * Setup of bounding box for this puppy.
@@ -74,53 +60,12 @@ void Build_sphere(SPHERE         *s)
  * Sphere_intersect()
  * 
  * Check given sphere for intersection with given ray. Return TRUE if an
- * intersection takes place.
+ * intersection takes place. The test is Sphere_hit(), in kernels.h.
  */
 
 int Sphere_intersect(OBJECT *obj, RAY *ray, INTERSECT *inter)
 {
-    SPHERE         *s;
-    VECTOR          oc;
-    double          l2oc, tca, t2hc, disc;
-    double          t;
-
-    s = obj->obj;
-
-    /* calculate the origin to center vector */
-
-    VecSub(s->center, ray->pos, oc);
-    l2oc = VecDot(oc, oc);
-
-    /* find out the closest approach along the ray */
-    tca = VecDot(oc, ray->dir);
-    t2hc = s->radius2 - l2oc + (tca * tca);
-
-    /* if the discriminator < 0, then the ray will not hit */
-    if (t2hc < MIN_T)
-	return (0);
-
-    disc = sqrt(t2hc);
-
-    /* if ray is inside object, set the inside flag */
-    if (l2oc > s->radius2 + MIN_T)
-    {
-	inter->inside = 0;
-	t = tca - disc;
-    }
-    else
-    {
-	inter->inside = 1;
-	t = tca + disc;
-    }
-
-    if (t < MIN_T)
-	return (0);
-
-    inter->obj = obj;
-    inter->t = t;
-
-    return (1);
-
+    return (Sphere_hit(obj, ray, inter));
 }
 
 /*
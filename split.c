@@ -0,0 +1,341 @@
+/*
+ * split.c
+ *
+ * This module cuts up polygons whose bounding boxes are far bigger than
+ * those of the rest of the scene, before the hierarchy is built over them.
+ * A big floor polygon has a box which takes in everything standing on it,
+ * so every ray which goes near any of it has to test the polygon. Cut into
+ * pieces, each piece has a box of its own which the hierarchy can place
+ * with the objects around it.
+ *
+ * A polygon is cut in half across the longest side of its box, and the
+ * halves are cut in turn, until the boxes are small enough. The pieces lie
+ * in the plane of the polygon they came from, so they keep its normal. The
+ * halves overlap by a hair, since a ray running almost along a cut has its
+ * boxes tested from where it starts, and could otherwise slip between them.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rt.h"
+#include "externs.h"
+
+#define SPLIT_DEPTH	12	/* most times a polygon is halved */
+#define SPLIT_OVERLAP	1e-9	/* how far halves overlap, per size */
+
+static int      npieces;	/* pieces made so far		 */
+
+/*
+ * Compare_area()
+ *
+ * Compare two areas for qsort().
+ */
+
+static int Compare_area(const void *p1, const void *p2)
+{
+    double          a1, a2;
+
+    a1 = *(double *) p1;
+    a2 = *(double *) p2;
+
+    if (a1 < a2)
+	return (-1);
+    else if (a1 > a2)
+	return (1);
+    else
+	return (0);
+}
+
+/*
+ * Median_area()
+ *
+ * Return the median surface area of the boxes of the objects.
+ */
+
+static double Median_area()
+{
+    double         *area, median;
+    int             i, n;
+
+    n = nobjects;
+
+    if ((area = (double *) malloc(sizeof(double) * n)) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    for (i = 0; i < n; i++)
+	area[i] = Box_area(&objects[i]->b_min, &objects[i]->b_max);
+
+    qsort(area, n, sizeof(double), Compare_area);
+    median = area[n / 2];
+
+    free(area);
+    return (median);
+}
+
+/*
+ * Coord()
+ *
+ * Return a pointer to one coordinate of a point.
+ */
+
+static REAL    *Coord(VECTOR *v, int axis)
+{
+    switch (axis)
+    {
+    case 0:
+	return (&v->x);
+    case 1:
+	return (&v->y);
+    default:
+	return (&v->z);
+    }
+}
+
+/*
+ * Clip()
+ *
+ * Return the part of the polygon on one side of the plane where the given
+ * axis equals 'at': below it if 'below' is set, else above it. Returns NULL
+ * if nothing of it is left there.
+ */
+
+static POLYGON *Clip(POLYGON *p, int axis, double at, int below)
+{
+    POLYGON        *c;
+    VECTOR         *a, *b, pt;
+    double          da, db;
+    int             i, in_a, in_b;
+
+    /* each edge adds at most two points */
+    if ((c = (POLYGON *) malloc(POLY_SIZE(2 * p->npoints))) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    c->npoints = 0;
+
+    for (i = 0; i < p->npoints; i++)
+    {
+	a = &p->points[i];
+	b = &p->points[(i + 1) % p->npoints];
+
+	da = *Coord(a, axis) - at;
+	db = *Coord(b, axis) - at;
+	if (!below)
+	{
+	    da = -da;
+	    db = -db;
+	}
+
+	in_a = (da <= 0.0);
+	in_b = (db <= 0.0);
+
+	if (in_a)
+	    c->points[c->npoints++] = *a;
+
+	/*
+	 * Where the edge crosses the plane, the point is put right on
+	 * it. Going from a toward b keeps the coordinates they have in
+	 * common, so the pieces don't stick out past the polygon's edges.
+	 */
+
+	if (in_a != in_b)
+	{
+	    VecSub(*b, *a, pt);
+	    VecAddS(da / (da - db), pt, *a, pt);
+	    *Coord(&pt, axis) = at;
+	    c->points[c->npoints++] = pt;
+	}
+    }
+
+    /* drop points which repeat the one before */
+    for (i = 1; i < c->npoints;)
+    {
+	if (!memcmp(&c->points[i], &c->points[i - 1], sizeof(VECTOR)))
+	{
+	    memmove(&c->points[i], &c->points[i + 1],
+		    sizeof(VECTOR) * (c->npoints - i - 1));
+	    --c->npoints;
+	}
+	else
+	    ++i;
+    }
+
+    if (c->npoints > 1 &&
+	!memcmp(&c->points[0], &c->points[c->npoints - 1], sizeof(VECTOR)))
+	--c->npoints;
+
+    if (c->npoints < 3)
+    {
+	free(c);
+	return (NULL);
+    }
+
+    c->normal = p->normal;
+    c->d = p->d;
+    c->p1 = p->p1;
+    c->p2 = p->p2;
+
+    return (c);
+}
+
+/*
+ * Poly_box()
+ *
+ * Find the bounding box of a polygon.
+ */
+
+static void Poly_box(POLYGON *p, VECTOR *b_min, VECTOR *b_max)
+{
+    int             i;
+
+    b_min->x = b_min->y = b_min->z = HUGE;
+    b_max->x = b_max->y = b_max->z = -HUGE;
+
+    for (i = 0; i < p->npoints; i++)
+    {
+	b_min->x = MIN(p->points[i].x, b_min->x);
+	b_min->y = MIN(p->points[i].y, b_min->y);
+	b_min->z = MIN(p->points[i].z, b_min->z);
+
+	b_max->x = MAX(p->points[i].x, b_max->x);
+	b_max->y = MAX(p->points[i].y, b_max->y);
+	b_max->z = MAX(p->points[i].z, b_max->z);
+    }
+}
+
+/*
+ * Split()
+ *
+ * Cut the polygon in half until the boxes of the pieces have no more than
+ * the given area, and add the pieces to the object list. The pieces are
+ * copied into their objects, and freed.
+ */
+
+static void Split(POLYGON *p, double limit, int depth)
+{
+    POLYGON        *half, *piece;
+    VECTOR          b_min, b_max, size;
+    double          at, margin;
+    int             axis;
+
+    Poly_box(p, &b_min, &b_max);
+
+    if (depth > 0 &&
+	(depth == SPLIT_DEPTH || Box_area(&b_min, &b_max) <= limit))
+    {
+	/*
+	 * Build_poly() works out the plane from the first three points,
+	 * which a cut may have left in a line, so the one of the whole
+	 * polygon is put back, and the edges worked out again with it.
+	 */
+
+	Build_poly(p);
+
+	piece = (POLYGON *) objects[nobjects - 1]->obj;
+	piece->normal = p->normal;
+	piece->d = p->d;
+	piece->p1 = p->p1;
+	piece->p2 = p->p2;
+	Poly_edges(objects[nobjects - 1]);
+
+	free(p);
+	++npieces;
+	return;
+    }
+
+    VecSub(b_max, b_min, size);
+    if (size.x >= size.y && size.x >= size.z)
+	axis = 0;
+    else if (size.y >= size.z)
+	axis = 1;
+    else
+	axis = 2;
+
+    at = (*Coord(&b_min, axis) + *Coord(&b_max, axis)) / 2;
+    margin = *Coord(&size, axis) * SPLIT_OVERLAP;
+
+    if ((half = Clip(p, axis, at + margin, 1)) != NULL)
+	Split(half, limit, depth + 1);
+    if ((half = Clip(p, axis, at - margin, 0)) != NULL)
+	Split(half, limit, depth + 1);
+
+    /* the whole polygon is in the block of its object */
+    if (depth > 0)
+	free(p);
+}
+
+/*
+ * Split_polygons()
+ *
+ * Cut up every polygon whose box has more than split_factor times the median
+ * area of the boxes of all of the objects. The pieces take the place of the
+ * polygon at the end of the object list, with its surface. The objects of
+ * instance definitions are left as they are.
+ */
+
+void Split_polygons()
+{
+    SURFACE        *save_surface;
+    OBJECT         *o;
+    POLYGON        *p;
+    double          limit;
+    int             i, j, last, nsplit;
+
+    if (nobjects < 2)
+	return;
+
+    limit = Median_area() * split_factor;
+    last = nobjects;
+    save_surface = cur_surface;
+    nsplit = npieces = 0;
+
+    for (i = 0; i < last; i++)
+    {
+	o = objects[i];
+	if (o->type != T_POLYGON || Box_area(&o->b_min, &o->b_max) <= limit)
+	    continue;
+
+	p = (POLYGON *) o->obj;
+	cur_surface = o->surf;
+	Split(p, limit, 0);
+
+	free(o);
+	objects[i] = NULL;
+	++nsplit;
+    }
+
+    cur_surface = save_surface;
+
+    if (nsplit == 0)
+	return;
+
+    for (i = j = 0; i < nobjects; i++)
+	if (objects[i] != NULL)
+	    objects[j++] = objects[i];
+    nobjects = j;
+
+    if (verbose)
+    {
+	fprintf(stderr, "%s: split %d polygons into %d pieces\n",
+		my_name, nsplit, npieces);
+    }
+}
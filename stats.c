@@ -0,0 +1,259 @@
+/*
+ * stats.c
+ *
+ * This module prints a report on the quality of the bounding box hierarchy,
+ * so that the builders and their settings can be compared on a scene
+ * without rendering it.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rt.h"
+#include "externs.h"
+
+/*
+ * Totals for one level of the tree. The root is level 0.
+ */
+
+typedef struct level_stats
+{
+	int             nodes;	/* composites on this level	 */
+	int             prims;	/* objects on this level	 */
+	double          area;	/* sum of the composites' areas	 */
+}               LEVEL_STATS;
+
+static LEVEL_STATS *levels = NULL;
+static int      nlevels, max_levels;
+static int      leaf_hist[MAX_GROUP + 1];	/* leaves by object count */
+static double   overlap_area, child_area;
+
+/*
+ * Level()
+ *
+ * Return the totals of the given level, growing the table if needed.
+ */
+
+static LEVEL_STATS *Level(int depth)
+{
+    if (depth >= max_levels)
+    {
+	max_levels = MAX(max_levels * 2, depth + 16);
+	levels = (LEVEL_STATS *) realloc(levels,
+					 sizeof(LEVEL_STATS) * max_levels);
+	if (levels == NULL)
+	{
+	    fprintf(stderr, "%s: malloc failed\n", my_name);
+	    exit(1);
+	}
+    }
+
+    while (nlevels <= depth)
+    {
+	memset(&levels[nlevels], 0, sizeof(LEVEL_STATS));
+	++nlevels;
+    }
+
+    return (&levels[depth]);
+}
+
+/*
+ * Overlap()
+ *
+ * Return the surface area of the part two boxes have in common.
+ */
+
+static double Overlap(OBJECT *a, OBJECT *b)
+{
+    VECTOR          mn, mx;
+
+    mn.x = MAX(a->b_min.x, b->b_min.x);
+    mn.y = MAX(a->b_min.y, b->b_min.y);
+    mn.z = MAX(a->b_min.z, b->b_min.z);
+
+    mx.x = MIN(a->b_max.x, b->b_max.x);
+    mx.y = MIN(a->b_max.y, b->b_max.y);
+    mx.z = MIN(a->b_max.z, b->b_max.z);
+
+    return (Box_area(&mn, &mx));
+}
+
+/*
+ * Walk_tree()
+ *
+ * Gather the statistics of the subtree under the given object.
+ */
+
+static void Walk_tree(OBJECT *obj, int depth)
+{
+    COMPOSITE      *cd;
+    LEVEL_STATS    *ls;
+    int             i, j, nprims;
+
+    ls = Level(depth);
+
+    if (obj->type != T_COMPOSITE)
+    {
+	++ls->prims;
+	return;
+    }
+
+    ++ls->nodes;
+    ls->area += Box_area(&obj->b_min, &obj->b_max);
+
+    cd = (COMPOSITE *) obj->obj;
+
+    /*
+     * A leaf is a composite which holds objects, and the overlap is
+     * taken between every pair of children.
+     */
+
+    nprims = 0;
+    for (i = 0; i < cd->num; i++)
+    {
+	if (cd->child[i]->type != T_COMPOSITE)
+	    ++nprims;
+
+	child_area += Box_area(&cd->child[i]->b_min, &cd->child[i]->b_max);
+	for (j = i + 1; j < cd->num; j++)
+	    overlap_area += Overlap(cd->child[i], cd->child[j]);
+    }
+
+    if (nprims > 0)
+	++leaf_hist[nprims];
+
+    for (i = 0; i < cd->num; i++)
+	Walk_tree(cd->child[i], depth + 1);
+}
+
+/*
+ * Prim_size()
+ *
+ * Return the number of bytes taken by the data of the given object.
+ */
+
+static long Prim_size(OBJECT *obj)
+{
+    TRIANGLE       *tri;
+
+    if (obj->type != T_TRIANGLE)
+	return (Data_size(obj));
+
+    tri = (TRIANGLE *) obj->obj;
+    if (tri != tri->mesh->tris)
+	return (sizeof(TRIANGLE));
+
+    /* the first triangle of a mesh is charged with its vertices */
+    return (sizeof(MESH) + sizeof(VECTOR) * tri->mesh->nverts +
+	    sizeof(TRIANGLE));
+}
+
+/*
+ * Print_bvh_stats()
+ *
+ * Print the report on the hierarchy under the root. If 'dump_areas' is set,
+ * the box areas of every level are listed as well.
+ */
+
+void Print_bvh_stats(int dump_areas)
+{
+    long            node_mem, prim_mem;
+    double          root_area;
+    int             i, nprims, nnodes, nleaves, nrefs;
+
+    nlevels = 0;
+    memset(leaf_hist, 0, sizeof(leaf_hist));
+    overlap_area = child_area = 0.0;
+
+    Walk_tree(root, 0);
+
+    nprims = nnodes = nrefs = 0;
+    prim_mem = node_mem = 0;
+
+    for (i = 0; i < nobjects; i++)
+    {
+	if (objects[i]->type == T_COMPOSITE)
+	{
+	    ++nnodes;
+	    node_mem += sizeof(OBJECT) + sizeof(COMPOSITE) + sizeof(OBJECT *) *
+		(((COMPOSITE *) objects[i]->obj)->num - 1);
+	}
+	else
+	{
+	    ++nprims;
+	    prim_mem += sizeof(OBJECT) + Prim_size(objects[i]);
+	}
+    }
+
+    for (i = 0; i < nlevels; i++)
+	nrefs += levels[i].prims;
+
+    nleaves = 0;
+    for (i = 1; i <= MAX_GROUP; i++)
+	nleaves += leaf_hist[i];
+
+    printf("%s: hierarchy of %s\n", my_name, input_file);
+    printf("    objects:          %d (%d references)\n", nprims, nrefs);
+    printf("    composites:       %d (%d leaves)\n", nnodes, nleaves);
+    printf("    depth:            %d\n", nlevels - 1);
+    printf("    SAH cost:         %g\n", Sah_cost(root));
+    printf("    overlap ratio:    %g\n",
+	   child_area > 0.0 ? overlap_area / child_area : 0.0);
+
+    printf("    memory:           %ld Kbytes of composites, "
+	   "%ld Kbytes of objects\n", node_mem / 1024, prim_mem / 1024);
+    if (use_qbvh)
+	printf("                      %ld Kbytes of quantized nodes\n",
+	       Qbvh_memory() / 1024);
+    if (use_stackless)
+	printf("                      %ld Kbytes of stackless entries\n",
+	       Skip_memory() / 1024);
+    if (use_qbvh || use_stackless)
+	printf("    layout:           %s\n",
+	       bvh_layout == LAYOUT_VEB ? "van Emde Boas" : "depth first");
+
+    printf("    branching:        %d, leaves of up to %d\n",
+	   branch_factor, leaf_size);
+
+    printf("\n    objects per leaf:\n");
+    for (i = 1; i <= MAX(branch_factor, leaf_size); i++)
+	printf("    %8d %8d\n", i, leaf_hist[i]);
+
+    printf("\n    depth    composites  objects\n");
+    for (i = 0; i < nlevels; i++)
+	printf("    %5d %10d %10d\n", i, levels[i].nodes, levels[i].prims);
+
+    if (dump_areas)
+    {
+	/*
+	 * The areas are also given relative to the root's, which is
+	 * the chance that a ray hitting the root hits a box on the level.
+	 */
+
+	root_area = Box_area(&root->b_min, &root->b_max);
+
+	printf("\n    depth    composites  total area   mean area   vs root\n");
+	for (i = 0; i < nlevels; i++)
+	{
+	    if (levels[i].nodes == 0)
+		continue;
+
+	    printf("    %5d %10d %12g %12g %9.4f\n", i, levels[i].nodes,
+		   levels[i].area, levels[i].area / levels[i].nodes,
+		   root_area > 0.0 ? levels[i].area / root_area : 0.0);
+	}
+    }
+}
@@ -14,6 +14,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <time.h>
 
@@ -22,6 +23,8 @@
 
 COLOR           Trace_a_ray(), Background_color(), Illuminate();
 
+#define TILE_ROWS	16	/* scan lines traced together by --sort-rays */
+
 //
 // These variable are read-only to the tracer threads. They can only be modified
 // by the master thread before any of the tracer threads are created.
@@ -32,6 +35,179 @@ VECTOR		ver;
 double		x_pw;
 double		y_pw;
 
+static long	ts;		/* time of the last progress report */
+static int	l_int, l_shad, l_refl, l_refr;	/* counts at that time */
+
+/*
+ * Write_tile()
+ * 
+ * Write the given number of scan lines of summed colors to the output file,
+ * and clear them for the next tile.
+ */
+
+static void Write_tile(COLOR *tile, int rows)
+{
+    COLOR          *col;
+    int             x, y;
+
+    for (y = 0; y < rows; y++)
+    {
+	for (x = 0; x < view.x_res; x++)
+	{
+	    col = &tile[y * view.x_res + x];
+
+	    if (sample_cnt != 1)
+	    {
+		col->r /= sample_cnt;
+		col->g /= sample_cnt;
+		col->b /= sample_cnt;
+	    }
+
+	    Write_pixel(col);
+	    col->r = col->g = col->b = 0.0;
+	}
+
+	Flush_output_file();
+    }
+}
+
+/*
+ * Show_progress()
+ *
+ * Report how far the picture has come, and what was traced since the last
+ * report, if verbose.
+ */
+
+static void Show_progress(int y)
+{
+    long            te;
+
+    if (!verbose)
+	return;
+
+    time(&te);
+    fprintf(stderr, "\r%s: scan %d -- %ld:%02ld  i:%d  s:%d   rl:%d  rr:%d ",
+	    my_name, y, (te - ts) / 60, (te - ts) % 60,
+	    n_intersects - l_int, n_shadinter - l_shad,
+	    n_reflect - l_refl, n_refract - l_refr);
+
+    l_int = n_intersects;
+    l_shad = n_shadinter;
+    l_refl = n_reflect;
+    l_refr = n_refract;
+
+    ts = te;
+}
+
+/*
+ * Packet_frustum()
+ *
+ * Make the frustum of the rays from the eye through the part of the screen
+ * from x0 to x1 across and y0 to y1 up. A ray goes along look_at, plus
+ * view.angle times its place across along hor and up along ver, so it is
+ * on the inner side of x >= x0 if its part along hor is at least x0 *
+ * view.angle times its part along look_at, and so on for the other sides,
+ * which are turned around for x <= x1 and y <= y1.
+ */
+
+static void Packet_frustum(FRUSTUM *fr, double x0, double x1, double y0,
+			   double y1)
+{
+    double          a[4], *n;
+    VECTOR         *side;
+    int             i;
+
+    fr->eye[0] = view.from.x;
+    fr->eye[1] = view.from.y;
+    fr->eye[2] = view.from.z;
+
+    a[0] = x0 * view.angle;
+    a[1] = x1 * view.angle;
+    a[2] = y0 * view.angle;
+    a[3] = y1 * view.angle;
+
+    for (i = 0; i < 4; i++)
+    {
+	side = (i < 2) ? &hor : &ver;
+	n = fr->n[i];
+
+	n[0] = side->x - a[i] * view.look_at.x;
+	n[1] = side->y - a[i] * view.look_at.y;
+	n[2] = side->z - a[i] * view.look_at.z;
+
+	if (i & 1)
+	{
+	    n[0] = -n[0];
+	    n[1] = -n[1];
+	    n[2] = -n[2];
+	}
+    }
+}
+
+/*
+ * Trace_band()
+ *
+ * Trace a band of scan lines in square packets of primary rays, and write
+ * it out. 'ray' has room for a packet, with the origins filled in. 'xr'
+ * holds where each column is across the screen, and 'yr' where each of the
+ * 'rows' scan lines is. Packets at the right and bottom edges are filled out
+ * with copies of the last rays, whose colors are dropped.
+ */
+
+static void Trace_band(RAY *ray, double *xr, double *yr, int rows,
+		       COLOR *band)
+{
+    INTERSECT       inter[MAX_PACKET];
+    FRUSTUM         fr;
+    VECTOR          ip;
+    int             x, i, j, k, n, hits;
+
+    n = packet_size;
+
+    for (x = 0; x < view.x_res; x += n)
+    {
+	for (j = 0; j < n; j++)
+	{
+	    for (i = 0; i < n; i++)
+	    {
+		k = j * n + i;
+		VecComb(xr[MIN(x + i, view.x_res - 1)] * view.angle, hor,
+			yr[MIN(j, rows - 1)] * view.angle, ver, ray[k].dir);
+		VecAdd(ray[k].dir, view.look_at, ray[k].dir);
+		VecNormalize(&ray[k].dir);
+	    }
+	}
+
+	/* across, the screen goes from 1 on the left to -1 on the right */
+	Packet_frustum(&fr, xr[MIN(x + n, view.x_res) - 1], xr[x],
+		       yr[rows - 1], yr[0]);
+	hits = Intersect_packet(ray, n * n, view.angle > 0 ? &fr : NULL, inter);
+
+	/* the rays are shaded one at a time, as Trace_a_ray() does */
+	for (j = 0; j < rows; j++)
+	{
+	    for (i = 0; i < n && x + i < view.x_res; i++)
+	    {
+		k = j * n + i;
+		++n_rays;
+
+		if (!(hits & (1 << k)))
+		{
+		    band[j * view.x_res + x + i] = Background_color(&ray[k]);
+		    continue;
+		}
+
+		++n_intersects;
+		VecAddS(inter[k].t, ray[k].dir, ray[k].pos, ip);
+		band[j * view.x_res + x + i] = Illuminate(&inter[k], &ray[k],
+							   &ip, 0);
+	    }
+	}
+    }
+
+    Write_tile(band, rows);
+}
+
 /*
  * Raytrace()
  * 
@@ -40,14 +216,14 @@ double		y_pw;
 
 void Raytrace()
 {
-    RAY             ray;
+    RAY             ray, pray[MAX_PACKET];
     double          xr, yr, x_step, y_step;
     double          x_rand, y_rand;
-    int             x, y;
+    double         *xs = NULL, ys[MAX_PACKET];
+    int             x, y, k, packets;
 
-    COLOR           col, scol;
-    long            ts, te;
-    int             l_int, l_shad, l_refl, l_refr, s;
+    COLOR           col, scol, *tile = NULL;
+    int             s, rows;
 
     /* calculate the viewing frustrum. */
     VecSub(view.look_at, view.from, view.look_at);
@@ -65,6 +241,50 @@ void Raytrace()
 
     view.angle = tan(view.angle * M_PI / 180) / sqrt(2.0);
 
+    /*
+     * When rays are sorted, the colors of a tile of scan lines are summed
+     * up here until all of its rays are traced.
+     */
+
+    if (sort_rays)
+    {
+	tile = (COLOR *) calloc(TILE_ROWS * view.x_res, sizeof(COLOR));
+	if (tile == NULL)
+	{
+	    fprintf(stderr, "%s: malloc failed\n", my_name);
+	    exit(1);
+	}
+    }
+
+    /*
+     * Packets are traced a band of scan lines at a time. The columns are
+     * worked out the same way as for single rays, so the rays are the
+     * same.
+     */
+
+    packets = (packet_size > 0 && sample_cnt == 1);
+    if (packets)
+    {
+	tile = (COLOR *) calloc(packet_size * view.x_res, sizeof(COLOR));
+	xs = (double *) malloc(sizeof(double) * view.x_res);
+	if (tile == NULL || xs == NULL)
+	{
+	    fprintf(stderr, "%s: malloc failed\n", my_name);
+	    exit(1);
+	}
+
+	xr = 1;
+	for (x = 0; x < view.x_res; x++)
+	{
+	    xs[x] = xr;
+	    xr -= x_step;
+	}
+
+	for (k = 0; k < MAX_PACKET; k++)
+	    VecCopy(view.from, pray[k].pos);
+    }
+
+    rows = 0;
     l_int = l_shad = l_refl = l_refr = 0;
     time(&ts);
 
@@ -74,6 +294,21 @@ void Raytrace()
 
     for (y = y_start; y < view.y_res; y += y_inc)
     {
+	if (packets)
+	{
+	    for (rows = 0; rows < packet_size && y < view.y_res; rows++)
+	    {
+		ys[rows] = yr;
+		yr -= y_step;
+		y += y_inc;
+	    }
+	    y -= y_inc;
+
+	    Trace_band(pray, xs, ys, rows, tile);
+	    Show_progress(y);
+	    continue;
+	}
+
 	xr = 1;
 	for (x = 0; x < view.x_res; x++)
 	{
@@ -90,7 +325,10 @@ void Raytrace()
 		 * Trace that Ray!!
 		 */
 
-		col = Trace_a_ray(&ray, 0);
+		if (sort_rays)
+		    Defer_ray(&ray, rows * view.x_res + x);
+		else
+		    col = Trace_a_ray(&ray, 0);
 	    }
 	    else
 	    {
@@ -110,6 +348,12 @@ void Raytrace()
 		     * ray.dir.z);
 		     */
 
+		    if (sort_rays)
+		    {
+			Defer_ray(&ray, rows * view.x_res + x);
+			continue;
+		    }
+
 		    scol = Trace_a_ray(&ray, 0);
 
 		    col.r += scol.r;
@@ -126,32 +370,35 @@ void Raytrace()
 	     * Write pixel to output file
 	     */
 
-	    Write_pixel(&col);
+	    if (!sort_rays)
+		Write_pixel(&col);
 
 	    xr -= x_step;
 	}
 
-	Flush_output_file();
-
 	yr -= y_step;
 
-	if (verbose)
+	/*
+	 * A tile is traced when it is full, or at the last scan line.
+	 */
+
+	if (sort_rays)
 	{
-	    time(&te);
-	    fprintf(stderr, "\r%s: scan %d -- %ld:%02ld  i:%d  s:%d   rl:%d  rr:%d ",
-		    my_name, y, (te - ts) / 60, (te - ts) % 60,
-		    n_intersects - l_int, n_shadinter - l_shad,
-		    n_reflect - l_refl, n_refract - l_refr);
-
-	    l_int = n_intersects;
-	    l_shad = n_shadinter;
-	    l_refl = n_reflect;
-	    l_refr = n_refract;
-
-	    ts = te;
+	    if (++rows < TILE_ROWS && y + y_inc < view.y_res)
+		continue;
+
+	    Trace_deferred(tile);
+	    Write_tile(tile, rows);
+	    rows = 0;
 	}
+	else
+	    Flush_output_file();
+
+	Show_progress(y);
     }
 
+    free(xs);
+    free(tile);
 }
 
 
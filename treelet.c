@@ -0,0 +1,580 @@
+/*
+ * treelet.c
+ *
+ * This module improves a built hierarchy by rearranging small treelets. A
+ * treelet is a composite and some of the composites under it, grown until
+ * it has TREELET_LEAVES subtrees hanging off of it. Those subtrees are
+ * regrouped in whichever way gives the treelet the lowest SAH cost, found
+ * by trying all of the ways. The tree is done from the bottom up, and the
+ * parts of it under different composites are done by different threads.
+ *
+ * Copyright (C) 1990-2015, Kory Hamzeh.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License V3
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "rt.h"
+#include "externs.h"
+
+#define TREELET_LEAVES	7	/* subtrees under a treelet	 */
+#define TREELET_SETS	(1 << TREELET_LEAVES)
+#define TREELET_WORK	4	/* subtrees per thread		 */
+
+/*
+ * The state of the treelet being rearranged. Sets of its subtrees are bit
+ * masks. part[s][m] is the lowest cost of splitting set s into exactly m
+ * groups, and first[s][m] the group holding the lowest member of s in it.
+ */
+
+typedef struct treelet
+{
+	OBJECT         *leaf[TREELET_LEAVES];	/* subtrees hanging off	 */
+	OBJECT         *inner[TREELET_LEAVES];	/* composites inside	 */
+	int             nleaves, ninner;
+	double          area[TREELET_SETS];	/* area of each set's box */
+	double          cost[TREELET_SETS];	/* lowest cost of each set */
+	int             groups[TREELET_SETS];	/* its number of groups	 */
+	double          part[TREELET_SETS][MAX_GROUP + 1];
+	int             first[TREELET_SETS][MAX_GROUP + 1];
+}               TREELET;
+
+static OBJECT **work;	/* subtrees for the threads	 */
+static int      nwork, next_work;
+static int      spare;		/* free room in the object list	 */
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Grow_treelet()
+ *
+ * Start a treelet at the given composite, and keep opening up the subtree
+ * with the biggest box while there is room for its children. Returns 0 if
+ * nothing could be opened.
+ */
+
+static int Grow_treelet(TREELET *tl, OBJECT *top)
+{
+    COMPOSITE      *cd;
+    OBJECT         *obj;
+    double          a, best_a;
+    int             i, best;
+
+    cd = (COMPOSITE *) top->obj;
+    if (cd->num > TREELET_LEAVES)
+	return (0);
+
+    tl->inner[0] = top;
+    tl->ninner = 1;
+    tl->nleaves = cd->num;
+    for (i = 0; i < cd->num; i++)
+	tl->leaf[i] = cd->child[i];
+
+    while (1)
+    {
+	best = -1;
+	best_a = -1;
+
+	for (i = 0; i < tl->nleaves; i++)
+	{
+	    obj = tl->leaf[i];
+	    if (obj->type != T_COMPOSITE ||
+		tl->nleaves - 1 + ((COMPOSITE *) obj->obj)->num > TREELET_LEAVES)
+		continue;
+
+	    if ((a = Box_area(&obj->b_min, &obj->b_max)) > best_a)
+	    {
+		best_a = a;
+		best = i;
+	    }
+	}
+
+	if (best < 0)
+	    break;
+
+	obj = tl->leaf[best];
+	cd = (COMPOSITE *) obj->obj;
+
+	tl->inner[tl->ninner++] = obj;
+	tl->leaf[best] = tl->leaf[--tl->nleaves];
+	for (i = 0; i < cd->num; i++)
+	    tl->leaf[tl->nleaves++] = cd->child[i];
+    }
+
+    return (tl->ninner > 1);
+}
+
+/*
+ * Best_groups()
+ *
+ * Find the lowest cost way to arrange every set of the treelet's subtrees,
+ * smallest sets first.
+ */
+
+static void Best_groups(TREELET *tl)
+{
+    VECTOR          mn, mx;
+    OBJECT         *obj;
+    double          c;
+    int             n, s, t, rest, low, m, i;
+
+    n = tl->nleaves;
+
+    for (s = 1; s < (1 << n); s++)
+    {
+	mn.x = mn.y = mn.z = HUGE;
+	mx.x = mx.y = mx.z = -HUGE;
+
+	for (i = 0; i < n; i++)
+	{
+	    if (!(s & (1 << i)))
+		continue;
+
+	    obj = tl->leaf[i];
+	    mn.x = MIN(mn.x, obj->b_min.x);
+	    mn.y = MIN(mn.y, obj->b_min.y);
+	    mn.z = MIN(mn.z, obj->b_min.z);
+	    mx.x = MAX(mx.x, obj->b_max.x);
+	    mx.y = MAX(mx.y, obj->b_max.y);
+	    mx.z = MAX(mx.z, obj->b_max.z);
+	}
+	tl->area[s] = Box_area(&mn, &mx);
+    }
+
+    /*
+     * Every subset of a set is a smaller number, so counting up does the
+     * parts of a set before the set itself.
+     */
+
+    for (s = 1; s < (1 << n); s++)
+    {
+	for (m = 0; m <= branch_factor; m++)
+	    tl->part[s][m] = HUGE;
+
+	if ((s & (s - 1)) == 0)
+	{
+	    for (i = 0; s != (1 << i); i++)
+		;
+	    tl->cost[s] = Node_cost(tl->leaf[i]);
+	    tl->groups[s] = 1;
+	    tl->part[s][1] = tl->cost[s];
+	    continue;
+	}
+
+	/* the group holding the lowest member, then the rest in m - 1 */
+
+	low = s & -s;
+	for (t = (s - 1) & s; t > 0; t = (t - 1) & s)
+	{
+	    if (!(t & low))
+		continue;
+
+	    rest = s & ~t;
+	    for (m = 2; m <= branch_factor; m++)
+	    {
+		c = tl->cost[t] + tl->part[rest][m - 1];
+		if (c < tl->part[s][m])
+		{
+		    tl->part[s][m] = c;
+		    tl->first[s][m] = t;
+		}
+	    }
+	}
+
+	tl->cost[s] = HUGE;
+	for (m = 2; m <= branch_factor; m++)
+	{
+	    c = tl->area[s] * m + tl->part[s][m];
+	    if (c < tl->cost[s])
+	    {
+		tl->cost[s] = c;
+		tl->groups[s] = m;
+	    }
+	}
+	tl->part[s][1] = tl->cost[s];
+    }
+}
+
+/*
+ * Count_groups()
+ *
+ * Return the number of composites the given set of subtrees is arranged
+ * into.
+ */
+
+static int Count_groups(TREELET *tl, int s)
+{
+    int             m, i, t, n;
+
+    if ((s & (s - 1)) == 0)
+	return (0);
+
+    n = 1;
+    m = tl->groups[s];
+    for (i = 0; i < m; i++)
+    {
+	t = (i < m - 1) ? tl->first[s][m - i] : s;
+	s &= ~t;
+	n += Count_groups(tl, t);
+    }
+
+    return (n);
+}
+
+/*
+ * Set_children()
+ *
+ * Fill in a composite for the given set of subtrees, arranged the way
+ * Best_groups() found, with its box.
+ */
+
+static OBJECT  *Make_group(TREELET *tl, int s);
+
+static void Set_children(TREELET *tl, OBJECT *cp, int s)
+{
+    COMPOSITE      *cd;
+    OBJECT         *ch;
+    int             m, i, t;
+
+    m = tl->groups[s];
+
+    if ((cd = (COMPOSITE *) malloc(sizeof(COMPOSITE) +
+				   sizeof(OBJECT *) * (m - 1))) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    cp->type = T_COMPOSITE;
+    cp->obj = (void *) cd;
+    cd->num = m;
+    cd->leaf = NULL;
+
+    cp->b_min.x = cp->b_min.y = cp->b_min.z = HUGE;
+    cp->b_max.x = cp->b_max.y = cp->b_max.z = -HUGE;
+
+    for (i = 0; i < m; i++)
+    {
+	t = (i < m - 1) ? tl->first[s][m - i] : s;
+	s &= ~t;
+
+	ch = Make_group(tl, t);
+	cd->child[i] = ch;
+
+	cp->b_min.x = MIN(ch->b_min.x, cp->b_min.x);
+	cp->b_min.y = MIN(ch->b_min.y, cp->b_min.y);
+	cp->b_min.z = MIN(ch->b_min.z, cp->b_min.z);
+
+	cp->b_max.x = MAX(ch->b_max.x, cp->b_max.x);
+	cp->b_max.y = MAX(ch->b_max.y, cp->b_max.y);
+	cp->b_max.z = MAX(ch->b_max.z, cp->b_max.z);
+    }
+}
+
+/*
+ * Make_group()
+ *
+ * Return the subtree for the given set, making a new composite for it if it
+ * has more than one member.
+ */
+
+static OBJECT  *Make_group(TREELET *tl, int s)
+{
+    OBJECT         *cp;
+    int             i;
+
+    if ((s & (s - 1)) == 0)
+    {
+	for (i = 0; s != (1 << i); i++)
+	    ;
+	return (tl->leaf[i]);
+    }
+
+    if ((cp = (OBJECT *) malloc(sizeof(OBJECT))) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    Set_children(tl, cp, s);
+    return (cp);
+}
+
+/*
+ * Rearrange()
+ *
+ * Rearrange the treelet at the given composite if that lowers its cost. Any
+ * composites it needs beyond the ones it had come out of the spare room in
+ * the object list. The composite itself stays where it is, since its parent
+ * points at it.
+ */
+
+static void Rearrange(TREELET *tl, OBJECT *top)
+{
+    double          old_cost;
+    int             i, all, extra, fits;
+
+    if (!Grow_treelet(tl, top))
+	return;
+
+    old_cost = 0;
+    for (i = 0; i < tl->ninner; i++)
+	old_cost += Box_area(&tl->inner[i]->b_min, &tl->inner[i]->b_max) *
+	    ((COMPOSITE *) tl->inner[i]->obj)->num;
+    for (i = 0; i < tl->nleaves; i++)
+	old_cost += Node_cost(tl->leaf[i]);
+
+    Best_groups(tl);
+
+    all = (1 << tl->nleaves) - 1;
+    if (tl->cost[all] >= old_cost * (1 - 1e-9))
+	return;
+
+    extra = Count_groups(tl, all) - tl->ninner;
+
+    pthread_mutex_lock(&tree_lock);
+    fits = (extra <= spare);
+    if (fits)
+	spare -= extra;
+    pthread_mutex_unlock(&tree_lock);
+
+    if (!fits)
+	return;
+
+    free(top->obj);
+    for (i = 1; i < tl->ninner; i++)
+    {
+	free(tl->inner[i]->obj);
+	free(tl->inner[i]);
+    }
+
+    Set_children(tl, top, all);
+}
+
+/*
+ * Optimize()
+ *
+ * Rearrange the treelets under the given object, from the bottom up.
+ */
+
+static void Optimize(TREELET *tl, OBJECT *obj)
+{
+    COMPOSITE      *cd;
+    int             i;
+
+    if (obj->type != T_COMPOSITE)
+	return;
+
+    cd = (COMPOSITE *) obj->obj;
+    for (i = 0; i < cd->num; i++)
+	Optimize(tl, cd->child[i]);
+
+    Rearrange(tl, obj);
+}
+
+/*
+ * Optimize_top()
+ *
+ * Rearrange the treelets above the given depth, which the threads have
+ * already done below.
+ */
+
+static void Optimize_top(TREELET *tl, OBJECT *obj, int depth)
+{
+    COMPOSITE      *cd;
+    int             i;
+
+    if (obj->type != T_COMPOSITE || depth == 0)
+	return;
+
+    cd = (COMPOSITE *) obj->obj;
+    for (i = 0; i < cd->num; i++)
+	Optimize_top(tl, cd->child[i], depth - 1);
+
+    Rearrange(tl, obj);
+}
+
+/*
+ * Worker()
+ *
+ * Thread body. Take subtrees off of the work list until it is empty.
+ */
+
+static void    *Worker(void *arg)
+{
+    TREELET        *tl;
+    OBJECT         *obj;
+
+    if ((tl = (TREELET *) malloc(sizeof(TREELET))) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    while (1)
+    {
+	pthread_mutex_lock(&tree_lock);
+	obj = (next_work < nwork) ? work[next_work++] : NULL;
+	pthread_mutex_unlock(&tree_lock);
+
+	if (obj == NULL)
+	    break;
+
+	Optimize(tl, obj);
+    }
+
+    free(tl);
+    return (NULL);
+}
+
+/*
+ * Level_nodes()
+ *
+ * Add the composites at the given depth under the given object to the work
+ * list. Branches which end above that depth are left to Optimize_top().
+ */
+
+static void Level_nodes(OBJECT *obj, int depth)
+{
+    COMPOSITE      *cd;
+    int             i;
+
+    if (obj->type != T_COMPOSITE)
+	return;
+
+    if (depth == 0)
+    {
+	work[nwork++] = obj;
+	return;
+    }
+
+    cd = (COMPOSITE *) obj->obj;
+    for (i = 0; i < cd->num; i++)
+	Level_nodes(cd->child[i], depth - 1);
+}
+
+/*
+ * Renumber()
+ *
+ * Put the composites under the given object back into the object list,
+ * each one after its children, the way the builders leave them.
+ */
+
+static void Renumber(OBJECT *obj)
+{
+    COMPOSITE      *cd;
+    int             i;
+
+    if (obj->type != T_COMPOSITE)
+	return;
+
+    cd = (COMPOSITE *) obj->obj;
+    for (i = 0; i < cd->num; i++)
+	Renumber(cd->child[i]);
+
+    if (nobjects == MAX_PRIMS)
+    {
+	fprintf(stderr, "%s: too many primitives, max is %d\n",
+		my_name, MAX_PRIMS);
+	exit(1);
+    }
+
+    objects[nobjects++] = obj;
+}
+
+/*
+ * Optimize_treelets()
+ *
+ * Run the given number of treelet passes over the hierarchy. The subtrees
+ * at the first depth with enough of them to go around are shared out
+ * between num_threads threads. The part above them is done after.
+ */
+
+void Optimize_treelets(int passes)
+{
+    pthread_t      *threads;
+    TREELET        *tl;
+    double          before;
+    int             depth, nprims, i, p;
+
+    if (root->type != T_COMPOSITE)
+	return;
+
+    for (nprims = 0; nprims < nobjects; nprims++)
+	if (objects[nprims]->type == T_COMPOSITE)
+	    break;
+
+    before = Sah_cost(root);
+    spare = MAX_PRIMS - nobjects;
+
+    if ((work = (OBJECT **) malloc(sizeof(OBJECT *) * MAX_PRIMS)) == NULL ||
+	(threads = (pthread_t *) malloc(sizeof(pthread_t) *
+					num_threads)) == NULL ||
+	(tl = (TREELET *) malloc(sizeof(TREELET))) == NULL)
+    {
+	fprintf(stderr, "%s: malloc failed\n", my_name);
+	exit(1);
+    }
+
+    for (p = 0; p < passes; p++)
+    {
+	depth = 0;
+	nwork = 0;
+
+	if (num_threads > 1)
+	{
+	    do
+	    {
+		++depth;
+		nwork = 0;
+		Level_nodes(root, depth);
+	    } while (nwork > 0 && nwork < num_threads * TREELET_WORK);
+
+	    next_work = 0;
+	    for (i = 0; i < num_threads; i++)
+	    {
+		if (pthread_create(&threads[i], NULL, Worker, NULL) != 0)
+		{
+		    fprintf(stderr, "%s: can't create thread\n", my_name);
+		    exit(1);
+		}
+	    }
+
+	    for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	}
+
+	if (depth > 0)
+	    Optimize_top(tl, root, depth);
+	else
+	    Optimize(tl, root);
+    }
+
+    free(tl);
+    free(threads);
+    free(work);
+
+    /*
+     * Composites came and went, so list them again from scratch.
+     */
+
+    nobjects = nprims;
+    Renumber(root);
+
+    if (verbose)
+    {
+	fprintf(stderr, "%s: treelets: SAH cost %g -> %g, %d composites\n",
+		my_name, before, Sah_cost(root), nobjects - nprims);
+    }
+}